@@ -329,6 +329,74 @@ int str2ba(const char *str, bdaddr_t *ba);
 int ba2oui(const bdaddr_t *ba, char *oui);
 int bachk(const char *str);
 
+/* LE advertising data (AD) types */
+#define BT_AD_FLAGS			0x01
+#define BT_AD_UUID16_SOME		0x02
+#define BT_AD_UUID16_ALL		0x03
+#define BT_AD_UUID32_SOME		0x04
+#define BT_AD_UUID32_ALL		0x05
+#define BT_AD_UUID128_SOME		0x06
+#define BT_AD_UUID128_ALL		0x07
+#define BT_AD_NAME_SHORT		0x08
+#define BT_AD_NAME_COMPLETE		0x09
+#define BT_AD_TX_POWER			0x0a
+#define BT_AD_SERVICE_DATA16		0x16
+#define BT_AD_SERVICE_DATA32		0x20
+#define BT_AD_SERVICE_DATA128		0x21
+#define BT_AD_MANUFACTURER_DATA		0xff
+
+#define BT_AD_MAX_SERVICE_DATA		4
+#define BT_AD_MAX_MANUFACTURER_DATA	2
+
+/* A UUID list, or service or manufacturer data, pointing into the AD */
+struct bt_ad_field {
+	uint8_t type;
+	uint8_t len;
+	const uint8_t *data;
+};
+
+/*
+ * Result of bt_ad_parse(). All pointers point into the parsed buffer.
+ * For each UUID width only the first list is kept, service data starts
+ * with its UUID and manufacturer data with the company identifier.
+ */
+struct bt_ad_info {
+	int has_flags;
+	uint8_t flags;
+	int has_tx_power;
+	int8_t tx_power;
+	struct bt_ad_field name;
+	struct bt_ad_field uuid16;
+	struct bt_ad_field uuid32;
+	struct bt_ad_field uuid128;
+	uint8_t num_service_data;
+	struct bt_ad_field service_data[BT_AD_MAX_SERVICE_DATA];
+	uint8_t num_manufacturer_data;
+	struct bt_ad_field manufacturer_data[BT_AD_MAX_MANUFACTURER_DATA];
+};
+
+int bt_ad_parse(const uint8_t *data, size_t len, struct bt_ad_info *info);
+
+/* Last advertisement heard from one device */
+struct bt_adv_entry {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t used;
+	int16_t rssi;		/* Moving average, in 1/16 dBm */
+	uint64_t hash;		/* Of the advertising payload */
+	uint64_t last_seen;
+};
+
+struct bt_adv_cache;
+
+struct bt_adv_cache *bt_adv_cache_new(unsigned int size);
+void bt_adv_cache_free(struct bt_adv_cache *cache);
+int bt_adv_cache_update(struct bt_adv_cache *cache, const bdaddr_t *ba,
+				uint8_t type, const uint8_t *data, size_t len,
+				int8_t rssi, uint64_t now);
+const struct bt_adv_entry *bt_adv_cache_lookup(struct bt_adv_cache *cache,
+					const bdaddr_t *ba, uint8_t type);
+
 int baprintf(const char *format, ...);
 int bafprintf(FILE *stream, const char *format, ...);
 int basprintf(char *str, const char *format, ...);
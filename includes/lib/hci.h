@@ -2200,6 +2200,22 @@ typedef struct {
 } __attribute__ ((packed)) evt_le_long_term_key_request;
 #define EVT_LE_LTK_REQUEST_SIZE 12
 
+#define EVT_LE_ENHANCED_CONN_COMPLETE	0x0A
+typedef struct {
+	uint8_t		status;
+	uint16_t	handle;
+	uint8_t		role;
+	uint8_t		peer_bdaddr_type;
+	bdaddr_t	peer_bdaddr;
+	bdaddr_t	local_rpa;
+	bdaddr_t	peer_rpa;
+	uint16_t	interval;
+	uint16_t	latency;
+	uint16_t	supervision_timeout;
+	uint8_t		master_clock_accuracy;
+} __attribute__ ((packed)) evt_le_enhanced_connection_complete;
+#define EVT_LE_ENHANCED_CONN_COMPLETE_SIZE 30
+
 #define EVT_PHYSICAL_LINK_COMPLETE		0x40
 typedef struct {
 	uint8_t		status;
@@ -164,6 +164,12 @@ typedef struct {
 	} value;
 } bt_uuid_t;
 
+/* Constant initialisers, usable for static const bt_uuid_t objects */
+#define BT_UUID16_INIT(v)	{ .type = BT_UUID16, .value.u16 = (v) }
+#define BT_UUID32_INIT(v)	{ .type = BT_UUID32, .value.u32 = (v) }
+#define BT_UUID128_INIT(...)	{ .type = BT_UUID128,			\
+					.value.u128.data = { __VA_ARGS__ } }
+
 int bt_uuid_strcmp(const void *a, const void *b);
 
 int bt_uuid16_create(bt_uuid_t *btuuid, uint16_t value);
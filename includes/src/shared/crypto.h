@@ -25,6 +25,16 @@
 #include <stdint.h>
 
 struct bt_crypto;
+struct bt_crypto_sign_key;
+
+/* Signed message to verify, valid is set by bt_crypto_sign_att_batch() */
+struct bt_crypto_sign_msg {
+	const uint8_t *m;
+	uint16_t m_len;
+	uint32_t sign_cnt;
+	const uint8_t *signature;
+	bool valid;
+};
 
 struct bt_crypto *bt_crypto_new(void);
 
@@ -61,3 +71,15 @@ bool bt_crypto_h6(struct bt_crypto *crypto, const uint8_t w[16],
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12]);
+
+struct bt_crypto_sign_key *bt_crypto_sign_key_new(struct bt_crypto *crypto,
+							const uint8_t key[16]);
+void bt_crypto_sign_key_free(struct bt_crypto_sign_key *sign_key);
+bool bt_crypto_sign_att_key(struct bt_crypto *crypto,
+				const struct bt_crypto_sign_key *sign_key,
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12]);
+bool bt_crypto_sign_att_batch(struct bt_crypto *crypto,
+				const struct bt_crypto_sign_key *sign_key,
+				struct bt_crypto_sign_msg *msgs,
+				unsigned int num_msgs);
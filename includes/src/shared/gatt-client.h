@@ -28,10 +28,16 @@
 #define BT_GATT_UUID_SIZE 16
 
 struct bt_gatt_client;
+struct bt_gatt_client_stream;
 
 struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 							struct bt_att *att,
 							uint16_t mtu);
+struct bt_gatt_client *bt_gatt_client_new_filtered(struct gatt_db *db,
+						struct bt_att *att,
+						uint16_t mtu,
+						const bt_uuid_t *uuids,
+						unsigned int num_uuids);
 struct bt_gatt_client *bt_gatt_client_clone(struct bt_gatt_client *client);
 
 struct bt_gatt_client *bt_gatt_client_ref(struct bt_gatt_client *client);
@@ -72,6 +78,13 @@ bool bt_gatt_client_set_debug(struct bt_gatt_client *client,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
 
+bool bt_gatt_client_discover_services(struct bt_gatt_client *client,
+					const bt_uuid_t *uuids,
+					unsigned int num_uuids,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy);
+
 uint16_t bt_gatt_client_get_mtu(struct bt_gatt_client *client);
 struct gatt_db *bt_gatt_client_get_db(struct bt_gatt_client *client);
 
@@ -88,6 +101,12 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 					bt_gatt_client_read_callback_t callback,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
+unsigned int bt_gatt_client_read_long_value_buf(struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					uint8_t *buf, uint16_t size,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy);
 unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 					uint16_t *handles, uint8_t num_handles,
 					bt_gatt_client_read_callback_t callback,
@@ -99,6 +118,20 @@ unsigned int bt_gatt_client_write_without_response(
 					uint16_t value_handle,
 					bool signed_write,
 					const uint8_t *value, uint16_t length);
+struct bt_gatt_client_stream *bt_gatt_client_stream_open(
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					size_t max_in_flight);
+bool bt_gatt_client_stream_write(struct bt_gatt_client_stream *stream,
+					const uint8_t *data, size_t len,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy);
+bool bt_gatt_client_stream_get_stats(struct bt_gatt_client_stream *stream,
+						uint64_t *bytes,
+						uint64_t *bytes_per_sec);
+void bt_gatt_client_stream_close(struct bt_gatt_client_stream *stream);
+
 unsigned int bt_gatt_client_write_value(struct bt_gatt_client *client,
 					uint16_t value_handle,
 					const uint8_t *value, uint16_t length,
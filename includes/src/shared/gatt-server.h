@@ -42,6 +42,26 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					void *user_data,
 					bt_gatt_server_destroy_func_t destroy);
 
+/*
+ * Bytes of Prepare Write data queued per connection, including a small
+ * overhead per queued region. Defaults to 64 KiB, lower it to bound the
+ * memory a peer can make the server hold.
+ */
+bool bt_gatt_server_set_max_prep_size(struct bt_gatt_server *server,
+								size_t size);
+
+typedef bool (*bt_gatt_server_write_func_t)(struct bt_gatt_server *server,
+					struct gatt_db_attribute *attrib,
+					uint16_t offset, const uint8_t *value,
+					size_t len, uint8_t opcode,
+					gatt_db_attribute_write_t func,
+					void *func_data, void *user_data);
+
+bool bt_gatt_server_set_write_handler(struct bt_gatt_server *server,
+					bt_gatt_server_write_func_t callback,
+					void *user_data,
+					bt_gatt_server_destroy_func_t destroy);
+
 bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length);
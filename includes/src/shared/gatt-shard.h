@@ -0,0 +1,58 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sharded GATT server runtime: every shard runs its own mainloop on its own
+ * thread and serves the ATT bearers hashed onto it. All shards share one
+ * gatt_db; reads are served locally while writes are serialized through the
+ * owner shard (shard 0), where application write callbacks are invoked.
+ * For bearers on other shards those callbacks get a NULL bt_att, since the
+ * bearer belongs to another thread's mainloop; notifications have to be
+ * sent from the shard serving the bearer, e.g. in the attach callback.
+ */
+struct bt_gatt_shards;
+
+typedef void (*bt_gatt_shards_attach_func_t)(struct bt_gatt_server *server,
+							unsigned int shard,
+							void *user_data);
+typedef void (*bt_gatt_shards_destroy_func_t)(void *user_data);
+
+struct bt_gatt_shards *bt_gatt_shards_new(struct gatt_db *db,
+						unsigned int num_shards,
+						uint16_t mtu,
+						uint8_t min_enc_size);
+void bt_gatt_shards_free(struct bt_gatt_shards *shards);
+
+bool bt_gatt_shards_set_attach_handler(struct bt_gatt_shards *shards,
+					bt_gatt_shards_attach_func_t callback,
+					void *user_data,
+					bt_gatt_shards_destroy_func_t destroy);
+
+bool bt_gatt_shards_start(struct bt_gatt_shards *shards);
+
+int bt_gatt_shards_attach(struct bt_gatt_shards *shards, int fd);
+
+unsigned int bt_gatt_shards_get_count(struct bt_gatt_shards *shards);
+unsigned int bt_gatt_shards_get_connections(struct bt_gatt_shards *shards,
+							unsigned int shard);
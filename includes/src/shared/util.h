@@ -99,13 +99,43 @@ void *btd_malloc(size_t size);
 
 typedef void (*util_debug_func_t)(const char *str, void *user_data);
 
-void util_debug(util_debug_func_t function, void *user_data,
+void util_debug_print(util_debug_func_t function, void *user_data,
 						const char *format, ...)
 					__attribute__((format(printf, 3, 4)));
 
-void util_hexdump(const char dir, const unsigned char *buf, size_t len,
+void util_hexdump_print(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data);
 
+/*
+ * Debug output compiled in: 0 none, 1 messages, 2 messages and PDU dumps.
+ * The build sets it from the VERBOSE option.
+ */
+#ifndef UTIL_DEBUG_LEVEL
+#define UTIL_DEBUG_LEVEL 2
+#endif
+
+/*
+ * Only evaluate the arguments and make the call when a debug callback is
+ * set. Compiled-out levels still type check the arguments.
+ */
+#define util_debug_enabled(function) \
+	(UTIL_DEBUG_LEVEL >= 1 && __builtin_expect(!!(function), 0))
+
+#define util_debug(function, user_data, ...)				\
+	do {								\
+		if (util_debug_enabled(function))			\
+			util_debug_print((function), (user_data),	\
+							__VA_ARGS__);	\
+	} while (0)
+
+#define util_hexdump(dir, buf, len, function, user_data)		\
+	do {								\
+		if (UTIL_DEBUG_LEVEL >= 2 &&				\
+					util_debug_enabled(function))	\
+			util_hexdump_print((dir), (buf), (len),		\
+						(function), (user_data));	\
+	} while (0)
+
 unsigned char util_get_dt(const char *parent, const char *name);
 
 uint8_t util_get_uid(unsigned int *bitmap, uint8_t max);
@@ -37,7 +37,7 @@
 #include <sys/socket.h>
 
 #include "bluetooth.h"
-#include "hci.h"
+#include "lib/hci.h"
 
 void baswap(bdaddr_t *dst, const bdaddr_t *src)
 {
@@ -49,15 +49,37 @@ void baswap(bdaddr_t *dst, const bdaddr_t *src)
 		d[i] = s[5-i];
 }
 
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/*
+ * Write len bytes, starting at src and advancing by step, as pairs of upper
+ * case hex digits separated by sep, followed by a terminating NUL.
+ */
+static int hex_sep(char *str, const uint8_t *src, int step, int len, char sep)
+{
+	char *p = str;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		uint8_t b = src[i * step];
+
+		*p++ = hex_digits[b >> 4];
+		*p++ = hex_digits[b & 0x0f];
+		*p++ = sep;
+	}
+
+	p[-1] = '\0';
+
+	return p - 1 - str;
+}
+
 char *batostr(const bdaddr_t *ba)
 {
 	char *str = bt_malloc(18);
 	if (!str)
 		return NULL;
 
-	sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
-		ba->b[0], ba->b[1], ba->b[2],
-		ba->b[3], ba->b[4], ba->b[5]);
+	hex_sep(str, ba->b, 1, 6, ':');
 
 	return str;
 }
@@ -77,8 +99,7 @@ bdaddr_t *strtoba(const char *str)
 
 int ba2str(const bdaddr_t *ba, char *str)
 {
-	return sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
-		ba->b[5], ba->b[4], ba->b[3], ba->b[2], ba->b[1], ba->b[0]);
+	return hex_sep(str, &ba->b[5], -1, 6, ':');
 }
 
 int str2ba(const char *str, bdaddr_t *ba)
@@ -98,7 +119,7 @@ int str2ba(const char *str, bdaddr_t *ba)
 
 int ba2oui(const bdaddr_t *ba, char *str)
 {
-	return sprintf(str, "%2.2X-%2.2X-%2.2X", ba->b[5], ba->b[4], ba->b[3]);
+	return hex_sep(str, &ba->b[5], -1, 3, '-');
 }
 
 int bachk(const char *str)
@@ -126,6 +147,284 @@ int bachk(const char *str)
 	return 0;
 }
 
+enum {
+	AD_SKIP,
+	AD_FLAGS,
+	AD_UUIDS,
+	AD_NAME,
+	AD_TX_POWER,
+	AD_SERVICE_DATA,
+	AD_MANUFACTURER_DATA,
+};
+
+/* How each AD type is stored, its minimum length and its element size */
+static const struct {
+	uint8_t kind;
+	uint8_t min_len;
+	uint8_t unit;
+} ad_rules[256] = {
+	[BT_AD_FLAGS]			= { AD_FLAGS, 1, 1 },
+	[BT_AD_UUID16_SOME]		= { AD_UUIDS, 0, 2 },
+	[BT_AD_UUID16_ALL]		= { AD_UUIDS, 0, 2 },
+	[BT_AD_UUID32_SOME]		= { AD_UUIDS, 0, 4 },
+	[BT_AD_UUID32_ALL]		= { AD_UUIDS, 0, 4 },
+	[BT_AD_UUID128_SOME]		= { AD_UUIDS, 0, 16 },
+	[BT_AD_UUID128_ALL]		= { AD_UUIDS, 0, 16 },
+	[BT_AD_NAME_SHORT]		= { AD_NAME, 0, 1 },
+	[BT_AD_NAME_COMPLETE]		= { AD_NAME, 0, 1 },
+	[BT_AD_TX_POWER]		= { AD_TX_POWER, 1, 1 },
+	[BT_AD_SERVICE_DATA16]		= { AD_SERVICE_DATA, 2, 1 },
+	[BT_AD_SERVICE_DATA32]		= { AD_SERVICE_DATA, 4, 1 },
+	[BT_AD_SERVICE_DATA128]		= { AD_SERVICE_DATA, 16, 1 },
+	[BT_AD_MANUFACTURER_DATA]	= { AD_MANUFACTURER_DATA, 2, 1 },
+};
+
+static struct bt_ad_field *ad_uuid_list(struct bt_ad_info *info, uint8_t type)
+{
+	switch (type) {
+	case BT_AD_UUID16_SOME:
+	case BT_AD_UUID16_ALL:
+		return &info->uuid16;
+	case BT_AD_UUID32_SOME:
+	case BT_AD_UUID32_ALL:
+		return &info->uuid32;
+	default:
+		return &info->uuid128;
+	}
+}
+
+static void ad_field_set(struct bt_ad_field *field, uint8_t type,
+					const uint8_t *data, uint8_t len)
+{
+	field->type = type;
+	field->data = data;
+	field->len = len;
+}
+
+/*
+ * Parse advertising or scan response data in place. Fields that are too
+ * short or of an unknown type are skipped, a field running past the end
+ * of the buffer stops parsing with -EBADMSG.
+ */
+int bt_ad_parse(const uint8_t *data, size_t len, struct bt_ad_info *info)
+{
+	size_t i = 0;
+
+	memset(info, 0, sizeof(*info));
+
+	while (i < len) {
+		uint8_t field_len = data[i];
+		const uint8_t *field;
+		struct bt_ad_field *list;
+		uint8_t type, flen, n;
+
+		/* Zero length marks the end of the significant part */
+		if (!field_len)
+			return 0;
+
+		if (field_len > len - i - 1)
+			return -EBADMSG;
+
+		type = data[i + 1];
+		field = data + i + 2;
+		flen = field_len - 1;
+		i += field_len + 1;
+
+		if (ad_rules[type].kind == AD_SKIP)
+			continue;
+
+		if (flen < ad_rules[type].min_len || flen % ad_rules[type].unit)
+			continue;
+
+		switch (ad_rules[type].kind) {
+		case AD_FLAGS:
+			info->has_flags = 1;
+			info->flags = field[0];
+			break;
+		case AD_UUIDS:
+			list = ad_uuid_list(info, type);
+			if (!list->data)
+				ad_field_set(list, type, field, flen);
+			break;
+		case AD_NAME:
+			if (!info->name.data || type == BT_AD_NAME_COMPLETE)
+				ad_field_set(&info->name, type, field, flen);
+			break;
+		case AD_TX_POWER:
+			info->has_tx_power = 1;
+			info->tx_power = (int8_t) field[0];
+			break;
+		case AD_SERVICE_DATA:
+			n = info->num_service_data;
+			if (n == BT_AD_MAX_SERVICE_DATA)
+				break;
+
+			ad_field_set(&info->service_data[n], type, field, flen);
+			info->num_service_data++;
+			break;
+		case AD_MANUFACTURER_DATA:
+			n = info->num_manufacturer_data;
+			if (n == BT_AD_MAX_MANUFACTURER_DATA)
+				break;
+
+			ad_field_set(&info->manufacturer_data[n], type, field,
+									flen);
+			info->num_manufacturer_data++;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Slots searched for a device, inserting past them evicts the oldest */
+#define ADV_CACHE_PROBES	16
+#define ADV_CACHE_MAX		(1 << 20)
+
+/*
+ * Open addressing with linear probing. Entries are never deleted, only
+ * replaced in place, so a device is always found before the first free
+ * slot of its probe sequence.
+ */
+struct bt_adv_cache {
+	unsigned int mask;
+	struct bt_adv_entry entries[];
+};
+
+struct bt_adv_cache *bt_adv_cache_new(unsigned int size)
+{
+	struct bt_adv_cache *cache;
+	unsigned int slots = ADV_CACHE_PROBES;
+
+	if (size > ADV_CACHE_MAX)
+		return NULL;
+
+	while (slots < size)
+		slots <<= 1;
+
+	cache = bt_malloc(sizeof(*cache) +
+				slots * sizeof(struct bt_adv_entry));
+	if (!cache)
+		return NULL;
+
+	memset(cache->entries, 0, slots * sizeof(struct bt_adv_entry));
+	cache->mask = slots - 1;
+
+	return cache;
+}
+
+void bt_adv_cache_free(struct bt_adv_cache *cache)
+{
+	bt_free(cache);
+}
+
+static unsigned int adv_cache_slot(const bdaddr_t *ba, uint8_t type)
+{
+	uint64_t key = bt_get_le32(ba->b) |
+				(uint64_t) bt_get_le16(ba->b + 4) << 32 |
+				(uint64_t) type << 48;
+
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static uint64_t adv_payload_hash(const uint8_t *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+	uint64_t word;
+
+	for (; len >= 8; data += 8, len -= 8) {
+		hash = (hash ^ bt_get_le64(data)) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+
+	if (len) {
+		word = 0;
+		memcpy(&word, data, len);
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+
+	return hash;
+}
+
+/*
+ * Record an advertisement. Returns 1 for a new device or a changed
+ * payload and 0 for an unchanged repeat. Last seen time and RSSI average
+ * are updated in both cases.
+ */
+int bt_adv_cache_update(struct bt_adv_cache *cache, const bdaddr_t *ba,
+				uint8_t type, const uint8_t *data, size_t len,
+				int8_t rssi, uint64_t now)
+{
+	struct bt_adv_entry *entry, *victim = NULL;
+	unsigned int slot;
+	uint64_t hash;
+	int i;
+
+	if (!cache || !ba || (len && !data))
+		return -EINVAL;
+
+	hash = adv_payload_hash(data, len);
+	slot = adv_cache_slot(ba, type);
+
+	for (i = 0; i < ADV_CACHE_PROBES; i++) {
+		entry = &cache->entries[(slot + i) & cache->mask];
+
+		if (!entry->used) {
+			victim = entry;
+			break;
+		}
+
+		if (entry->bdaddr_type == type && !bacmp(&entry->bdaddr, ba)) {
+			entry->last_seen = now;
+			entry->rssi += (rssi * 16 - entry->rssi) / 8;
+
+			if (entry->hash == hash)
+				return 0;
+
+			entry->hash = hash;
+			return 1;
+		}
+
+		if (!victim || entry->last_seen < victim->last_seen)
+			victim = entry;
+	}
+
+	bacpy(&victim->bdaddr, ba);
+	victim->bdaddr_type = type;
+	victim->used = 1;
+	victim->rssi = rssi * 16;
+	victim->hash = hash;
+	victim->last_seen = now;
+
+	return 1;
+}
+
+const struct bt_adv_entry *bt_adv_cache_lookup(struct bt_adv_cache *cache,
+					const bdaddr_t *ba, uint8_t type)
+{
+	unsigned int slot;
+	int i;
+
+	if (!cache || !ba)
+		return NULL;
+
+	slot = adv_cache_slot(ba, type);
+
+	for (i = 0; i < ADV_CACHE_PROBES; i++) {
+		struct bt_adv_entry *entry;
+
+		entry = &cache->entries[(slot + i) & cache->mask];
+		if (!entry->used)
+			break;
+
+		if (entry->bdaddr_type == type && !bacmp(&entry->bdaddr, ba))
+			return entry;
+	}
+
+	return NULL;
+}
+
 int baprintf(const char *format, ...)
 {
 	va_list ap;
@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
+#include <time.h>
 
 #include <sys/param.h>
 #include <sys/uio.h>
@@ -42,8 +43,8 @@
 #include <sys/socket.h>
 
 #include "bluetooth.h"
-#include "hci.h"
-#include "hci_lib.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -1117,6 +1118,16 @@ int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
 	return 0;
 }
 
+static int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+				(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
 int hci_send_req(int dd, struct hci_request *r, int to)
 {
 	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
@@ -1124,6 +1135,7 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 	struct hci_filter nf, of;
 	socklen_t olen;
 	hci_event_hdr *hdr;
+	struct timespec start;
 	int err, try;
 
 	olen = sizeof(of);
@@ -1143,6 +1155,8 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 	if (hci_send_cmd(dd, r->ogf, r->ocf, r->clen, r->cparam) < 0)
 		goto failed;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	try = 10;
 	while (try--) {
 		evt_cmd_complete *cc;
@@ -1154,10 +1168,17 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 
 		if (to) {
 			struct pollfd p;
-			int n;
+			int n, left;
+
+			/* The timeout covers the whole request, not each read */
+			left = to - elapsed_ms(&start);
+			if (left <= 0) {
+				errno = ETIMEDOUT;
+				goto failed;
+			}
 
 			p.fd = dd; p.events = POLLIN;
-			while ((n = poll(&p, 1, to)) < 0) {
+			while ((n = poll(&p, 1, left)) < 0) {
 				if (errno == EAGAIN || errno == EINTR)
 					continue;
 				goto failed;
@@ -1167,11 +1188,6 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 				errno = ETIMEDOUT;
 				goto failed;
 			}
-
-			to -= 10;
-			if (to < 0)
-				to = 0;
-
 		}
 
 		while ((len = read(dd, buf, sizeof(buf))) < 0) {
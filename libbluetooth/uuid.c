@@ -93,7 +93,57 @@ void bt_uuid_to_uuid128(const bt_uuid_t *src, bt_uuid_t *dst)
 
 static int bt_uuid128_cmp(const bt_uuid_t *u1, const bt_uuid_t *u2)
 {
-	return memcmp(&u1->value.u128, &u2->value.u128, sizeof(uint128_t));
+	const uint8_t *d1 = u1->value.u128.data, *d2 = u2->value.u128.data;
+	uint64_t a, b;
+
+	/* Big-endian halves order the same way as memcmp */
+	a = bt_get_be64(d1);
+	b = bt_get_be64(d2);
+	if (a == b) {
+		a = bt_get_be64(d1 + 8);
+		b = bt_get_be64(d2 + 8);
+	}
+
+	return (a > b) - (a < b);
+}
+
+/*
+ * Canonical short form: 16 and 32-bit UUIDs, as well as 128-bit UUIDs
+ * built on the Bluetooth Base UUID, are represented by the 32-bit value
+ * they carry in octets 0-3 of the 128-bit form.
+ */
+static int bt_uuid_short_value(const bt_uuid_t *uuid, uint32_t *value)
+{
+	switch (uuid->type) {
+	case BT_UUID16:
+		*value = uuid->value.u16;
+		return 1;
+	case BT_UUID32:
+		*value = uuid->value.u32;
+		return 1;
+	case BT_UUID128:
+		if (memcmp(&uuid->value.u128.data[4],
+					&bluetooth_base_uuid.data[4], 12))
+			return 0;
+
+		*value = bt_get_be32(uuid->value.u128.data);
+		return 1;
+	case BT_UUID_UNSPEC:
+	default:
+		return 0;
+	}
+}
+
+/* Compares a base UUID short value against a non-base 128-bit UUID */
+static int bt_uuid_short_cmp128(uint32_t value, const bt_uuid_t *uuid)
+{
+	uint32_t prefix = bt_get_be32(uuid->value.u128.data);
+
+	if (value != prefix)
+		return (value > prefix) - (value < prefix);
+
+	return memcmp(&bluetooth_base_uuid.data[4], &uuid->value.u128.data[4],
+									12);
 }
 
 int bt_uuid16_create(bt_uuid_t *btuuid, uint16_t value)
@@ -125,12 +175,61 @@ int bt_uuid128_create(bt_uuid_t *btuuid, uint128_t value)
 
 int bt_uuid_cmp(const bt_uuid_t *uuid1, const bt_uuid_t *uuid2)
 {
-	bt_uuid_t u1, u2;
+	uint32_t v1, v2;
+	int short1, short2;
+
+	/* Common case, nothing to normalize */
+	if (uuid1->type == BT_UUID16 && uuid2->type == BT_UUID16)
+		return (uuid1->value.u16 > uuid2->value.u16) -
+					(uuid1->value.u16 < uuid2->value.u16);
+
+	/* Unset UUIDs sort first */
+	if (uuid1->type == BT_UUID_UNSPEC || uuid2->type == BT_UUID_UNSPEC)
+		return (uuid1->type != BT_UUID_UNSPEC) -
+					(uuid2->type != BT_UUID_UNSPEC);
+
+	short1 = bt_uuid_short_value(uuid1, &v1);
+	short2 = bt_uuid_short_value(uuid2, &v2);
+
+	if (short1 && short2)
+		return (v1 > v2) - (v1 < v2);
+
+	if (short1)
+		return bt_uuid_short_cmp128(v1, uuid2);
 
-	bt_uuid_to_uuid128(uuid1, &u1);
-	bt_uuid_to_uuid128(uuid2, &u2);
+	if (short2)
+		return -bt_uuid_short_cmp128(v2, uuid1);
 
-	return bt_uuid128_cmp(&u1, &u2);
+	return bt_uuid128_cmp(uuid1, uuid2);
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+static const char base_suffix[] = "-0000-1000-8000-00805f9b34fb";
+
+static void uuid128_format(const uint8_t *data, char *p)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*p++ = '-';
+
+		*p++ = hex_digits[data[i] >> 4];
+		*p++ = hex_digits[data[i] & 0x0f];
+	}
+
+	*p = '\0';
+}
+
+/* 16 and 32 bit UUIDs only differ from the base UUID in the first field */
+static void uuid32_format(uint32_t val, char *p)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, val >>= 4)
+		p[i] = hex_digits[val & 0x0f];
+
+	memcpy(p + 8, base_suffix, sizeof(base_suffix));
 }
 
 /*
@@ -138,35 +237,35 @@ int bt_uuid_cmp(const bt_uuid_t *uuid1, const bt_uuid_t *uuid2)
  */
 int bt_uuid_to_string(const bt_uuid_t *uuid, char *str, size_t n)
 {
-	bt_uuid_t tmp;
-	unsigned int   data0;
-	unsigned short data1;
-	unsigned short data2;
-	unsigned short data3;
-	unsigned int   data4;
-	unsigned short data5;
-	const uint8_t *data;
+	char buf[MAX_LEN_UUID_STR];
+	char *p = n < sizeof(buf) ? buf : str;
 
 	if (!uuid || uuid->type == BT_UUID_UNSPEC) {
 		snprintf(str, n, "NULL");
 		return -EINVAL;
 	}
 
-	/* Convert to 128 Bit format */
-	bt_uuid_to_uuid128(uuid, &tmp);
-	data = (uint8_t *) &tmp.value.u128;
-
-	memcpy(&data0, &data[0], 4);
-	memcpy(&data1, &data[4], 2);
-	memcpy(&data2, &data[6], 2);
-	memcpy(&data3, &data[8], 2);
-	memcpy(&data4, &data[10], 4);
-	memcpy(&data5, &data[14], 2);
-
-	snprintf(str, n, "%.8x-%.4x-%.4x-%.4x-%.8x%.4x",
-				ntohl(data0), ntohs(data1),
-				ntohs(data2), ntohs(data3),
-				ntohl(data4), ntohs(data5));
+	switch (uuid->type) {
+	case BT_UUID16:
+		uuid32_format(uuid->value.u16, p);
+		break;
+	case BT_UUID32:
+		uuid32_format(uuid->value.u32, p);
+		break;
+	case BT_UUID128:
+		uuid128_format(uuid->value.u128.data, p);
+		break;
+	case BT_UUID_UNSPEC:
+	default:
+		snprintf(str, n, "NULL");
+		return -EINVAL;
+	}
+
+	/* Truncate like snprintf when the caller buffer is short */
+	if (p == buf && n) {
+		memcpy(str, buf, n - 1);
+		str[n - 1] = '\0';
+	}
 
 	return 0;
 }
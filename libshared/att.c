@@ -47,6 +47,9 @@
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
+/* Max signed write commands read and verified per wakeup */
+#define ATT_RECV_BATCH			8
+
 struct att_send_op;
 
 struct bt_att {
@@ -72,6 +75,9 @@ struct bt_att {
 	uint8_t *buf;
 	uint16_t mtu;
 
+	uint8_t *batch_buf;		/* Extra PDUs of a signed batch */
+	uint16_t batch_mtu;
+
 	unsigned int next_send_id;	/* IDs for "send" ops */
 	unsigned int next_reg_id;	/* IDs for registered callbacks */
 
@@ -84,6 +90,7 @@ struct bt_att {
 	void *debug_data;
 
 	struct bt_crypto *crypto;
+	bool ext_signed;		/* Signatures are checked by the owner */
 
 	struct sign_info *local_sign;
 	struct sign_info *remote_sign;
@@ -91,6 +98,7 @@ struct bt_att {
 
 struct sign_info {
 	uint8_t key[16];
+	struct bt_crypto_sign_key *cmac;  /* Expanded once per key */
 	bt_att_counter_func_t counter;
 	void *user_data;
 };
@@ -304,8 +312,9 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 	if (!sign->counter(&sign_cnt, sign->user_data))
 		goto fail;
 
-	if ((bt_crypto_sign_att(att->crypto, sign->key, op->pdu, 1 + length,
-				sign_cnt, &((uint8_t *) op->pdu)[1 + length])))
+	if ((bt_crypto_sign_att_key(att->crypto, sign->cmac, op->pdu,
+				1 + length, sign_cnt,
+				&((uint8_t *) op->pdu)[1 + length])))
 		return true;
 
 	util_debug(att->debug_callback, att->debug_data,
@@ -773,55 +782,58 @@ static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 									NULL);
 }
 
-static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
-								ssize_t pdu_len)
+static bool sign_msg_prepare(struct bt_att *att, uint8_t *pdu,
+						ssize_t pdu_len,
+						struct bt_crypto_sign_msg *msg)
 {
-	uint8_t *signature;
-	uint32_t sign_cnt;
-	struct sign_info *sign;
+	struct sign_info *sign = att->remote_sign;
 
 	/* Check if there is enough data for a signature */
-	if (pdu_len < 2 + BT_ATT_SIGNATURE_LEN)
-		goto fail;
+	if (pdu_len < 3 + BT_ATT_SIGNATURE_LEN)
+		return false;
 
-	sign = att->remote_sign;
-	if (!sign)
-		goto fail;
+	if (!sign || !sign->cmac)
+		return false;
 
-	signature = pdu + (pdu_len - BT_ATT_SIGNATURE_LEN);
-	sign_cnt = get_le32(signature);
+	/* The signature covers the opcode and the parameters */
+	msg->m = pdu;
+	msg->m_len = pdu_len - BT_ATT_SIGNATURE_LEN;
+	msg->signature = pdu + msg->m_len;
+	msg->sign_cnt = get_le32(msg->signature);
+	msg->valid = false;
 
 	/* Validate counter */
-	if (!sign->counter(&sign_cnt, sign->user_data))
+	return sign->counter(&msg->sign_cnt, sign->user_data);
+}
+
+static bool handle_signed(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
+{
+	struct bt_crypto_sign_msg msg;
+
+	if (!sign_msg_prepare(att, pdu, pdu_len, &msg))
 		goto fail;
 
 	/* Generate signature and verify it */
-	if (!bt_crypto_sign_att(att->crypto, sign->key, pdu,
-				pdu_len - BT_ATT_SIGNATURE_LEN, sign_cnt,
-				signature))
+	if (!bt_crypto_sign_att_batch(att->crypto, att->remote_sign->cmac,
+								&msg, 1))
 		goto fail;
 
-	return true;
+	if (msg.valid)
+		return true;
 
 fail:
 	util_debug(att->debug_callback, att->debug_data,
-			"ATT failed to verify signature: 0x%02x", opcode);
+			"ATT failed to verify signature: 0x%02x", pdu[0]);
 
 	return false;
 }
 
-static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
+static void notify_pdu(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
 	const struct queue_entry *entry;
 	bool found;
 
-	if ((opcode & ATT_OP_SIGNED_MASK) && !att->crypto) {
-		if (!handle_signed(att, opcode, pdu, pdu_len))
-			return;
-		pdu_len -= BT_ATT_SIGNATURE_LEN;
-	}
-
 	bt_att_ref(att);
 
 	found = false;
@@ -856,39 +868,42 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	bt_att_unref(att);
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
+								ssize_t pdu_len)
 {
-	struct bt_att *att = user_data;
-	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t bytes_read;
+	/*
+	 * Signed PDUs are passed on with their signature only if the owner
+	 * checks it, without crypto to verify them they are dropped.
+	 */
+	if ((opcode & ATT_OP_SIGNED_MASK) && !att->ext_signed) {
+		if (!att->crypto || !handle_signed(att, pdu - 1, pdu_len + 1))
+			return;
+		pdu_len -= BT_ATT_SIGNATURE_LEN;
+	}
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
-	if (bytes_read < 0)
-		return false;
+	notify_pdu(att, opcode, pdu, pdu_len);
+}
 
-	util_hexdump('>', att->buf, bytes_read,
-					att->debug_callback, att->debug_data);
+static bool handle_pdu(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
+{
+	uint8_t opcode;
 
-	if (bytes_read < ATT_MIN_PDU_LEN)
+	if (pdu_len < ATT_MIN_PDU_LEN)
 		return true;
 
-	pdu = att->buf;
 	opcode = pdu[0];
 
-	bt_att_ref(att);
-
 	/* Act on the received PDU based on the opcode type */
 	switch (get_op_type(opcode)) {
 	case ATT_OP_TYPE_RSP:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT response received: 0x%02x", opcode);
-		handle_rsp(att, opcode, pdu + 1, bytes_read - 1);
+		handle_rsp(att, opcode, pdu + 1, pdu_len - 1);
 		break;
 	case ATT_OP_TYPE_CONF:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT confirmation received: 0x%02x", opcode);
-		handle_conf(att, pdu + 1, bytes_read - 1);
+		handle_conf(att, pdu + 1, pdu_len - 1);
 		break;
 	case ATT_OP_TYPE_REQ:
 		/*
@@ -901,7 +916,6 @@ static bool can_read_data(struct io *io, void *user_data)
 					"Received request while another is "
 					"pending: 0x%02x", opcode);
 			io_shutdown(att->io);
-			bt_att_unref(att);
 
 			return false;
 		}
@@ -919,15 +933,126 @@ static bool can_read_data(struct io *io, void *user_data)
 		 */
 		util_debug(att->debug_callback, att->debug_data,
 					"ATT PDU received: 0x%02x", opcode);
-		handle_notify(att, opcode, pdu + 1, bytes_read - 1);
+		handle_notify(att, opcode, pdu + 1, pdu_len - 1);
 		break;
 	}
 
-	bt_att_unref(att);
+	return true;
+}
+
+static bool is_signed_write(const uint8_t *pdu, ssize_t pdu_len)
+{
+	return pdu_len >= ATT_MIN_PDU_LEN &&
+					pdu[0] == BT_ATT_OP_SIGNED_WRITE_CMD;
+}
+
+/*
+ * A peer flooding signed write commands gets them read in batches: the
+ * ones already queued on the socket are drained, verified together and
+ * then dispatched in order, followed by the first PDU of another kind.
+ */
+static bool handle_signed_batch(struct bt_att *att, ssize_t pdu_len)
+{
+	struct bt_crypto_sign_msg msgs[ATT_RECV_BATCH];
+	uint8_t *pdus[ATT_RECV_BATCH];
+	ssize_t lens[ATT_RECV_BATCH];
+	bool valid[ATT_RECV_BATCH];
+	unsigned int num = 1, num_signed, num_msgs = 0, i;
+
+	pdus[0] = att->buf;
+	lens[0] = pdu_len;
+
+	if (att->batch_mtu < att->mtu) {
+		free(att->batch_buf);
+		att->batch_buf = malloc((ATT_RECV_BATCH - 1) * att->mtu);
+		att->batch_mtu = att->batch_buf ? att->mtu : 0;
+	}
+
+	while (att->batch_buf && num < ATT_RECV_BATCH) {
+		uint8_t *buf = att->batch_buf + (num - 1) * att->batch_mtu;
+		ssize_t len;
+
+		len = recv(att->fd, buf, att->mtu, MSG_DONTWAIT);
+		if (len <= 0)
+			break;
+
+		util_hexdump('>', buf, len, att->debug_callback,
+							att->debug_data);
+
+		pdus[num] = buf;
+		lens[num++] = len;
+
+		if (!is_signed_write(buf, len))
+			break;
+	}
+
+	num_signed = num;
+	if (!is_signed_write(pdus[num - 1], lens[num - 1]))
+		num_signed--;
+
+	/* Counters are checked in arrival order, signatures all at once */
+	for (i = 0; i < num_signed; i++) {
+		valid[i] = sign_msg_prepare(att, pdus[i], lens[i],
+							&msgs[num_msgs]);
+		if (valid[i])
+			num_msgs++;
+	}
+
+	if (num_msgs)
+		bt_crypto_sign_att_batch(att->crypto, att->remote_sign->cmac,
+							msgs, num_msgs);
+
+	for (i = 0, num_msgs = 0; i < num_signed; i++) {
+		if (valid[i])
+			valid[i] = msgs[num_msgs++].valid;
+
+		if (!valid[i]) {
+			util_debug(att->debug_callback, att->debug_data,
+					"ATT failed to verify signature: "
+					"0x%02x", pdus[i][0]);
+			continue;
+		}
+
+		util_debug(att->debug_callback, att->debug_data,
+				"ATT PDU received: 0x%02x", pdus[i][0]);
+		notify_pdu(att, pdus[i][0], pdus[i] + 1,
+					lens[i] - 1 - BT_ATT_SIGNATURE_LEN);
+	}
+
+	if (num_signed < num)
+		return handle_pdu(att, pdus[num - 1], lens[num - 1]);
 
 	return true;
 }
 
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_att *att = user_data;
+	ssize_t bytes_read;
+	bool ret;
+
+	bytes_read = read(att->fd, att->buf, att->mtu);
+	if (bytes_read < 0)
+		return false;
+
+	util_hexdump('>', att->buf, bytes_read,
+					att->debug_callback, att->debug_data);
+
+	if (bytes_read < ATT_MIN_PDU_LEN)
+		return true;
+
+	bt_att_ref(att);
+
+	if (is_signed_write(att->buf, bytes_read) && att->crypto)
+		ret = handle_signed_batch(att, bytes_read);
+	else
+		ret = handle_pdu(att, att->buf, bytes_read);
+
+	bt_att_unref(att);
+
+	return ret;
+}
+
 static bool is_io_l2cap_based(int fd)
 {
 	int domain;
@@ -953,6 +1078,15 @@ static bool is_io_l2cap_based(int fd)
 	return proto == BTPROTO_L2CAP;
 }
 
+static void sign_info_free(struct sign_info *sign)
+{
+	if (!sign)
+		return;
+
+	bt_crypto_sign_key_free(sign->cmac);
+	free(sign);
+}
+
 static void bt_att_free(struct bt_att *att)
 {
 	if (att->pending_req)
@@ -976,10 +1110,11 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
-	free(att->local_sign);
-	free(att->remote_sign);
+	sign_info_free(att->local_sign);
+	sign_info_free(att->remote_sign);
 
 	free(att->buf);
+	free(att->batch_buf);
 
 	free(att);
 }
@@ -1011,6 +1146,7 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 		goto fail;
 
 	/* crypto is optional, if not available leave it NULL */
+	att->ext_signed = ext_signed;
 	if (!ext_signed)
 		att->crypto = bt_crypto_new();
 
@@ -1090,6 +1226,14 @@ int bt_att_get_fd(struct bt_att *att)
 	return att->fd;
 }
 
+bool bt_att_is_connected(struct bt_att *att)
+{
+	if (!att)
+		return false;
+
+	return att->io != NULL;
+}
+
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy)
 {
@@ -1512,8 +1656,9 @@ void bt_att_set_enc_key_size(struct bt_att *att, uint8_t enc_size)
 	att->enc_size = enc_size;
 }
 
-static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
-				bt_att_counter_func_t func, void *user_data)
+static bool sign_set_key(struct bt_att *att, struct sign_info **sign,
+				uint8_t key[16], bt_att_counter_func_t func,
+				void *user_data)
 {
 	if (!(*sign))
 		*sign = new0(struct sign_info, 1);
@@ -1522,6 +1667,9 @@ static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
 	(*sign)->user_data = user_data;
 	memcpy((*sign)->key, key, 16);
 
+	bt_crypto_sign_key_free((*sign)->cmac);
+	(*sign)->cmac = bt_crypto_sign_key_new(att->crypto, key);
+
 	return true;
 }
 
@@ -1531,7 +1679,8 @@ bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->local_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->local_sign, sign_key, func,
+								user_data);
 }
 
 bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
@@ -1540,7 +1689,8 @@ bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->remote_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->remote_sign, sign_key, func,
+								user_data);
 }
 
 bool bt_att_has_crypto(struct bt_att *att)
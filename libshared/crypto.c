@@ -25,14 +25,22 @@
 #include <config.h>
 #endif
 
-#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/random.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AESNI
+#include <wmmintrin.h>
+#endif
 
 #include "src/shared/util.h"
 #include "src/shared/crypto.h"
 
+#ifdef USE_AF_ALG
 #ifndef HAVE_LINUX_IF_ALG_H
 #ifndef HAVE_LINUX_TYPES_H
 typedef uint8_t __u8;
@@ -71,28 +79,48 @@ struct af_alg_iv {
 #ifndef SOL_ALG
 #define SOL_ALG		279
 #endif
+#endif
 
 /* Maximum message length that can be passed to aes_cmac */
 #define CMAC_MSG_MAX	80
 
+/* Random bytes fetched from the kernel at a time */
+#define RANDOM_POOL_SIZE	4096
+
 struct bt_crypto {
 	int ref_count;
+	uint8_t pool[RANDOM_POOL_SIZE];
+	size_t pool_len;	/* Unused bytes at the start of pool */
+#ifdef USE_AF_ALG
 	int ecb_aes;
-	int urandom;
 	int cmac_aes;
+#endif
 };
 
-static int urandom_setup(void)
+static bool random_pool_fill(struct bt_crypto *crypto)
 {
-	int fd;
+	size_t len = 0;
+	ssize_t ret;
 
-	fd = open("/dev/urandom", O_RDONLY);
-	if (fd < 0)
-		return -1;
+	while (len < sizeof(crypto->pool)) {
+		ret = getrandom(crypto->pool + len, sizeof(crypto->pool) - len,
+									0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 
-	return fd;
+			return false;
+		}
+
+		len += ret;
+	}
+
+	crypto->pool_len = len;
+
+	return true;
 }
 
+#ifdef USE_AF_ALG
 static int ecb_aes_setup(void)
 {
 	struct sockaddr_alg salg;
@@ -137,32 +165,414 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
+static int alg_new(int fd, const void *keyval, socklen_t keylen)
+{
+	if (setsockopt(fd, SOL_ALG, ALG_SET_KEY, keyval, keylen) < 0)
+		return -1;
+
+	/* FIXME: This should use accept4() with SOCK_CLOEXEC */
+	return accept(fd, NULL, 0);
+}
+
+static bool alg_encrypt(int fd, const void *inbuf, size_t inlen,
+						void *outbuf, size_t outlen)
+{
+	__u32 alg_op = ALG_OP_ENCRYPT;
+	char cbuf[CMSG_SPACE(sizeof(alg_op))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(alg_op));
+	memcpy(CMSG_DATA(cmsg), &alg_op, sizeof(alg_op));
+
+	iov.iov_base = (void *) inbuf;
+	iov.iov_len = inlen;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	len = sendmsg(fd, &msg, 0);
+	if (len < 0)
+		return false;
+
+	len = read(fd, outbuf, outlen);
+	if (len < 0)
+		return false;
+
+	return true;
+}
+#endif
+
+/*
+ * In-process AES-128, used unless the library is built to go through the
+ * kernel AF_ALG interface. AES-NI is used when the CPU provides it, the
+ * portable code is constant time: the S-box is computed as the GF(2^8)
+ * inverse followed by the affine transform, on eight bytes at a time, so
+ * there are no key or data dependent table lookups or branches.
+ */
+struct aes_ctx {
+	uint8_t rk[11 * 16];
+};
+
+#define LANES(x)	((x) * 0x0101010101010101ULL)
+
+static uint64_t gf_xtime(uint64_t a)
+{
+	return ((a & LANES(0x7f)) << 1) ^ (((a >> 7) & LANES(0x01)) * 0x1b);
+}
+
+static uint64_t gf_mul(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r ^= a & (((b >> i) & LANES(0x01)) * 0xff);
+		a = gf_xtime(a);
+	}
+
+	return r;
+}
+
+static uint64_t gf_rotl(uint64_t a, int n)
+{
+	return ((a << n) & LANES((0xff << n) & 0xff)) |
+					((a >> (8 - n)) & LANES(0xff >> (8 - n)));
+}
+
+static uint64_t aes_sbox_lanes(uint64_t x)
+{
+	uint64_t x2, x3, x12, y;
+
+	/* x^254 is the multiplicative inverse, with 0 mapping to 0 */
+	x2 = gf_mul(x, x);
+	x3 = gf_mul(x2, x);
+	x12 = gf_mul(x3, x3);
+	x12 = gf_mul(x12, x12);
+	y = gf_mul(x12, x3);
+	y = gf_mul(y, y);
+	y = gf_mul(y, y);
+	y = gf_mul(y, y);
+	y = gf_mul(y, y);
+	y = gf_mul(y, x12);
+	y = gf_mul(y, x2);
+
+	return y ^ gf_rotl(y, 1) ^ gf_rotl(y, 2) ^ gf_rotl(y, 3) ^
+						gf_rotl(y, 4) ^ LANES(0x63);
+}
+
+static void aes_sub_bytes(uint8_t *b, size_t len)
+{
+	uint64_t w[2] = { 0, 0 };
+
+	memcpy(w, b, len);
+
+	w[0] = aes_sbox_lanes(w[0]);
+	if (len > 8)
+		w[1] = aes_sbox_lanes(w[1]);
+
+	memcpy(b, w, len);
+}
+
+static void soft_expand_key(struct aes_ctx *ctx, const uint8_t key[16])
+{
+	uint8_t *rk = ctx->rk;
+	uint8_t t[4], rcon = 0x01;
+	int i, j;
+
+	memcpy(rk, key, 16);
+
+	for (i = 16; i < (int) sizeof(ctx->rk); i += 4) {
+		memcpy(t, rk + i - 4, 4);
+
+		if (!(i % 16)) {
+			uint8_t tmp = t[0];
+
+			t[0] = t[1];
+			t[1] = t[2];
+			t[2] = t[3];
+			t[3] = tmp;
+
+			aes_sub_bytes(t, 4);
+			t[0] ^= rcon;
+			rcon = gf_xtime(rcon);
+		}
+
+		for (j = 0; j < 4; j++)
+			rk[i + j] = rk[i + j - 16] ^ t[j];
+	}
+}
+
+static void soft_encrypt(const struct aes_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16])
+{
+	uint8_t s[16], t[16];
+	int r, c, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ ctx->rk[i];
+
+	for (r = 1; r <= 10; r++) {
+		aes_sub_bytes(s, 16);
+
+		/* ShiftRows, the state is stored column by column */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[4 * c + i] = s[4 * ((c + i) % 4) + i];
+
+		for (c = 0; r < 10 && c < 4; c++) {
+			uint8_t *a = t + 4 * c;
+			uint8_t a0 = a[0], u = a[0] ^ a[1] ^ a[2] ^ a[3];
+
+			a[0] ^= u ^ (uint8_t) gf_xtime(a[0] ^ a[1]);
+			a[1] ^= u ^ (uint8_t) gf_xtime(a[1] ^ a[2]);
+			a[2] ^= u ^ (uint8_t) gf_xtime(a[2] ^ a[3]);
+			a[3] ^= u ^ (uint8_t) gf_xtime(a[3] ^ a0);
+		}
+
+		for (i = 0; i < 16; i++)
+			s[i] = t[i] ^ ctx->rk[16 * r + i];
+	}
+
+	memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AESNI
+#define AESNI	__attribute__((target("aes,sse2")))
+
+static inline AESNI __m128i aesni_expand_step(__m128i key, __m128i assist)
+{
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+	return _mm_xor_si128(key, assist);
+}
+
+#define AESNI_ROUND_KEY(rk, i, rcon) \
+	rk[i] = aesni_expand_step(rk[i - 1], \
+				_mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+static AESNI void aesni_expand_key(struct aes_ctx *ctx, const uint8_t key[16])
+{
+	__m128i rk[11];
+	int i;
+
+	rk[0] = _mm_loadu_si128((const __m128i *) key);
+	AESNI_ROUND_KEY(rk, 1, 0x01);
+	AESNI_ROUND_KEY(rk, 2, 0x02);
+	AESNI_ROUND_KEY(rk, 3, 0x04);
+	AESNI_ROUND_KEY(rk, 4, 0x08);
+	AESNI_ROUND_KEY(rk, 5, 0x10);
+	AESNI_ROUND_KEY(rk, 6, 0x20);
+	AESNI_ROUND_KEY(rk, 7, 0x40);
+	AESNI_ROUND_KEY(rk, 8, 0x80);
+	AESNI_ROUND_KEY(rk, 9, 0x1b);
+	AESNI_ROUND_KEY(rk, 10, 0x36);
+
+	for (i = 0; i < 11; i++)
+		_mm_storeu_si128((__m128i *) (ctx->rk + 16 * i), rk[i]);
+}
+
+static AESNI void aesni_encrypt(const struct aes_ctx *ctx,
+					const uint8_t in[16], uint8_t out[16])
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i b;
+	int i;
+
+	b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+						_mm_loadu_si128(rk));
+
+	for (i = 1; i < 10; i++)
+		b = _mm_aesenc_si128(b, _mm_loadu_si128(rk + i));
+
+	b = _mm_aesenclast_si128(b, _mm_loadu_si128(rk + 10));
+
+	_mm_storeu_si128((__m128i *) out, b);
+}
+
+/* Independent blocks are interleaved to keep the AES unit pipeline busy */
+static AESNI void aesni_encrypt_lanes(const struct aes_ctx *ctx,
+					uint8_t (*blocks)[16], unsigned int n)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i b0, b1, b2, b3, k;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		k = _mm_loadu_si128(rk);
+		b0 = _mm_xor_si128(_mm_loadu_si128((__m128i *) blocks[i]), k);
+		b1 = _mm_xor_si128(_mm_loadu_si128((__m128i *) blocks[i + 1]),
+									k);
+		b2 = _mm_xor_si128(_mm_loadu_si128((__m128i *) blocks[i + 2]),
+									k);
+		b3 = _mm_xor_si128(_mm_loadu_si128((__m128i *) blocks[i + 3]),
+									k);
+
+		for (r = 1; r < 10; r++) {
+			k = _mm_loadu_si128(rk + r);
+			b0 = _mm_aesenc_si128(b0, k);
+			b1 = _mm_aesenc_si128(b1, k);
+			b2 = _mm_aesenc_si128(b2, k);
+			b3 = _mm_aesenc_si128(b3, k);
+		}
+
+		k = _mm_loadu_si128(rk + 10);
+		_mm_storeu_si128((__m128i *) blocks[i],
+						_mm_aesenclast_si128(b0, k));
+		_mm_storeu_si128((__m128i *) blocks[i + 1],
+						_mm_aesenclast_si128(b1, k));
+		_mm_storeu_si128((__m128i *) blocks[i + 2],
+						_mm_aesenclast_si128(b2, k));
+		_mm_storeu_si128((__m128i *) blocks[i + 3],
+						_mm_aesenclast_si128(b3, k));
+	}
+
+	for (; i < n; i++)
+		aesni_encrypt(ctx, blocks[i], blocks[i]);
+}
+#endif
+
+static void soft_encrypt_lanes(const struct aes_ctx *ctx,
+					uint8_t (*blocks)[16], unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		soft_encrypt(ctx, blocks[i], blocks[i]);
+}
+
+static void (*aes_expand_key)(struct aes_ctx *ctx, const uint8_t key[16]);
+static void (*aes_encrypt)(const struct aes_ctx *ctx, const uint8_t in[16],
+							uint8_t out[16]);
+static void (*aes_encrypt_lanes)(const struct aes_ctx *ctx,
+					uint8_t (*blocks)[16], unsigned int n);
+static pthread_once_t aes_once = PTHREAD_ONCE_INIT;
+
+static void aes_select(void)
+{
+	aes_expand_key = soft_expand_key;
+	aes_encrypt = soft_encrypt;
+	aes_encrypt_lanes = soft_encrypt_lanes;
+
+#ifdef HAVE_AESNI
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2")) {
+		aes_expand_key = aesni_expand_key;
+		aes_encrypt = aesni_encrypt;
+		aes_encrypt_lanes = aesni_encrypt_lanes;
+	}
+#endif
+}
+
+#ifndef USE_AF_ALG
+/* Doubling in GF(2^128) as used for the CMAC subkeys (RFC 4493) */
+static void cmac_double(uint8_t k[16])
+{
+	uint8_t msb = k[0] >> 7;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		k[i] = (k[i] << 1) | (k[i + 1] >> 7);
+
+	k[15] = (k[15] << 1) ^ (0x87 & -msb);
+}
+
+static void cmac_subkeys(const struct aes_ctx *ctx, uint8_t k1[16],
+								uint8_t k2[16])
+{
+	/* K1 = double(E(K, 0)), K2 = double(K1) */
+	memset(k1, 0, 16);
+	aes_encrypt(ctx, k1, k1);
+	cmac_double(k1);
+
+	memcpy(k2, k1, 16);
+	cmac_double(k2);
+}
+
+static void aes_cmac_ctx(const struct aes_ctx *ctx, const uint8_t k1[16],
+				const uint8_t k2[16], const uint8_t *msg,
+				size_t msg_len, uint8_t mac[16])
+{
+	const uint8_t *k = k1;
+	uint8_t x[16], last[16];
+	size_t n, rem, i, j;
+
+	n = msg_len ? (msg_len + 15) / 16 : 1;
+	rem = msg_len - 16 * (n - 1);
+
+	memset(x, 0, sizeof(x));
+
+	for (i = 0; i < n - 1; i++) {
+		for (j = 0; j < 16; j++)
+			x[j] ^= msg[16 * i + j];
+
+		aes_encrypt(ctx, x, x);
+	}
+
+	memset(last, 0, sizeof(last));
+	if (rem)
+		memcpy(last, msg + 16 * (n - 1), rem);
+
+	/* Incomplete last block is padded and uses K2 */
+	if (rem < 16) {
+		last[rem] = 0x80;
+		k = k2;
+	}
+
+	for (j = 0; j < 16; j++)
+		x[j] ^= last[j] ^ k[j];
+
+	aes_encrypt(ctx, x, mac);
+}
+#endif
+
+/* CMAC state kept for a signing key that is used repeatedly */
+struct bt_crypto_sign_key {
+#ifdef USE_AF_ALG
+	int fd;
+#else
+	struct aes_ctx ctx;
+	uint8_t k1[16];
+	uint8_t k2[16];
+#endif
+};
+
 struct bt_crypto *bt_crypto_new(void)
 {
 	struct bt_crypto *crypto;
 
+	pthread_once(&aes_once, aes_select);
+
 	crypto = new0(struct bt_crypto, 1);
 
+#ifdef USE_AF_ALG
 	crypto->ecb_aes = ecb_aes_setup();
 	if (crypto->ecb_aes < 0) {
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->urandom = urandom_setup();
-	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
-	}
-
 	crypto->cmac_aes = cmac_aes_setup();
 	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
 		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
+#endif
 
 	return bt_crypto_ref(crypto);
 }
@@ -185,9 +595,13 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 	if (__sync_sub_and_fetch(&crypto->ref_count, 1))
 		return;
 
-	close(crypto->urandom);
+#ifdef USE_AF_ALG
 	close(crypto->ecb_aes);
 	close(crypto->cmac_aes);
+#endif
+
+	/* Do not leave unused random bytes behind */
+	explicit_bzero(crypto->pool, sizeof(crypto->pool));
 
 	free(crypto);
 }
@@ -195,86 +609,183 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 bool bt_crypto_random_bytes(struct bt_crypto *crypto,
 					void *buf, uint8_t num_bytes)
 {
-	ssize_t len;
-
 	if (!crypto)
 		return false;
 
-	len = read(crypto->urandom, buf, num_bytes);
-	if (len < num_bytes)
+	if (crypto->pool_len < num_bytes && !random_pool_fill(crypto))
 		return false;
 
+	/* Bytes handed out are wiped so they cannot be recovered later */
+	crypto->pool_len -= num_bytes;
+	memcpy(buf, crypto->pool + crypto->pool_len, num_bytes);
+	memset(crypto->pool + crypto->pool_len, 0, num_bytes);
+
 	return true;
 }
 
-static int alg_new(int fd, const void *keyval, socklen_t keylen)
+static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 {
-	if (setsockopt(fd, SOL_ALG, ALG_SET_KEY, keyval, keylen) < 0)
-		return -1;
+	int i;
 
-	/* FIXME: This should use accept4() with SOCK_CLOEXEC */
-	return accept(fd, NULL, 0);
+	for (i = 0; i < len; i++)
+		dst[len - 1 - i] = src[i];
 }
 
-static bool alg_encrypt(int fd, const void *inbuf, size_t inlen,
-						void *outbuf, size_t outlen)
+/* AES-128 of one block, key and data with the most significant octet first */
+static bool crypto_aes(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t in[16], uint8_t out[16])
 {
-	__u32 alg_op = ALG_OP_ENCRYPT;
-	char cbuf[CMSG_SPACE(sizeof(alg_op))];
-	struct cmsghdr *cmsg;
-	struct msghdr msg;
-	struct iovec iov;
+#ifdef USE_AF_ALG
+	int fd;
+
+	fd = alg_new(crypto->ecb_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	if (!alg_encrypt(fd, in, 16, out, 16)) {
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+#else
+	struct aes_ctx ctx;
+
+	aes_expand_key(&ctx, key);
+	aes_encrypt(&ctx, in, out);
+#endif
+
+	return true;
+}
+
+/* AES-CMAC, key, message and MAC with the most significant octet first */
+static bool crypto_cmac(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *msg, size_t msg_len,
+				uint8_t mac[16])
+{
+#ifdef USE_AF_ALG
 	ssize_t len;
+	int fd;
 
-	memset(cbuf, 0, sizeof(cbuf));
-	memset(&msg, 0, sizeof(msg));
+	fd = alg_new(crypto->cmac_aes, key, 16);
+	if (fd < 0)
+		return false;
 
-	msg.msg_control = cbuf;
-	msg.msg_controllen = sizeof(cbuf);
+	len = send(fd, msg, msg_len, 0);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_ALG;
-	cmsg->cmsg_type = ALG_SET_OP;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(alg_op));
-	memcpy(CMSG_DATA(cmsg), &alg_op, sizeof(alg_op));
+	len = read(fd, mac, 16);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
 
-	iov.iov_base = (void *) inbuf;
-	iov.iov_len = inlen;
+	close(fd);
+#else
+	struct aes_ctx ctx;
+	uint8_t k1[16], k2[16];
 
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	aes_expand_key(&ctx, key);
+	cmac_subkeys(&ctx, k1, k2);
+	aes_cmac_ctx(&ctx, k1, k2, msg, msg_len, mac);
+#endif
 
-	len = sendmsg(fd, &msg, 0);
-	if (len < 0)
+	return true;
+}
+
+struct bt_crypto_sign_key *bt_crypto_sign_key_new(struct bt_crypto *crypto,
+							const uint8_t key[16])
+{
+	struct bt_crypto_sign_key *sign_key;
+	uint8_t tmp[16];
+
+	if (!crypto)
+		return NULL;
+
+	sign_key = new0(struct bt_crypto_sign_key, 1);
+
+	/* The most significant octet of key corresponds to key[0] */
+	swap_buf(key, tmp, 16);
+
+#ifdef USE_AF_ALG
+	/* The accepted transform keeps the key for every following hash */
+	sign_key->fd = alg_new(crypto->cmac_aes, tmp, 16);
+	if (sign_key->fd < 0) {
+		free(sign_key);
+		return NULL;
+	}
+#else
+	aes_expand_key(&sign_key->ctx, tmp);
+	cmac_subkeys(&sign_key->ctx, sign_key->k1, sign_key->k2);
+#endif
+
+	return sign_key;
+}
+
+void bt_crypto_sign_key_free(struct bt_crypto_sign_key *sign_key)
+{
+	if (!sign_key)
+		return;
+
+#ifdef USE_AF_ALG
+	close(sign_key->fd);
+#endif
+
+	free(sign_key);
+}
+
+static bool sign_key_cmac(const struct bt_crypto_sign_key *sign_key,
+				const uint8_t *msg, size_t msg_len,
+				uint8_t mac[16])
+{
+#ifdef USE_AF_ALG
+	if (send(sign_key->fd, msg, msg_len, 0) < 0)
 		return false;
 
-	len = read(fd, outbuf, outlen);
-	if (len < 0)
+	if (read(sign_key->fd, mac, 16) < 0)
 		return false;
+#else
+	aes_cmac_ctx(&sign_key->ctx, sign_key->k1, sign_key->k2, msg, msg_len,
+									mac);
+#endif
 
 	return true;
 }
 
-static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
+static void sign_finish(uint8_t mac[16], uint32_t sign_cnt,
+							uint8_t signature[12])
 {
-	int i;
+	uint8_t tmp[16];
 
-	for (i = 0; i < len; i++)
-		dst[len - 1 - i] = src[i];
+	/*
+	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
+	 * be placed in the signature
+	 */
+	put_be32(sign_cnt, mac + 8);
+
+	/*
+	 * The most significant octet of hash corresponds to mac[0]  - swap it.
+	 * Then truncate in most significant bit first order to a length of
+	 * 12 octets
+	 */
+	swap_buf(mac, tmp, 16);
+	memcpy(signature, tmp + 4, 12);
 }
 
-bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+bool bt_crypto_sign_att_key(struct bt_crypto *crypto,
+				const struct bt_crypto_sign_key *sign_key,
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
-	uint8_t tmp[16], out[16];
+	uint8_t out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
 	uint8_t msg_s[msg_len];
 
-	if (!crypto)
+	if (!crypto || !sign_key)
 		return false;
 
 	memset(msg, 0, msg_len);
@@ -283,46 +794,167 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* Add sign_counter to the message */
 	put_le32(sign_cnt, msg + m_len);
 
-	/* The most significant octet of key corresponds to key[0] */
-	swap_buf(key, tmp, 16);
-
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
+	if (!sign_key_cmac(sign_key, msg_s, msg_len, out))
 		return false;
+
+	sign_finish(out, sign_cnt, signature);
+
+	return true;
+}
+
+/* Number of signatures computed side by side */
+#define SIGN_LANES	4
+
+#ifndef USE_AF_ALG
+/* Octet i of the swapped m || sign_cnt message that is fed to the CMAC */
+static uint8_t sign_msg_octet(const struct bt_crypto_sign_msg *msg,
+							size_t msg_len, size_t i)
+{
+	size_t pos = msg_len - 1 - i;
+
+	if (pos < msg->m_len)
+		return msg->m[pos];
+
+	return msg->sign_cnt >> (8 * (pos - msg->m_len));
+}
+
+/*
+ * Runs the CMAC of up to SIGN_LANES messages block by block, encrypting
+ * the current block of every message still in progress in one go.
+ */
+static void sign_cmac_lanes(const struct bt_crypto_sign_key *sign_key,
+				const struct bt_crypto_sign_msg *msgs,
+				unsigned int num, uint8_t (*macs)[16])
+{
+	uint8_t blocks[SIGN_LANES][16];
+	size_t len[SIGN_LANES], nblk[SIGN_LANES], max_blk = 0, blk, i;
+	unsigned int lane[SIGN_LANES], active, l;
+
+	for (l = 0; l < num; l++) {
+		len[l] = msgs[l].m_len + sizeof(uint32_t);
+		nblk[l] = (len[l] + 15) / 16;
+		if (nblk[l] > max_blk)
+			max_blk = nblk[l];
+
+		memset(macs[l], 0, 16);
 	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
-		return false;
+	for (blk = 0; blk < max_blk; blk++) {
+		active = 0;
+
+		for (l = 0; l < num; l++) {
+			uint8_t *x = blocks[active];
+			const uint8_t *k;
+			size_t off = 16 * blk, rem;
+
+			if (blk >= nblk[l])
+				continue;
+
+			rem = len[l] - off < 16 ? len[l] - off : 16;
+
+			memcpy(x, macs[l], 16);
+
+			for (i = 0; i < rem; i++)
+				x[i] ^= sign_msg_octet(&msgs[l], len[l],
+								off + i);
+
+			/* Last block, padded and using K2 if incomplete */
+			if (blk == nblk[l] - 1) {
+				k = sign_key->k1;
+
+				if (rem < 16) {
+					x[rem] ^= 0x80;
+					k = sign_key->k2;
+				}
+
+				for (i = 0; i < 16; i++)
+					x[i] ^= k[i];
+			}
+
+			lane[active++] = l;
+		}
+
+		aes_encrypt_lanes(&sign_key->ctx, blocks, active);
+
+		for (l = 0; l < active; l++)
+			memcpy(macs[lane[l]], blocks[l], 16);
 	}
+}
+#endif
 
-	close(fd);
+static bool sign_equal(const uint8_t a[12], const uint8_t b[12])
+{
+	uint8_t diff = 0;
+	int i;
 
-	/*
-	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
-	 * be placed in the signature
-	 */
-	put_be32(sign_cnt, out + 8);
+	/* Constant time, a mismatch must not leak its position */
+	for (i = 0; i < 12; i++)
+		diff |= a[i] ^ b[i];
 
-	/*
-	 * The most significant octet of hash corresponds to out[0]  - swap it.
-	 * Then truncate in most significant bit first order to a length of
-	 * 12 octets
-	 */
-	swap_buf(out, tmp, 16);
-	memcpy(signature, tmp + 4, 12);
+	return !diff;
+}
+
+bool bt_crypto_sign_att_batch(struct bt_crypto *crypto,
+				const struct bt_crypto_sign_key *sign_key,
+				struct bt_crypto_sign_msg *msgs,
+				unsigned int num_msgs)
+{
+	uint8_t sig[12];
+	unsigned int i, j, num;
+#ifndef USE_AF_ALG
+	uint8_t macs[SIGN_LANES][16];
+#endif
+
+	if (!crypto || !sign_key || (!msgs && num_msgs))
+		return false;
+
+	for (i = 0; i < num_msgs; i += num) {
+		struct bt_crypto_sign_msg *group = msgs + i;
+
+		num = num_msgs - i < SIGN_LANES ? num_msgs - i : SIGN_LANES;
+
+#ifdef USE_AF_ALG
+		for (j = 0; j < num; j++)
+			group[j].valid = bt_crypto_sign_att_key(crypto,
+						sign_key, group[j].m,
+						group[j].m_len,
+						group[j].sign_cnt, sig) &&
+					sign_equal(sig, group[j].signature);
+#else
+		sign_cmac_lanes(sign_key, group, num, macs);
+
+		for (j = 0; j < num; j++) {
+			sign_finish(macs[j], group[j].sign_cnt, sig);
+			group[j].valid = sign_equal(sig, group[j].signature);
+		}
+#endif
+	}
 
 	return true;
 }
+
+bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
+{
+	struct bt_crypto_sign_key *sign_key;
+	bool ret;
+
+	sign_key = bt_crypto_sign_key_new(crypto, key);
+	if (!sign_key)
+		return false;
+
+	ret = bt_crypto_sign_att_key(crypto, sign_key, m, m_len, sign_cnt,
+								signature);
+
+	bt_crypto_sign_key_free(sign_key);
+
+	return ret;
+}
+
 /*
  * Security function e
  *
@@ -340,7 +972,6 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
 	uint8_t tmp[16], in[16], out[16];
-	int fd;
 
 	if (!crypto)
 		return false;
@@ -348,24 +979,15 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
-
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
-		close(fd);
+	if (!crypto_aes(crypto, tmp, in, out))
 		return false;
-	}
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -572,34 +1194,18 @@ static bool aes_cmac(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t *msg, size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!crypto_cmac(crypto, key_msb, msg_msb, msg_len, out))
 		return false;
-	}
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -36,6 +36,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/uio.h>
 
 #ifndef MAX
@@ -51,6 +52,17 @@
 #define GATT_SVC_UUID	0x1801
 #define SVC_CHNGD_UUID	0x2a05
 
+/* Buckets of the value handle index of notify_chrcs, must be a power of 2 */
+#define NOTIFY_TABLE_SIZE 64
+
+/* Long read buffers of BT_ATT_MAX_VALUE_LEN octets kept for reuse */
+#define READ_BUF_POOL_SIZE 4
+
+/* Octets of Write Commands queued on the bearer by a stream by default */
+#define STREAM_DEFAULT_IN_FLIGHT 4096
+
+struct notify_chrc;
+
 struct ready_cb {
 	bt_gatt_client_callback_t callback;
 	bt_gatt_client_destroy_func_t destroy;
@@ -93,6 +105,7 @@ struct bt_gatt_client {
 	/* List of registered disconnect/notification/indication callbacks */
 	struct queue *notify_list;
 	struct queue *notify_chrcs;
+	struct notify_chrc *notify_table[NOTIFY_TABLE_SIZE];
 	int next_reg_id;
 	unsigned int disc_id, notify_id, ind_id;
 
@@ -116,8 +129,21 @@ struct bt_gatt_client {
 
 	struct bt_gatt_request *discovery_req;
 	unsigned int mtu_req_id;
+
+	/* Services of interest, NULL if all services are discovered */
+	struct queue *svc_filter;
+
+	struct queue *read_bufs;
+
+	/*
+	 * Read Requests currently in flight, shared by the client and all of
+	 * its clones. Only maintained on the root client.
+	 */
+	struct queue *shared_reads;
 };
 
+struct read_share;
+
 struct request {
 	struct bt_gatt_client *client;
 	bool long_write;
@@ -126,6 +152,7 @@ struct request {
 	int ref_count;
 	unsigned int id;
 	unsigned int att_id;
+	struct read_share *share;
 	void *data;
 	void (*destroy)(void *);
 };
@@ -183,6 +210,10 @@ struct notify_chrc {
 	 */
 	struct queue *reg_notify_queue;
 	unsigned int ccc_write_id;
+
+	/* Registered handlers of this value handle, a subset of notify_list */
+	struct queue *notify_list;
+	struct notify_chrc *next;	/* Next in the notify_table bucket */
 };
 
 struct notify_data {
@@ -274,9 +305,26 @@ static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 
 	chrc->value_handle = value_handle;
 	chrc->properties = properties;
+	chrc->notify_list = queue_new();
 
 	queue_push_tail(client->notify_chrcs, chrc);
 
+	chrc->next = client->notify_table[value_handle &
+							(NOTIFY_TABLE_SIZE - 1)];
+	client->notify_table[value_handle & (NOTIFY_TABLE_SIZE - 1)] = chrc;
+
+	return chrc;
+}
+
+static struct notify_chrc *notify_chrc_lookup(struct bt_gatt_client *client,
+							uint16_t value_handle)
+{
+	struct notify_chrc *chrc;
+
+	chrc = client->notify_table[value_handle & (NOTIFY_TABLE_SIZE - 1)];
+	while (chrc && chrc->value_handle != value_handle)
+		chrc = chrc->next;
+
 	return chrc;
 }
 
@@ -285,9 +333,24 @@ static void notify_chrc_free(void *data)
 	struct notify_chrc *chrc = data;
 
 	queue_destroy(chrc->reg_notify_queue, notify_data_unref);
+	queue_destroy(chrc->notify_list, NULL);
 	free(chrc);
 }
 
+static void notify_list_add(struct bt_gatt_client *client,
+					struct notify_data *notify_data)
+{
+	queue_push_tail(client->notify_list, notify_data);
+	queue_push_tail(notify_data->chrc->notify_list, notify_data);
+}
+
+static void notify_list_remove(struct bt_gatt_client *client,
+					struct notify_data *notify_data)
+{
+	queue_remove(client->notify_list, notify_data);
+	queue_remove(notify_data->chrc->notify_list, notify_data);
+}
+
 static bool match_notify_data_id(const void *a, const void *b)
 {
 	const struct notify_data *notify_data = a;
@@ -320,12 +383,20 @@ typedef void (*discovery_op_fail_func_t)(struct discovery_op *op);
 
 struct discovery_op {
 	struct bt_gatt_client *client;
+	struct queue *uuids;
 	struct queue *discov_ranges;
 	struct queue *pending_svcs;
 	struct queue *pending_chrcs;
+	struct queue *desc_chrcs;
 	struct queue *ext_prop_desc;
 	struct gatt_db_attribute *cur_svc;
 	bool success;
+	bool completed;
+	bool descs_done;
+	bool filtered;
+	bool incl_primary;
+	uint16_t incl_start;
+	uint16_t incl_end;
 	uint16_t start;
 	uint16_t end;
 	uint16_t last;
@@ -335,6 +406,9 @@ struct discovery_op {
 	int ref_count;
 	discovery_op_complete_func_t complete_func;
 	discovery_op_fail_func_t failure_func;
+	bt_gatt_client_callback_t callback;
+	bt_gatt_client_destroy_func_t destroy;
+	void *user_data;
 };
 
 static void discovery_op_free(struct discovery_op *op)
@@ -342,9 +416,14 @@ static void discovery_op_free(struct discovery_op *op)
 	if (op->db_id > 0)
 		gatt_db_unregister(op->client->db, op->db_id);
 
+	if (op->destroy)
+		op->destroy(op->user_data);
+
+	queue_destroy(op->uuids, free);
 	queue_destroy(op->discov_ranges, free);
 	queue_destroy(op->pending_svcs, NULL);
 	queue_destroy(op->pending_chrcs, free);
+	queue_destroy(op->desc_chrcs, free);
 	queue_destroy(op->ext_prop_desc, NULL);
 	free(op);
 }
@@ -354,6 +433,11 @@ static void discovery_op_complete(struct discovery_op *op, bool success,
 {
 	const struct queue_entry *svc;
 
+	if (op->completed)
+		return;
+
+	op->completed = true;
+
 	/*
 	 * Unregister remove callback so it is not called when clearing unused
 	 * range.
@@ -384,10 +468,38 @@ static void discovery_op_complete(struct discovery_op *op, bool success,
 	op->complete_func(op, success, err);
 }
 
+static bool match_uuid(const void *a, const void *b)
+{
+	return !bt_uuid_cmp(a, b);
+}
+
+static void copy_uuid(void *data, void *user_data)
+{
+	struct queue *uuids = user_data;
+	bt_uuid_t *uuid;
+
+	if (queue_find(uuids, match_uuid, data))
+		return;
+
+	uuid = new0(bt_uuid_t, 1);
+	*uuid = *(bt_uuid_t *) data;
+	queue_push_tail(uuids, uuid);
+}
+
 static void discovery_load_services(struct gatt_db_attribute *attr,
 							void *user_data)
 {
 	struct discovery_op *op = user_data;
+	bt_uuid_t uuid;
+
+	/* Services not looked up again must not be reported as removed */
+	if (op->filtered) {
+		if (!gatt_db_attribute_get_service_uuid(attr, &uuid))
+			return;
+
+		if (!queue_find(op->uuids, match_uuid, &uuid))
+			return;
+	}
 
 	queue_push_tail(op->pending_svcs, attr);
 }
@@ -402,6 +514,7 @@ static void discovery_service_changed(struct gatt_db_attribute *attr,
 
 static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 				uint16_t start, uint16_t end,
+				struct queue *filter,
 				discovery_op_complete_func_t complete_func,
 				discovery_op_fail_func_t failure_func)
 {
@@ -412,6 +525,7 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 	op->discov_ranges = queue_new();
 	op->pending_svcs = queue_new();
 	op->pending_chrcs = queue_new();
+	op->desc_chrcs = queue_new();
 	op->ext_prop_desc = queue_new();
 	op->client = client;
 	op->complete_func = complete_func;
@@ -422,6 +536,16 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 	op->svc_first = UINT16_MAX;
 	op->svc_last = 0;
 
+	/*
+	 * With a filter only the listed services are looked up, by UUID, and
+	 * only their handle ranges are walked.
+	 */
+	if (filter) {
+		op->filtered = true;
+		op->uuids = queue_new();
+		queue_foreach(filter, copy_uuid, op->uuids);
+	}
+
 	/* Load existing services as pending */
 	gatt_db_foreach_service_in_range(client->db, NULL,
 					 discovery_load_services, op,
@@ -435,6 +559,9 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 						discovery_service_changed,
 						op, NULL);
 
+	if (op->filtered)
+		return op;
+
 	range = new0(struct handle_range, 1);
 	range->start = start;
 	range->end = end;
@@ -476,6 +603,33 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data);
 
+static bool discover_incl_svc(struct discovery_op *op);
+
+/* Find the first include whose service has not been discovered yet */
+static bool find_missing_incl(struct discovery_op *op,
+					struct bt_gatt_result *result)
+{
+	struct bt_gatt_iter iter;
+	uint16_t handle, start, end;
+	uint128_t u128;
+
+	if (!bt_gatt_iter_init(&iter, result))
+		return false;
+
+	while (bt_gatt_iter_next_included_service(&iter, &handle, &start,
+							&end, u128.data)) {
+		if (gatt_db_get_attribute(op->client->db, start))
+			continue;
+
+		op->incl_start = start;
+		op->incl_end = end;
+
+		return true;
+	}
+
+	return false;
+}
+
 static void discover_incl_cb(bool success, uint8_t att_ecode,
 				struct bt_gatt_result *result, void *user_data)
 {
@@ -510,6 +664,19 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 						"Included services found: %u",
 						includes_count);
 
+	/*
+	 * Filtered discovery only looked up the services of interest. Look up
+	 * the included service first and then walk the includes again, since
+	 * they have to be inserted before any characteristic.
+	 */
+	if (op->filtered && find_missing_incl(op, result)) {
+		op->incl_primary = false;
+		if (discover_incl_svc(op))
+			return;
+
+		goto failed;
+	}
+
 	for (i = 0; i < includes_count; i++) {
 		if (!bt_gatt_iter_next_included_service(&iter, &handle, &start,
 							&end, u128.data))
@@ -518,10 +685,12 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (util_debug_enabled(client->debug_callback)) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"handle: 0x%04x, start: 0x%04x, end: 0x%04x,"
 				"uuid: %s", handle, start, end, uuid_str);
+		}
 
 		attr = gatt_db_get_attribute(client->db, start);
 		if (!attr)
@@ -575,21 +744,84 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data);
 
-static bool discover_descs(struct discovery_op *op, bool *discovering)
+static bool uuid_is_16bit(const bt_uuid_t *uuid)
+{
+	bt_uuid_t base;
+
+	bt_uuid16_create(&base, 0x0000);
+	bt_uuid_to_uuid128(&base, &base);
+
+	/* Only bytes 2 and 3 may differ from the Bluetooth Base UUID */
+	return !memcmp(uuid->value.u128.data, base.value.u128.data, 2) &&
+			!memcmp(uuid->value.u128.data + 4,
+					base.value.u128.data + 4, 12);
+}
+
+static bool discovery_insert_chrc(struct discovery_op *op,
+						const struct chrc *chrc_data)
 {
 	struct bt_gatt_client *client = op->client;
 	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_insert_characteristic(client->db,
+							chrc_data->value_handle,
+							&chrc_data->uuid, 0,
+							chrc_data->properties,
+							NULL, NULL, NULL);
+	if (!attr) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to insert characteristic at 0x%04x",
+				chrc_data->value_handle);
+		return false;
+	}
+
+	return gatt_db_attribute_get_handle(attr) == chrc_data->value_handle;
+}
+
+/*
+ * Insert the batched characteristics whose value handle is not past handle,
+ * so that the database is populated in handle order.
+ */
+static bool discovery_insert_chrcs(struct discovery_op *op, uint16_t handle,
+							uint16_t *value_handle)
+{
+	struct chrc *chrc_data;
+	bool ok;
+
+	while ((chrc_data = queue_peek_head(op->desc_chrcs))) {
+		if (chrc_data->value_handle > handle)
+			break;
+
+		queue_pop_head(op->desc_chrcs);
+
+		ok = discovery_insert_chrc(op, chrc_data);
+		*value_handle = chrc_data->value_handle;
+		free(chrc_data);
+
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+static bool discover_descs(struct discovery_op *op, bool *discovering)
+{
+	struct bt_gatt_client *client = op->client;
 	struct chrc *chrc_data;
-	uint16_t desc_start;
+	uint16_t desc_start, desc_end;
 
 	*discovering = false;
 
-	while ((chrc_data = queue_pop_head(op->pending_chrcs))) {
+	while ((chrc_data = queue_peek_head(op->pending_chrcs))) {
 		struct gatt_db_attribute *svc;
 		uint16_t start, end;
 
 		/* Adjust current service */
 		svc = gatt_db_get_service(client->db, chrc_data->value_handle);
+		if (!svc)
+			return false;
+
 		if (op->cur_svc != svc) {
 			if (op->cur_svc) {
 				queue_remove(op->pending_svcs, op->cur_svc);
@@ -601,23 +833,6 @@ static bool discover_descs(struct discovery_op *op, bool *discovering)
 			op->cur_svc = svc;
 		}
 
-		attr = gatt_db_insert_characteristic(client->db,
-							chrc_data->value_handle,
-							&chrc_data->uuid, 0,
-							chrc_data->properties,
-							NULL, NULL, NULL);
-
-		if (!attr) {
-			util_debug(client->debug_callback, client->debug_data,
-				"Failed to insert characteristic at 0x%04x",
-				chrc_data->value_handle);
-			goto failed;
-		}
-
-		if (gatt_db_attribute_get_handle(attr) !=
-							chrc_data->value_handle)
-			goto failed;
-
 		gatt_db_attribute_get_service_handles(svc, &start, &end);
 
 		/*
@@ -627,43 +842,81 @@ static bool discover_descs(struct discovery_op *op, bool *discovering)
 		if (chrc_data->end_handle > end)
 			chrc_data->end_handle = end;
 
+		queue_pop_head(op->pending_chrcs);
+
 		/*
 		 * check for descriptors presence, before initializing the
 		 * desc_handle and avoid integer overflow during desc_handle
 		 * intialization.
 		 */
 		if (chrc_data->value_handle >= chrc_data->end_handle) {
+			bool ok = discovery_insert_chrc(op, chrc_data);
+
 			free(chrc_data);
+			if (!ok)
+				return false;
+
 			continue;
 		}
 
 		desc_start = chrc_data->value_handle + 1;
+		desc_end = chrc_data->end_handle;
+		queue_push_tail(op->desc_chrcs, chrc_data);
+
+		/*
+		 * Cover the following characteristics of the service with the
+		 * same Find Information procedure, their declaration and value
+		 * handles are skipped when the result is processed. Stop at a
+		 * 128 bit value UUID since it would split the response into
+		 * extra PDUs.
+		 */
+		while ((chrc_data = queue_peek_head(op->pending_chrcs))) {
+			if (chrc_data->value_handle < start ||
+					chrc_data->value_handle > end ||
+					!uuid_is_16bit(&chrc_data->uuid))
+				break;
+
+			if (chrc_data->end_handle > end)
+				chrc_data->end_handle = end;
+
+			if (chrc_data->value_handle < chrc_data->end_handle)
+				desc_end = chrc_data->end_handle;
+
+			queue_pop_head(op->pending_chrcs);
+			queue_push_tail(op->desc_chrcs, chrc_data);
+		}
 
 		client->discovery_req = bt_gatt_discover_descriptors(
 							client->att, desc_start,
-							chrc_data->end_handle,
+							desc_end,
 							discover_descs_cb,
 							discovery_op_ref(op),
 							discovery_op_unref);
 		if (client->discovery_req) {
 			*discovering = true;
-			goto done;
+			return true;
 		}
 
 		util_debug(client->debug_callback, client->debug_data,
 					"Failed to start descriptor discovery");
 		discovery_op_unref(op);
 
-		goto failed;
+		return false;
 	}
 
-done:
-	free(chrc_data);
 	return true;
+}
 
-failed:
-	free(chrc_data);
-	return false;
+/* Complete discovery once the remaining ext. prop reads are done */
+static void discovery_descs_complete(struct discovery_op *op)
+{
+	/* Done with the current service */
+	gatt_db_service_set_active(op->cur_svc, true);
+
+	op->descs_done = true;
+
+	if (queue_isempty(op->ext_prop_desc))
+		discovery_op_complete(op, true, 0);
 }
 
 static void ext_prop_write_cb(struct gatt_db_attribute *attrib,
@@ -679,22 +932,27 @@ static void ext_prop_read_cb(bool success, uint8_t att_ecode,
 					const uint8_t *value, uint16_t length,
 					void *user_data);
 
-static bool read_ext_prop_desc(struct discovery_op *op)
+/*
+ * Extended properties are read while discovery goes on, the reads are
+ * queued behind the pending discovery request instead of stalling it.
+ */
+static bool read_ext_prop_desc(struct discovery_op *op,
+					struct gatt_db_attribute *attr)
 {
 	struct bt_gatt_client *client = op->client;
 	uint16_t handle;
-	struct gatt_db_attribute *attr;
-
-	attr = queue_peek_head(op->ext_prop_desc);
-	if (!attr)
-		return false;
 
 	handle = gatt_db_attribute_get_handle(attr);
 
+	queue_push_tail(op->ext_prop_desc, attr);
+
 	if (!bt_gatt_client_read_value(client, handle, ext_prop_read_cb,
 							discovery_op_ref(op),
-							discovery_op_unref))
+							discovery_op_unref)) {
+		queue_remove(op->ext_prop_desc, attr);
+		discovery_op_unref(op);
 		return false;
+	}
 
 	return true;
 }
@@ -705,40 +963,45 @@ static void ext_prop_read_cb(bool success, uint8_t att_ecode,
 {
 	struct discovery_op *op = user_data;
 	struct bt_gatt_client *client = op->client;
-	bool discovering;
 	struct gatt_db_attribute *desc_attr = NULL;
 
-	util_debug(client->debug_callback, client->debug_data,
-				"Ext. prop value: 0x%04x", (uint16_t)value[0]);
-
 	desc_attr = queue_pop_head(op->ext_prop_desc);
+
+	if (op->completed)
+		return;
+
 	if (!desc_attr)
 		goto failed;
 
+	if (!success || !length) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to read ext. prop at 0x%04x",
+				gatt_db_attribute_get_handle(desc_attr));
+		goto next;
+	}
+
+	util_debug(client->debug_callback, client->debug_data,
+				"Ext. prop value: 0x%04x", (uint16_t)value[0]);
+
 	if (!gatt_db_attribute_write(desc_attr, 0, value, length, 0, NULL,
 						ext_prop_write_cb, client))
 		goto failed;
 
-	/* Any other descriptor to read? */
-	if (read_ext_prop_desc(op))
-		return;
-
-	if (!discover_descs(op, &discovering))
-			goto failed;
-
-	if (discovering)
+next:
+	/* Any other descriptor to read or discovery still running? */
+	if (!queue_isempty(op->ext_prop_desc) || !op->descs_done)
 		return;
 
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
-	goto done;
+	discovery_op_complete(op, true, 0);
+	return;
 
 failed:
-	success = false;
+	if (client->discovery_req) {
+		bt_gatt_request_cancel(client->discovery_req);
+		discovery_req_clear(client);
+	}
 
-done:
-	discovery_op_complete(op, success, att_ecode);
+	discovery_op_complete(op, false, att_ecode);
 }
 
 static void discover_descs_cb(bool success, uint8_t att_ecode,
@@ -749,13 +1012,13 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 	struct bt_gatt_client *client = op->client;
 	struct bt_gatt_iter iter;
 	struct gatt_db_attribute *attr;
-	uint16_t handle;
+	uint16_t handle, value_handle = 0;
 	uint128_t u128;
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int desc_count;
 	bool discovering;
-	bt_uuid_t ext_prop_uuid;
+	bt_uuid_t ext_prop_uuid, chrc_uuid;
 
 	discovery_req_clear(client);
 
@@ -779,15 +1042,25 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 					"Descriptors found: %u", desc_count);
 
 	bt_uuid16_create(&ext_prop_uuid, GATT_CHARAC_EXT_PROPER_UUID);
+	bt_uuid16_create(&chrc_uuid, GATT_CHARAC_UUID);
 
 	while (bt_gatt_iter_next_descriptor(&iter, &handle, u128.data)) {
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (util_debug_enabled(client->debug_callback)) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 						"handle: 0x%04x, uuid: %s",
 						handle, uuid_str);
+		}
+
+		if (!discovery_insert_chrcs(op, handle, &value_handle))
+			goto failed;
+
+		/* Skip declarations and values of batched characteristics */
+		if (handle == value_handle || !bt_uuid_cmp(&chrc_uuid, &uuid))
+			continue;
 
 		attr = gatt_db_insert_descriptor(client->db, handle,
 							&uuid, 0, NULL, NULL,
@@ -802,25 +1075,23 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 		if (gatt_db_attribute_get_handle(attr) != handle)
 			goto failed;
 
-		if (!bt_uuid_cmp(&ext_prop_uuid, &uuid))
-			queue_push_tail(op->ext_prop_desc, attr);
+		if (!bt_uuid_cmp(&ext_prop_uuid, &uuid) &&
+						!read_ext_prop_desc(op, attr))
+			goto failed;
 	}
 
-	/* If we got extended prop descriptor, lets read it right away */
-	if (read_ext_prop_desc(op))
-		return;
-
 next:
+	if (!discovery_insert_chrcs(op, UINT16_MAX, &value_handle))
+		goto failed;
+
 	if (!discover_descs(op, &discovering))
 		goto failed;
 
 	if (discovering)
 		return;
 
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
-	goto done;
+	discovery_descs_complete(op);
+	return;
 
 failed:
 	success = false;
@@ -871,11 +1142,13 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
+		if (util_debug_enabled(client->debug_callback)) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
 				"start: 0x%04x, end: 0x%04x, value: 0x%04x, "
 				"props: 0x%02x, uuid: %s",
 				start, end, value, properties, uuid_str);
+		}
 
 		chrc_data = new0(struct chrc, 1);
 
@@ -919,8 +1192,8 @@ next:
 	}
 
 	/*
-	 * Sequentially discover descriptors for each characteristic and insert
-	 * the characteristics into the database as we proceed.
+	 * Discover descriptors for batches of characteristics and insert the
+	 * characteristics into the database as we proceed.
 	 */
 	if (!discover_descs(op, &discovering))
 		goto failed;
@@ -928,84 +1201,263 @@ next:
 	if (discovering)
 		return;
 
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
-	goto done;
-
+	discovery_descs_complete(op);
+	return;
+
+failed:
+	success = false;
+
+done:
+	discovery_op_complete(op, success, att_ecode);
+}
+
+static bool match_handle_range(const void *data, const void *match_data)
+{
+	const struct handle_range *range = data;
+	const struct handle_range *match_range = match_data;
+
+	return (match_range->start >= range->start) &&
+					(match_range->start <= range->end);
+}
+
+static void remove_discov_range(struct discovery_op *op, uint16_t start,
+								uint16_t end)
+{
+	struct handle_range match_range;
+	struct handle_range *range, *new_range;
+
+	match_range.start = start;
+	match_range.end = end;
+
+	range = queue_find(op->discov_ranges, match_handle_range, &match_range);
+	if (!range)
+		return;
+
+	if ((range->start == start) && (range->end == end)) {
+		queue_remove(op->discov_ranges, range);
+		free(range);
+	} else if (range->start == start)
+		range->start = end + 1;
+	else if (range->end == end)
+		range->end = start - 1;
+	else {
+		new_range = new0(struct handle_range, 1);
+		new_range->start = end + 1;
+		new_range->end = range->end;
+
+		queue_push_after(op->discov_ranges, range, new_range);
+
+		range->end = start - 1;
+	}
+}
+
+/* Ranges are walked in handle order */
+static void add_discov_range(struct discovery_op *op, uint16_t start,
+								uint16_t end)
+{
+	const struct queue_entry *entry;
+	struct handle_range *range, *prev = NULL;
+
+	for (entry = queue_get_entries(op->discov_ranges); entry;
+							entry = entry->next) {
+		range = entry->data;
+		if (range->start > start)
+			break;
+
+		prev = range;
+	}
+
+	range = new0(struct handle_range, 1);
+	range->start = start;
+	range->end = end;
+
+	if (prev)
+		queue_push_after(op->discov_ranges, prev, range);
+	else
+		queue_push_head(op->discov_ranges, range);
+}
+
+static void discovery_found_service(struct discovery_op *op,
+					struct gatt_db_attribute *attr,
+					uint16_t start, uint16_t end)
+{
+	/* Skip if service already active */
+	if (!gatt_db_service_get_active(attr)) {
+		/* Skip if there are no attributes */
+		if (end == start)
+			gatt_db_service_set_active(attr, true);
+		else {
+			queue_push_tail(op->pending_svcs, attr);
+
+			if (op->filtered)
+				add_discov_range(op, start, end);
+		}
+
+		if (start < op->svc_first)
+			op->svc_first = start;
+		if (end > op->svc_last)
+			op->svc_last = end;
+	} else {
+		/* Remove from pending if active */
+		queue_remove(op->pending_svcs, attr);
+
+		remove_discov_range(op, start, end);
+	}
+
+	/* Update last handle */
+	if (end > op->last)
+		op->last = end;
+}
+
+static void discover_incl_svc_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data);
+
+/*
+ * Look up the service at incl_start, as a secondary service first since
+ * that is what includes usually refer to.
+ */
+static bool discover_incl_svc(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+
+	if (op->incl_primary)
+		client->discovery_req = bt_gatt_discover_primary_services(
+							client->att, NULL,
+							op->incl_start,
+							op->incl_end,
+							discover_incl_svc_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+	else
+		client->discovery_req = bt_gatt_discover_secondary_services(
+							client->att, NULL,
+							op->incl_start,
+							op->incl_end,
+							discover_incl_svc_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+	if (client->discovery_req)
+		return true;
+
+	util_debug(client->debug_callback, client->debug_data,
+				"Failed to start included service discovery");
+	discovery_op_unref(op);
+
+	return false;
+}
+
+static void discover_incl_svc_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data)
+{
+	struct discovery_op *op = user_data;
+	struct bt_gatt_client *client = op->client;
+	struct bt_gatt_iter iter;
+	struct gatt_db_attribute *attr = NULL;
+	struct handle_range *range;
+	uint16_t start, end;
+	uint128_t u128;
+	bt_uuid_t uuid;
+
+	discovery_req_clear(client);
+
+	if (!success) {
+		if (op->incl_primary ||
+				(att_ecode != BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND &&
+				att_ecode != BT_ATT_ERROR_UNSUPPORTED_GROUP_TYPE))
+			goto failed;
+
+		op->incl_primary = true;
+		if (discover_incl_svc(op))
+			return;
+
+		goto failed;
+	}
+
+	if (!result || !bt_gatt_iter_init(&iter, result))
+		goto failed;
+
+	while (bt_gatt_iter_next_service(&iter, &start, &end, u128.data)) {
+		if (start != op->incl_start)
+			continue;
+
+		bt_uuid128_create(&uuid, u128);
+		attr = gatt_db_insert_service(client->db, start, &uuid,
+						op->incl_primary,
+						end - start + 1);
+		break;
+	}
+
+	if (!attr) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to store included service");
+		goto failed;
+	}
+
+	util_debug(client->debug_callback, client->debug_data,
+			"Included service: start: 0x%04x, end: 0x%04x",
+			start, end);
+
+	/* Its range is walked too, in handle order */
+	discovery_found_service(op, attr, start, end);
+
+	range = queue_peek_head(op->discov_ranges);
+	if (!range)
+		goto failed;
+
+	client->discovery_req = bt_gatt_discover_included_services(client->att,
+							range->start,
+							range->end,
+							discover_incl_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+	if (client->discovery_req)
+		return;
+
+	util_debug(client->debug_callback, client->debug_data,
+				"Failed to start included services discovery");
+	discovery_op_unref(op);
 failed:
-	success = false;
-
-done:
-	discovery_op_complete(op, success, att_ecode);
+	discovery_op_complete(op, false, att_ecode);
 }
 
-static bool match_handle_range(const void *data, const void *match_data)
+/* Walk includes and characteristics of the remaining handle ranges */
+static bool discover_pending_svcs(struct discovery_op *op, bool *discovering)
 {
-	const struct handle_range *range = data;
-	const struct handle_range *match_range = match_data;
+	struct bt_gatt_client *client = op->client;
+	struct handle_range *range;
 
-	return (match_range->start >= range->start) &&
-					(match_range->start <= range->end);
-}
+	*discovering = false;
 
-static void remove_discov_range(struct discovery_op *op, uint16_t start,
-								uint16_t end)
-{
-	struct handle_range match_range;
-	struct handle_range *range, *new_range;
+	if (queue_isempty(op->pending_svcs) || queue_isempty(op->discov_ranges))
+		return true;
 
-	match_range.start = start;
-	match_range.end = end;
+	if (op->svc_first > 0x0001)
+		remove_discov_range(op, 1, op->svc_first - 1);
+	if (op->svc_last < 0xffff)
+		remove_discov_range(op, op->svc_last + 1, 0xffff);
 
-	range = queue_find(op->discov_ranges, match_handle_range, &match_range);
+	range = queue_peek_head(op->discov_ranges);
 	if (!range)
-		return;
-
-	if ((range->start == start) && (range->end == end)) {
-		queue_remove(op->discov_ranges, range);
-		free(range);
-	} else if (range->start == start)
-		range->start = end + 1;
-	else if (range->end == end)
-		range->end = start - 1;
-	else {
-		new_range = new0(struct handle_range, 1);
-		new_range->start = end + 1;
-		new_range->end = range->end;
-
-		queue_push_after(op->discov_ranges, range, new_range);
+		return true;
 
-		range->end = start - 1;
+	client->discovery_req = bt_gatt_discover_included_services(client->att,
+							range->start,
+							range->end,
+							discover_incl_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+	if (client->discovery_req) {
+		*discovering = true;
+		return true;
 	}
-}
-
-static void discovery_found_service(struct discovery_op *op,
-					struct gatt_db_attribute *attr,
-					uint16_t start, uint16_t end)
-{
-	/* Skip if service already active */
-	if (!gatt_db_service_get_active(attr)) {
-		/* Skip if there are no attributes */
-		if (end == start)
-			gatt_db_service_set_active(attr, true);
-		else
-			queue_push_tail(op->pending_svcs, attr);
-
-		if (start < op->svc_first)
-			op->svc_first = start;
-		if (end > op->svc_last)
-			op->svc_last = end;
-	} else {
-		/* Remove from pending if active */
-		queue_remove(op->pending_svcs, attr);
 
-		remove_discov_range(op, start, end);
-	}
+	util_debug(client->debug_callback, client->debug_data,
+				"Failed to start included services discovery");
+	discovery_op_unref(op);
 
-	/* Update last handle */
-	if (end > op->last)
-		op->last = end;
+	return false;
 }
 
 static void discover_secondary_cb(bool success, uint8_t att_ecode,
@@ -1020,7 +1472,7 @@ static void discover_secondary_cb(bool success, uint8_t att_ecode,
 	uint128_t u128;
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
-	struct handle_range *range;
+	bool discovering;
 
 	discovery_req_clear(client);
 
@@ -1052,10 +1504,12 @@ static void discover_secondary_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
-				"start: 0x%04x, end: 0x%04x, uuid: %s",
-				start, end, uuid_str);
+		if (util_debug_enabled(client->debug_callback)) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
+					"start: 0x%04x, end: 0x%04x, uuid: %s",
+					start, end, uuid_str);
+		}
 
 		/* Store the service */
 		attr = gatt_db_insert_service(client->db, start, &uuid, false,
@@ -1080,32 +1534,43 @@ static void discover_secondary_cb(bool success, uint8_t att_ecode,
 	}
 
 next:
-	if (queue_isempty(op->pending_svcs) || queue_isempty(op->discov_ranges))
-		goto done;
+	if (!discover_pending_svcs(op, &discovering))
+		success = false;
+	else if (discovering)
+		return;
 
-	if (op->svc_first > 0x0001)
-		remove_discov_range(op, 1, op->svc_first - 1);
-	if (op->svc_last < 0xffff)
-		remove_discov_range(op, op->svc_last + 1, 0xffff);
+done:
+	discovery_op_complete(op, success, att_ecode);
+}
 
-	range = queue_peek_head(op->discov_ranges);
+static void discover_primary_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data);
 
-	client->discovery_req = bt_gatt_discover_included_services(client->att,
-							range->start,
-							range->end,
-							discover_incl_cb,
+/*
+ * Start primary service discovery of the operation range, or look up the next
+ * service of interest by UUID if filtered.
+ */
+static bool discover_primary(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+	bt_uuid_t *uuid = NULL;
+
+	if (op->filtered) {
+		uuid = queue_pop_head(op->uuids);
+		if (!uuid)
+			return false;
+	}
+
+	client->discovery_req = bt_gatt_discover_primary_services(client->att,
+							uuid, op->start,
+							op->end,
+							discover_primary_cb,
 							discovery_op_ref(op),
 							discovery_op_unref);
-	if (client->discovery_req)
-		return;
-
-	util_debug(client->debug_callback, client->debug_data,
-				"Failed to start included services discovery");
-	discovery_op_unref(op);
-	success = false;
+	free(uuid);
 
-done:
-	discovery_op_complete(op, success, att_ecode);
+	return client->discovery_req != NULL;
 }
 
 static void discover_primary_cb(bool success, uint8_t att_ecode,
@@ -1120,6 +1585,7 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 	uint128_t u128;
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
+	bool discovering;
 
 	discovery_req_clear(client);
 
@@ -1151,10 +1617,12 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 		bt_uuid128_create(&uuid, u128);
 
 		/* Log debug message. */
-		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-		util_debug(client->debug_callback, client->debug_data,
-				"start: 0x%04x, end: 0x%04x, uuid: %s",
-				start, end, uuid_str);
+		if (util_debug_enabled(client->debug_callback)) {
+			bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+			util_debug(client->debug_callback, client->debug_data,
+					"start: 0x%04x, end: 0x%04x, uuid: %s",
+					start, end, uuid_str);
+		}
 
 		attr = gatt_db_insert_service(client->db, start, &uuid, true,
 							end - start + 1);
@@ -1178,6 +1646,20 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 	}
 
 secondary:
+	if (op->filtered) {
+		if (queue_isempty(op->uuids))
+			goto services;
+
+		if (discover_primary(op))
+			return;
+
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to start primary service discovery");
+		discovery_op_unref(op);
+		success = false;
+		goto done;
+	}
+
 	/*
 	 * Version 4.2 [Vol 1, Part A] page 101:
 	 * A secondary service is a service that provides auxiliary
@@ -1200,6 +1682,18 @@ secondary:
 				"Failed to start secondary service discovery");
 	discovery_op_unref(op);
 	success = false;
+	goto done;
+
+services:
+	/*
+	 * Secondary services are only reachable through includes of primary
+	 * services, filtered discovery looks them up as their includes are
+	 * walked.
+	 */
+	if (!discover_pending_svcs(op, &discovering))
+		success = false;
+	else if (discovering)
+		return;
 
 done:
 	discovery_op_complete(op, success, att_ecode);
@@ -1279,12 +1773,7 @@ static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 					bt_att_get_mtu(client->att));
 
 discover:
-	client->discovery_req = bt_gatt_discover_all_primary_services(
-							client->att, NULL,
-							discover_primary_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
+	if (discover_primary(op))
 		return;
 
 	util_debug(client->debug_callback, client->debug_data,
@@ -1380,7 +1869,7 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 		 * the next one in the queue. If there was an error sending the
 		 * write request, then just move on to the next queued entry.
 		 */
-		queue_remove(notify_data->client->notify_list, notify_data);
+		notify_list_remove(notify_data->client, notify_data);
 		notify_data->callback(att_ecode, notify_data->user_data);
 
 		while ((notify_data = queue_pop_head(
@@ -1404,14 +1893,6 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 	bt_gatt_client_unref(notify_data->client);
 }
 
-static bool match_notify_chrc_value_handle(const void *a, const void *b)
-{
-	const struct notify_chrc *chrc = a;
-	uint16_t value_handle = PTR_TO_UINT(b);
-
-	return chrc->value_handle == value_handle;
-}
-
 static unsigned int register_notify(struct bt_gatt_client *client,
 				uint16_t handle,
 				bt_gatt_client_register_callback_t callback,
@@ -1423,8 +1904,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	struct notify_chrc *chrc = NULL;
 
 	/* Check if a characteristic ref count has been started already */
-	chrc = queue_find(client->notify_chrcs, match_notify_chrc_value_handle,
-						UINT_TO_PTR(handle));
+	chrc = notify_chrc_lookup(client, handle);
 
 	if (!chrc) {
 		/*
@@ -1450,7 +1930,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	notify_data->destroy = destroy;
 
 	/* Add the handler to the bt_gatt_client's general list */
-	queue_push_tail(client->notify_list, notify_data);
+	notify_list_add(client, notify_data);
 
 	/* Assign an ID to the handler. */
 	if (client->next_reg_id < 1)
@@ -1480,7 +1960,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 
 	/* Write to the CCC descriptor */
 	if (!notify_data_write_ccc(notify_data, true, enable_ccc_callback)) {
-		queue_remove(client->notify_list, notify_data);
+		notify_list_remove(client, notify_data);
 		free(notify_data);
 		return 0;
 	}
@@ -1615,17 +2095,13 @@ static void process_service_changed(struct bt_gatt_client *client,
 	struct discovery_op *op;
 
 	op = discovery_op_create(client, start_handle, end_handle,
+						client->svc_filter,
 						service_changed_complete,
 						service_changed_failure);
 	if (!op)
 		goto fail;
 
-	client->discovery_req = bt_gatt_discover_primary_services(client->att,
-						NULL, start_handle, end_handle,
-						discover_primary_cb,
-						discovery_op_ref(op),
-						discovery_op_unref);
-	if (client->discovery_req) {
+	if (discover_primary(op)) {
 		client->in_svc_chngd = true;
 		return;
 	}
@@ -1701,6 +2177,34 @@ done:
 	notify_client_ready(client, success, att_ecode);
 }
 
+static void discover_services_complete(struct discovery_op *op, bool success,
+							uint8_t att_ecode)
+{
+	struct bt_gatt_client *client = op->client;
+	struct service_changed_op *next_sc_op;
+
+	client->in_svc_chngd = false;
+
+	if (!success)
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to discover services - error: 0x%02x",
+				att_ecode);
+	else if (!register_service_changed(client))
+		util_debug(client->debug_callback, client->debug_data,
+			"Failed to register handler for \"Service Changed\"");
+
+	if (op->callback)
+		op->callback(success, att_ecode, op->user_data);
+
+	/* Process any Service Changed event queued meanwhile */
+	next_sc_op = queue_pop_head(client->svc_chngd_queue);
+	if (next_sc_op) {
+		process_service_changed(client, next_sc_op->start_handle,
+							next_sc_op->end_handle);
+		free(next_sc_op);
+	}
+}
+
 static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 {
 	struct discovery_op *op;
@@ -1708,7 +2212,8 @@ static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 	if (client->in_init || client->ready)
 		return false;
 
-	op = discovery_op_create(client, 0x0001, 0xffff, init_complete, NULL);
+	op = discovery_op_create(client, 0x0001, 0xffff, client->svc_filter,
+							init_complete, NULL);
 	if (!op)
 		return false;
 
@@ -1744,12 +2249,7 @@ static bool gatt_client_init(struct bt_gatt_client *client, uint16_t mtu)
 	return true;
 
 discover:
-	client->discovery_req = bt_gatt_discover_all_primary_services(
-							client->att, NULL,
-							discover_primary_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (!client->discovery_req) {
+	if (!discover_primary(op)) {
 		discovery_op_free(op);
 		return false;
 	}
@@ -1817,9 +2317,6 @@ static void notify_handler(void *data, void *user_data)
 
 	value_handle = get_le16(pdu_data->pdu);
 
-	if (notify_data->chrc->value_handle != value_handle)
-		return;
-
 	if (pdu_data->length > 2)
 		value = pdu_data->pdu + 2;
 
@@ -1836,6 +2333,7 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 								void *user_data)
 {
 	struct bt_gatt_client *client = user_data;
+	struct notify_chrc *chrc;
 	struct pdu_data pdu_data;
 
 	bt_gatt_client_ref(client);
@@ -1844,7 +2342,10 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 	pdu_data.pdu = pdu;
 	pdu_data.length = length;
 
-	queue_foreach(client->notify_list, notify_handler, &pdu_data);
+	/* Only the handlers of the notified value handle are visited */
+	chrc = length >= 2 ? notify_chrc_lookup(client, get_le16(pdu)) : NULL;
+	if (chrc)
+		queue_foreach(chrc->notify_list, notify_handler, &pdu_data);
 
 	if (opcode == BT_ATT_OP_HANDLE_VAL_IND && !client->parent)
 		bt_att_send(client->att, BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0,
@@ -1878,6 +2379,9 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
 	queue_destroy(client->pending_requests, request_unref);
+	queue_destroy(client->svc_filter, free);
+	queue_destroy(client->read_bufs, free);
+	queue_destroy(client->shared_reads, NULL);
 
 	if (client->parent) {
 		queue_remove(client->parent->clones, client);
@@ -1922,6 +2426,8 @@ static struct bt_gatt_client *gatt_client_new(struct gatt_db *db,
 	client->notify_list = queue_new();
 	client->notify_chrcs = queue_new();
 	client->pending_requests = queue_new();
+	client->read_bufs = queue_new();
+	client->shared_reads = queue_new();
 
 	client->notify_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_NOT,
 						notify_cb, client, NULL);
@@ -1957,12 +2463,105 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	if (!client)
 		return NULL;
 
-	if (!gatt_client_init(client, mtu)) {
-		bt_gatt_client_free(client);
-		return NULL;
-	}
+	if (!gatt_client_init(client, mtu)) {
+		bt_gatt_client_free(client);
+		return NULL;
+	}
+
+	return bt_gatt_client_ref(client);
+}
+
+static struct queue *uuid_list_new(const bt_uuid_t *uuids,
+							unsigned int num_uuids)
+{
+	struct queue *list;
+	unsigned int i;
+
+	list = queue_new();
+
+	for (i = 0; i < num_uuids; i++)
+		copy_uuid((void *) &uuids[i], list);
+
+	return list;
+}
+
+struct bt_gatt_client *bt_gatt_client_new_filtered(struct gatt_db *db,
+						struct bt_att *att,
+						uint16_t mtu,
+						const bt_uuid_t *uuids,
+						unsigned int num_uuids)
+{
+	struct bt_gatt_client *client;
+	bt_uuid_t gatt_uuid;
+
+	if (!att || !db || !uuids || !num_uuids)
+		return NULL;
+
+	client = gatt_client_new(db, att);
+	if (!client)
+		return NULL;
+
+	/* Always track the GATT service so Service Changed keeps working */
+	client->svc_filter = uuid_list_new(uuids, num_uuids);
+	bt_uuid16_create(&gatt_uuid, GATT_SVC_UUID);
+	copy_uuid(&gatt_uuid, client->svc_filter);
+
+	if (!gatt_client_init(client, mtu)) {
+		bt_gatt_client_free(client);
+		return NULL;
+	}
+
+	return bt_gatt_client_ref(client);
+}
+
+bool bt_gatt_client_discover_services(struct bt_gatt_client *client,
+					const bt_uuid_t *uuids,
+					unsigned int num_uuids,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	struct discovery_op *op;
+	struct queue *filter = NULL;
+
+	if (!client || !client->ready || client->parent)
+		return false;
+
+	if (client->in_svc_chngd || client->discovery_req)
+		return false;
+
+	if (num_uuids) {
+		if (!uuids)
+			return false;
+
+		filter = uuid_list_new(uuids, num_uuids);
+	}
+
+	op = discovery_op_create(client, 0x0001, 0xffff, filter,
+					discover_services_complete, NULL);
+
+	if (!discover_primary(op)) {
+		discovery_op_free(op);
+		queue_destroy(filter, free);
+		return false;
+	}
+
+	op->callback = callback;
+	op->user_data = user_data;
+	op->destroy = destroy;
+
+	client->in_svc_chngd = true;
 
-	return bt_gatt_client_ref(client);
+	/* Keep the new services tracked on Service Changed */
+	if (!filter) {
+		queue_destroy(client->svc_filter, free);
+		client->svc_filter = NULL;
+	} else if (client->svc_filter)
+		queue_foreach(filter, copy_uuid, client->svc_filter);
+
+	queue_destroy(filter, free);
+
+	return true;
 }
 
 struct bt_gatt_client *bt_gatt_client_clone(struct bt_gatt_client *client)
@@ -2155,10 +2754,15 @@ static bool cancel_prep_write_session(struct bt_gatt_client *client,
 							req, request_unref);
 }
 
+static bool cancel_shared_read(struct request *req);
+
 static bool cancel_request(struct request *req)
 {
 	req->removed = true;
 
+	if (req->share)
+		return cancel_shared_read(req);
+
 	if (req->long_write)
 		return cancel_long_write_req(req->client, req);
 
@@ -2223,35 +2827,166 @@ static void destroy_read_op(void *data)
 	free(op);
 }
 
+/*
+ * Identical Read Requests issued while one is already in flight, either by
+ * the same client or by any of its clones, are attached to the pending ATT
+ * transaction instead of queueing a duplicate PDU on the bearer. Every
+ * waiter keeps its own request id so it can be cancelled independently.
+ */
+struct read_share {
+	struct bt_gatt_client *root;
+	uint16_t value_handle;
+	unsigned int att_id;
+	bool done;
+	struct queue *waiters;
+};
+
+static struct bt_gatt_client *client_root(struct bt_gatt_client *client)
+{
+	while (client->parent)
+		client = client->parent;
+
+	return client;
+}
+
+static bool match_share_handle(const void *a, const void *b)
+{
+	const struct read_share *share = a;
+
+	return share->value_handle == PTR_TO_UINT(b);
+}
+
+static void read_share_free(void *data)
+{
+	struct read_share *share = data;
+
+	queue_remove(share->root->shared_reads, share);
+	queue_destroy(share->waiters, request_unref);
+	free(share);
+}
+
+static bool cancel_shared_read(struct request *req)
+{
+	struct read_share *share = req->share;
+
+	/* Response is being dispatched, the waiter is skipped instead */
+	if (share->done)
+		return true;
+
+	if (!queue_remove(share->waiters, req))
+		return false;
+
+	request_unref(req);
+
+	if (!queue_isempty(share->waiters))
+		return true;
+
+	return bt_att_cancel(share->root->att, share->att_id);
+}
+
+struct read_result {
+	bool success;
+	uint8_t att_ecode;
+	const uint8_t *value;
+	uint16_t length;
+};
+
+static void read_notify_waiter(void *data, void *user_data)
+{
+	struct request *req = data;
+	struct read_op *op = req->data;
+	struct read_result *result = user_data;
+
+	if (req->removed || !op->callback)
+		return;
+
+	op->callback(result->success, result->att_ecode, result->value,
+					result->length, op->user_data);
+}
+
 static void read_cb(uint8_t opcode, const void *pdu, uint16_t length,
 								void *user_data)
 {
-	struct request *req = user_data;
-	struct read_op *op = req->data;
-	bool success;
-	uint8_t att_ecode = 0;
-	const uint8_t *value = NULL;
-	uint16_t value_len = 0;
+	struct read_share *share = user_data;
+	struct read_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	/* Reads issued from the callbacks need a fresh value */
+	share->done = true;
+	queue_remove(share->root->shared_reads, share);
 
 	if (opcode == BT_ATT_OP_ERROR_RSP) {
-		success = false;
-		att_ecode = process_error(pdu, length);
+		result.att_ecode = process_error(pdu, length);
 		goto done;
 	}
 
-	if (opcode != BT_ATT_OP_READ_RSP || (!pdu && length)) {
-		success = false;
+	if (opcode != BT_ATT_OP_READ_RSP || (!pdu && length))
 		goto done;
+
+	result.success = true;
+	result.length = length;
+	if (length)
+		result.value = pdu;
+
+done:
+	queue_foreach(share->waiters, read_notify_waiter, &result);
+}
+
+static bool read_share_start(struct bt_gatt_client *root,
+							struct request *req,
+							uint16_t value_handle)
+{
+	struct read_share *share;
+	uint8_t pdu[2];
+
+	share = queue_find(root->shared_reads, match_share_handle,
+						UINT_TO_PTR(value_handle));
+	if (share)
+		goto done;
+
+	if (!root->att)
+		return false;
+
+	share = new0(struct read_share, 1);
+	share->root = root;
+	share->value_handle = value_handle;
+	share->waiters = queue_new();
+
+	put_le16(value_handle, pdu);
+
+	share->att_id = bt_att_send(root->att, BT_ATT_OP_READ_REQ,
+							pdu, sizeof(pdu),
+							read_cb, share,
+							read_share_free);
+	if (!share->att_id) {
+		queue_destroy(share->waiters, NULL);
+		free(share);
+		return false;
 	}
 
-	success = true;
-	value_len = length;
-	if (value_len)
-		value = pdu;
+	queue_push_tail(root->shared_reads, share);
 
 done:
-	if (op->callback)
-		op->callback(success, att_ecode, value, length, op->user_data);
+	/* The creation reference of the request is owned by the share */
+	queue_push_tail(share->waiters, req);
+	req->share = share;
+	req->att_id = share->att_id;
+
+	return true;
+}
+
+/*
+ * A write queued behind a shared read must not be overtaken by reads issued
+ * after it, so those start a new share. Earlier waiters keep the old one.
+ */
+static void read_share_invalidate(struct bt_gatt_client *client,
+							uint16_t value_handle)
+{
+	struct bt_gatt_client *root = client_root(client);
+
+	queue_remove_if(root->shared_reads, match_share_handle,
+						UINT_TO_PTR(value_handle));
 }
 
 unsigned int bt_gatt_client_read_value(struct bt_gatt_client *client,
@@ -2262,7 +2997,6 @@ unsigned int bt_gatt_client_read_value(struct bt_gatt_client *client,
 {
 	struct request *req;
 	struct read_op *op;
-	uint8_t pdu[2];
 
 	if (!client)
 		return 0;
@@ -2282,13 +3016,7 @@ unsigned int bt_gatt_client_read_value(struct bt_gatt_client *client,
 	req->data = op;
 	req->destroy = destroy_read_op;
 
-	put_le16(value_handle, pdu);
-
-	req->att_id = bt_att_send(client->att, BT_ATT_OP_READ_REQ,
-							pdu, sizeof(pdu),
-							read_cb, req,
-							request_unref);
-	if (!req->att_id) {
+	if (!read_share_start(client_root(client), req, value_handle)) {
 		op->destroy = NULL;
 		request_unref(req);
 		return 0;
@@ -2380,7 +3108,10 @@ struct read_long_op {
 	int ref_count;
 	uint16_t value_handle;
 	uint16_t offset;
-	struct iovec iov;
+	uint8_t *buf;
+	uint16_t len;
+	uint16_t size;
+	bool pooled;
 	bt_gatt_client_read_callback_t callback;
 	void *user_data;
 	bt_gatt_client_destroy_func_t destroy;
@@ -2389,35 +3120,34 @@ struct read_long_op {
 static void destroy_read_long_op(void *data)
 {
 	struct read_long_op *op = data;
+	struct bt_gatt_client *client = op->client;
 
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->iov.iov_base);
+	if (op->pooled && (queue_length(client->read_bufs) >=
+						READ_BUF_POOL_SIZE ||
+				!queue_push_tail(client->read_bufs, op->buf)))
+		free(op->buf);
+
 	free(op);
 }
 
-static bool append_chunk(struct read_long_op *op, const uint8_t *data,
+/*
+ * The value is read straight into a buffer sized for the whole value, either
+ * supplied by the caller or taken from the pool, so each chunk is copied once.
+ */
+static void append_chunk(struct read_long_op *op, const uint8_t *data,
 								uint16_t len)
 {
-	void *buf;
-
-	/* Truncate if the data would exceed maximum length */
-	if (op->offset + len > BT_ATT_MAX_VALUE_LEN)
-		len = BT_ATT_MAX_VALUE_LEN - op->offset;
+	/* Truncate if the data would exceed the buffer */
+	if (len > op->size - op->len)
+		len = op->size - op->len;
 
-	buf = realloc(op->iov.iov_base, op->iov.iov_len + len);
-	if (!buf)
-		return false;
-
-	op->iov.iov_base = buf;
+	memcpy(op->buf + op->len, data, len);
 
-	memcpy(op->iov.iov_base + op->iov.iov_len, data, len);
-
-	op->iov.iov_len += len;
+	op->len += len;
 	op->offset += len;
-
-	return true;
 }
 
 static void read_long_cb(uint8_t opcode, const void *pdu,
@@ -2444,12 +3174,9 @@ static void read_long_cb(uint8_t opcode, const void *pdu,
 	if (!length)
 		goto success;
 
-	if (!append_chunk(op, pdu, length)) {
-		success = false;
-		goto done;
-	}
+	append_chunk(op, pdu, length);
 
-	if (op->offset >= BT_ATT_MAX_VALUE_LEN)
+	if (op->len >= op->size)
 		goto success;
 
 	if (length >= bt_att_get_mtu(op->client->att) - 1) {
@@ -2477,12 +3204,13 @@ success:
 
 done:
 	if (op->callback)
-		op->callback(success, att_ecode, op->iov.iov_base,
-						op->iov.iov_len, op->user_data);
+		op->callback(success, att_ecode, op->buf, op->len,
+							op->user_data);
 }
 
-unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
+static unsigned int read_long_value(struct bt_gatt_client *client,
 					uint16_t value_handle, uint16_t offset,
+					uint8_t *buf, uint16_t size,
 					bt_gatt_client_read_callback_t callback,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy)
@@ -2493,18 +3221,34 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	uint8_t pdu[4];
 	uint16_t pdu_len;
 
-	if (!client)
-		return 0;
-
 	op = new0(struct read_long_op, 1);
 
+	if (!buf) {
+		buf = queue_pop_head(client->read_bufs);
+		if (!buf)
+			buf = malloc(BT_ATT_MAX_VALUE_LEN);
+
+		if (!buf) {
+			free(op);
+			return 0;
+		}
+
+		op->pooled = true;
+		size = offset < BT_ATT_MAX_VALUE_LEN ?
+					BT_ATT_MAX_VALUE_LEN - offset : 0;
+	}
+
+	op->client = client;
+	op->buf = buf;
+	op->size = size;
+
 	req = request_create(client);
 	if (!req) {
-		free(op);
+		op->destroy = NULL;
+		destroy_read_long_op(op);
 		return 0;
 	}
 
-	op->client = client;
 	op->value_handle = value_handle;
 	op->offset = offset;
 	op->callback = callback;
@@ -2550,6 +3294,33 @@ unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
 	return req->id;
 }
 
+unsigned int bt_gatt_client_read_long_value(struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	if (!client)
+		return 0;
+
+	return read_long_value(client, value_handle, offset, NULL, 0,
+					callback, user_data, destroy);
+}
+
+unsigned int bt_gatt_client_read_long_value_buf(struct bt_gatt_client *client,
+					uint16_t value_handle, uint16_t offset,
+					uint8_t *buf, uint16_t size,
+					bt_gatt_client_read_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	if (!client || !buf || !size)
+		return 0;
+
+	return read_long_value(client, value_handle, offset, buf, size,
+					callback, user_data, destroy);
+}
+
 unsigned int bt_gatt_client_write_without_response(
 					struct bt_gatt_client *client,
 					uint16_t value_handle,
@@ -2588,6 +3359,253 @@ unsigned int bt_gatt_client_write_without_response(
 	return req->id;
 }
 
+/*
+ * Write Without Response stream: buffers are segmented into Write Commands
+ * as the ATT socket drains. A segment is accounted as in flight from the time
+ * it is queued on the bearer until it is written out, which is signalled by
+ * the destroy callback of the command. Commands dropped on disconnect are
+ * destroyed with the bearer already down.
+ */
+struct stream_chunk {
+	const uint8_t *data;
+	size_t len;
+	size_t queued;
+	size_t done;
+	bool failed;
+	bt_gatt_client_callback_t callback;
+	bt_gatt_client_destroy_func_t destroy;
+	void *user_data;
+};
+
+struct stream_seg {
+	struct bt_gatt_client_stream *stream;
+	struct stream_chunk *chunk;
+	uint16_t len;
+};
+
+struct bt_gatt_client_stream {
+	struct bt_gatt_client *client;
+	uint16_t value_handle;
+	size_t max_in_flight;
+	size_t in_flight;
+	struct queue *chunks;
+	bool pumping;
+	bool closed;
+	uint64_t bytes;
+	struct timespec start;
+	struct timespec last;
+};
+
+static void stream_free(struct bt_gatt_client_stream *stream)
+{
+	queue_destroy(stream->chunks, NULL);
+	bt_gatt_client_unref(stream->client);
+	free(stream);
+}
+
+static void stream_complete_chunks(struct bt_gatt_client_stream *stream)
+{
+	struct stream_chunk *chunk;
+
+	while ((chunk = queue_peek_head(stream->chunks))) {
+		if (chunk->done < chunk->len)
+			break;
+
+		queue_pop_head(stream->chunks);
+
+		if (chunk->callback)
+			chunk->callback(!chunk->failed, 0, chunk->user_data);
+
+		if (chunk->destroy)
+			chunk->destroy(chunk->user_data);
+
+		free(chunk);
+	}
+}
+
+static bool match_chunk_unqueued(const void *a, const void *b)
+{
+	const struct stream_chunk *chunk = a;
+
+	return chunk->queued < chunk->len;
+}
+
+static void stream_pump(struct bt_gatt_client_stream *stream);
+
+static void stream_seg_destroy(void *data)
+{
+	struct stream_seg *seg = data;
+	struct bt_gatt_client_stream *stream = seg->stream;
+
+	stream->in_flight -= seg->len;
+	seg->chunk->done += seg->len;
+
+	if (!bt_att_is_connected(stream->client->att))
+		seg->chunk->failed = true;
+	else {
+		stream->bytes += seg->len;
+		clock_gettime(CLOCK_MONOTONIC, &stream->last);
+	}
+
+	free(seg);
+
+	stream_complete_chunks(stream);
+	stream_pump(stream);
+}
+
+static void stream_pump(struct bt_gatt_client_stream *stream)
+{
+	struct bt_gatt_client *client = stream->client;
+	uint8_t pdu[2 + BT_ATT_MAX_VALUE_LEN];
+	struct stream_chunk *chunk;
+	struct stream_seg *seg;
+	uint16_t len;
+
+	/* Called back from a completion while pumping already */
+	if (stream->pumping)
+		return;
+
+	stream->pumping = true;
+
+	while ((chunk = queue_find(stream->chunks, match_chunk_unqueued,
+								NULL))) {
+		len = client->att ? bt_att_get_mtu(client->att) - 3 : 0;
+		len = MIN(len, BT_ATT_MAX_VALUE_LEN);
+		len = MIN(len, chunk->len - chunk->queued);
+
+		/* Keep at least one segment going whatever the bound is */
+		if (stream->in_flight &&
+				stream->in_flight + len > stream->max_in_flight)
+			break;
+
+		seg = new0(struct stream_seg, 1);
+		seg->stream = stream;
+		seg->chunk = chunk;
+		seg->len = len;
+
+		put_le16(stream->value_handle, pdu);
+		memcpy(pdu + 2, chunk->data + chunk->queued, len);
+
+		if (!len || !bt_att_send(client->att, BT_ATT_OP_WRITE_CMD, pdu,
+						len + 2, NULL, seg,
+						stream_seg_destroy)) {
+			free(seg);
+
+			/* Fail whatever is left of the buffer */
+			chunk->failed = true;
+			chunk->done += chunk->len - chunk->queued;
+			chunk->queued = chunk->len;
+
+			stream_complete_chunks(stream);
+			continue;
+		}
+
+		if (!stream->in_flight && !stream->bytes)
+			clock_gettime(CLOCK_MONOTONIC, &stream->start);
+
+		chunk->queued += len;
+		stream->in_flight += len;
+	}
+
+	stream->pumping = false;
+
+	if (stream->closed && !stream->in_flight &&
+					queue_isempty(stream->chunks))
+		stream_free(stream);
+}
+
+struct bt_gatt_client_stream *bt_gatt_client_stream_open(
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					size_t max_in_flight)
+{
+	struct bt_gatt_client_stream *stream;
+
+	if (!client || !value_handle)
+		return NULL;
+
+	stream = new0(struct bt_gatt_client_stream, 1);
+	stream->client = bt_gatt_client_ref(client);
+	stream->value_handle = value_handle;
+	stream->max_in_flight = max_in_flight ? max_in_flight :
+						STREAM_DEFAULT_IN_FLIGHT;
+	stream->chunks = queue_new();
+
+	return stream;
+}
+
+bool bt_gatt_client_stream_write(struct bt_gatt_client_stream *stream,
+					const uint8_t *data, size_t len,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	struct stream_chunk *chunk;
+
+	if (!stream || stream->closed || !data || !len)
+		return false;
+
+	if (!stream->client->att)
+		return false;
+
+	chunk = new0(struct stream_chunk, 1);
+	chunk->data = data;
+	chunk->len = len;
+	chunk->callback = callback;
+	chunk->destroy = destroy;
+	chunk->user_data = user_data;
+
+	queue_push_tail(stream->chunks, chunk);
+
+	stream_pump(stream);
+
+	return true;
+}
+
+bool bt_gatt_client_stream_get_stats(struct bt_gatt_client_stream *stream,
+						uint64_t *bytes,
+						uint64_t *bytes_per_sec)
+{
+	uint64_t usec;
+
+	if (!stream)
+		return false;
+
+	usec = (stream->last.tv_sec - stream->start.tv_sec) * 1000000ULL;
+	usec += stream->last.tv_nsec / 1000;
+	usec -= stream->start.tv_nsec / 1000;
+
+	if (bytes)
+		*bytes = stream->bytes;
+
+	if (bytes_per_sec)
+		*bytes_per_sec = usec ? stream->bytes * 1000000ULL / usec : 0;
+
+	return true;
+}
+
+void bt_gatt_client_stream_close(struct bt_gatt_client_stream *stream)
+{
+	struct bt_gatt_client *client;
+	uint64_t bytes, rate;
+
+	if (!stream || stream->closed)
+		return;
+
+	client = stream->client;
+
+	bt_gatt_client_stream_get_stats(stream, &bytes, &rate);
+	util_debug(client->debug_callback, client->debug_data,
+			"Stream 0x%04x closed: %llu bytes at %llu bytes/s",
+			stream->value_handle, (unsigned long long) bytes,
+			(unsigned long long) rate);
+
+	/* Buffers still queued are flushed before the stream goes away */
+	stream->closed = true;
+
+	stream_pump(stream);
+}
+
 struct write_op {
 	struct bt_gatt_client *client;
 	bt_gatt_client_callback_t callback;
@@ -2659,6 +3677,8 @@ unsigned int bt_gatt_client_write_value(struct bt_gatt_client *client,
 	put_le16(value_handle, pdu);
 	memcpy(pdu + 2, value, length);
 
+	read_share_invalidate(client, value_handle);
+
 	req->att_id = bt_att_send(client->att, BT_ATT_OP_WRITE_REQ,
 							pdu, sizeof(pdu),
 							write_cb, req,
@@ -2944,6 +3964,8 @@ unsigned int bt_gatt_client_write_long_value(struct bt_gatt_client *client,
 	req->destroy = long_write_op_free;
 	req->long_write = true;
 
+	read_share_invalidate(client, value_handle);
+
 	if (client->in_long_write || client->reliable_write_session_id > 0) {
 		queue_push_tail(client->long_write_queue, req);
 		return req->id;
@@ -3126,6 +4148,8 @@ unsigned int bt_gatt_client_prepare_write(struct bt_gatt_client *client,
 	memcpy(op->pdu, pdu, length);
 	op->pdu_len = length;
 
+	read_share_invalidate(client, value_handle);
+
 	/*
 	 * Now we are ready to send command
 	 * Note that request_unref will be done on write execute
@@ -3261,6 +4285,8 @@ bool bt_gatt_client_unregister_notify(struct bt_gatt_client *client,
 	if (!notify_data)
 		return false;
 
+	queue_remove(notify_data->chrc->notify_list, notify_data);
+
 	/* Remove data if it has been queued */
 	queue_remove(notify_data->chrc->reg_notify_queue, notify_data);
 
@@ -27,6 +27,7 @@
 
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "lib/bluetooth.h"
 #include "lib/uuid.h"
@@ -40,20 +41,24 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #define MAX_CHAR_DECL_VALUE_LEN 19
 #define MAX_INCLUDED_VALUE_LEN 6
 #define ATTRIBUTE_TIMEOUT 5000
 
-static const bt_uuid_t primary_service_uuid = { .type = BT_UUID16,
-					.value.u16 = GATT_PRIM_SVC_UUID };
-static const bt_uuid_t secondary_service_uuid = { .type = BT_UUID16,
-					.value.u16 = GATT_SND_SVC_UUID };
-static const bt_uuid_t characteristic_uuid = { .type = BT_UUID16,
-					.value.u16 = GATT_CHARAC_UUID };
-static const bt_uuid_t included_service_uuid = { .type = BT_UUID16,
-					.value.u16 = GATT_INCLUDE_UUID };
-static const bt_uuid_t ext_desc_uuid = { .type = BT_UUID16,
-				.value.u16 = GATT_CHARAC_EXT_PROPER_UUID };
+static const bt_uuid_t primary_service_uuid =
+					BT_UUID16_INIT(GATT_PRIM_SVC_UUID);
+static const bt_uuid_t secondary_service_uuid =
+					BT_UUID16_INIT(GATT_SND_SVC_UUID);
+static const bt_uuid_t characteristic_uuid =
+					BT_UUID16_INIT(GATT_CHARAC_UUID);
+static const bt_uuid_t included_service_uuid =
+					BT_UUID16_INIT(GATT_INCLUDE_UUID);
+static const bt_uuid_t ext_desc_uuid =
+					BT_UUID16_INIT(GATT_CHARAC_EXT_PROPER_UUID);
 
 struct gatt_db {
 	int ref_count;
@@ -62,6 +67,14 @@ struct gatt_db {
 
 	struct queue *notify_list;
 	unsigned int next_notify_id;
+
+	/*
+	 * Set when the database is served from several threads at once, see
+	 * gatt_db_set_shared(). Protects stored attribute values and the
+	 * pending read/write bookkeeping, not the database layout.
+	 */
+	bool shared;
+	pthread_rwlock_t lock;
 };
 
 struct notify {
@@ -225,10 +238,39 @@ struct gatt_db *gatt_db_new(void)
 	db->services = queue_new();
 	db->notify_list = queue_new();
 	db->next_handle = 0x0001;
+	pthread_rwlock_init(&db->lock, NULL);
 
 	return gatt_db_ref(db);
 }
 
+bool gatt_db_set_shared(struct gatt_db *db, bool shared)
+{
+	if (!db)
+		return false;
+
+	db->shared = shared;
+
+	return true;
+}
+
+static void db_read_lock(struct gatt_db *db)
+{
+	if (db->shared)
+		pthread_rwlock_rdlock(&db->lock);
+}
+
+static void db_write_lock(struct gatt_db *db)
+{
+	if (db->shared)
+		pthread_rwlock_wrlock(&db->lock);
+}
+
+static void db_unlock(struct gatt_db *db)
+{
+	if (db->shared)
+		pthread_rwlock_unlock(&db->lock);
+}
+
 static void notify_destroy(void *data)
 {
 	struct notify *notify = data;
@@ -310,6 +352,7 @@ static void gatt_db_destroy(struct gatt_db *db)
 	db->notify_list = NULL;
 
 	queue_destroy(db->services, gatt_db_service_destroy);
+	pthread_rwlock_destroy(&db->lock);
 	free(db);
 }
 
@@ -1714,7 +1757,9 @@ static bool read_timeout(void *user_data)
 
 	p->timeout_id = 0;
 
+	db_write_lock(p->attrib->service->db);
 	queue_remove(p->attrib->pending_reads, p);
+	db_unlock(p->attrib->service->db);
 
 	pending_read_result(p, -ETIMEDOUT, NULL, 0);
 
@@ -1725,29 +1770,62 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 				uint8_t opcode, struct bt_att *att,
 				gatt_db_attribute_read_t func, void *user_data)
 {
+	struct gatt_db *db;
+	uint8_t buf[BT_ATT_MAX_VALUE_LEN];
 	uint8_t *value;
+	size_t len;
 
 	if (!attrib || !func)
 		return false;
 
+	db = attrib->service->db;
+
 	if (attrib->read_func) {
 		struct pending_read *p;
 
 		p = new0(struct pending_read, 1);
 		p->attrib = attrib;
-		p->id = ++attrib->read_id;
 		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, read_timeout,
 								p, NULL);
 		p->func = func;
 		p->user_data = user_data;
 
+		db_write_lock(db);
+		p->id = ++attrib->read_id;
 		queue_push_tail(attrib->pending_reads, p);
+		db_unlock(db);
 
 		attrib->read_func(attrib, p->id, offset, opcode, att,
 							attrib->user_data);
 		return true;
 	}
 
+	if (!db->shared)
+		goto unlocked;
+
+	/*
+	 * A shared database may have the value replaced by another thread
+	 * once the lock is dropped, so hand out a snapshot instead.
+	 */
+	db_read_lock(db);
+
+	if (offset > attrib->value_len) {
+		db_unlock(db);
+		func(attrib, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0, user_data);
+		return true;
+	}
+
+	len = MIN(attrib->value_len - offset, sizeof(buf));
+	if (len)
+		memcpy(buf, &attrib->value[offset], len);
+
+	db_unlock(db);
+
+	func(attrib, 0, len ? buf : NULL, len, user_data);
+
+	return true;
+
+unlocked:
 	/* Check boundary if value is stored in the db */
 	if (offset > attrib->value_len) {
 		func(attrib, BT_ATT_ERROR_INVALID_OFFSET, NULL, 0, user_data);
@@ -1779,8 +1857,10 @@ bool gatt_db_attribute_read_result(struct gatt_db_attribute *attrib,
 	if (!attrib || !id)
 		return false;
 
+	db_write_lock(attrib->service->db);
 	p = queue_remove_if(attrib->pending_reads, find_pending,
 							UINT_TO_PTR(id));
+	db_unlock(attrib->service->db);
 	if (!p)
 		return false;
 
@@ -1795,7 +1875,9 @@ static bool write_timeout(void *user_data)
 
 	p->timeout_id = 0;
 
+	db_write_lock(p->attrib->service->db);
 	queue_remove(p->attrib->pending_writes, p);
+	db_unlock(p->attrib->service->db);
 
 	pending_write_result(p, -ETIMEDOUT);
 
@@ -1808,21 +1890,27 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 					gatt_db_attribute_write_t func,
 					void *user_data)
 {
+	struct gatt_db *db;
+
 	if (!attrib || !func)
 		return false;
 
+	db = attrib->service->db;
+
 	if (attrib->write_func) {
 		struct pending_write *p;
 
 		p = new0(struct pending_write, 1);
 		p->attrib = attrib;
-		p->id = ++attrib->write_id;
 		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, write_timeout,
 								p, NULL);
 		p->func = func;
 		p->user_data = user_data;
 
+		db_write_lock(db);
+		p->id = ++attrib->write_id;
 		queue_push_tail(attrib->pending_writes, p);
+		db_unlock(db);
 
 		attrib->write_func(attrib, p->id, offset, value, len, opcode,
 							att, attrib->user_data);
@@ -1833,14 +1921,18 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 	if (len == 0)
 		goto done;
 
+	db_write_lock(db);
+
 	/* For values stored in db allocate on demand */
 	if (!attrib->value || offset >= attrib->value_len ||
 				len > (unsigned) (attrib->value_len - offset)) {
 		void *buf;
 
 		buf = realloc(attrib->value, len + offset);
-		if (!buf)
+		if (!buf) {
+			db_unlock(db);
 			return false;
+		}
 
 		attrib->value = buf;
 
@@ -1853,6 +1945,8 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 
 	memcpy(&attrib->value[offset], value, len);
 
+	db_unlock(db);
+
 done:
 	func(attrib, 0, user_data);
 
@@ -1867,8 +1961,10 @@ bool gatt_db_attribute_write_result(struct gatt_db_attribute *attrib,
 	if (!attrib || !id)
 		return false;
 
+	db_write_lock(attrib->service->db);
 	p = queue_remove_if(attrib->pending_writes, find_pending,
 							UINT_TO_PTR(id));
+	db_unlock(attrib->service->db);
 	if (!p)
 		return false;
 
@@ -1885,9 +1981,11 @@ bool gatt_db_attribute_reset(struct gatt_db_attribute *attrib)
 	if (!attrib->value || !attrib->value_len)
 		return true;
 
+	db_write_lock(attrib->service->db);
 	free(attrib->value);
 	attrib->value = NULL;
 	attrib->value_len = 0;
+	db_unlock(attrib->service->db);
 
 	return true;
 }
@@ -37,6 +37,22 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/*
+ * Result chunks of a request are carved out of blocks of a per-request arena,
+ * each block twice the size of the previous one, so the number of
+ * allocations grows with the log of the database size rather than with the
+ * number of responses.
+ */
+#define RESULT_BLOCK_MIN	512
+#define RESULT_BLOCK_MAX	16384
+
+struct result_block {
+	struct result_block *next;
+	size_t size;
+	size_t used;
+	uint8_t data[];
+};
+
 struct bt_gatt_result {
 	uint8_t opcode;
 	void *pdu;
@@ -48,21 +64,69 @@ struct bt_gatt_result {
 	struct bt_gatt_result *next;
 };
 
+struct bt_gatt_request {
+	struct bt_att *att;
+	unsigned int id;
+	uint16_t start_handle;
+	uint16_t end_handle;
+	int ref_count;
+	bt_uuid_t uuid;
+	uint16_t service_type;
+	struct bt_gatt_result *result_head;
+	struct bt_gatt_result *result_tail;
+	struct result_block *result_blocks;
+	unsigned int result_count;
+	bt_gatt_request_callback_t callback;
+	void *user_data;
+	bt_gatt_destroy_func_t destroy;
+};
+
+static void *result_alloc(struct bt_gatt_request *op, size_t len)
+{
+	struct result_block *block = op->result_blocks;
+	size_t size;
+	void *ptr;
+
+	/* Keep every chunk pointer aligned */
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!block || block->size - block->used < len) {
+		size = block ? block->size * 2 : RESULT_BLOCK_MIN;
+		if (size > RESULT_BLOCK_MAX)
+			size = RESULT_BLOCK_MAX;
+		if (size < len)
+			size = len;
+
+		block = malloc(sizeof(*block) + size);
+		if (!block)
+			return NULL;
+
+		block->next = op->result_blocks;
+		block->size = size;
+		block->used = 0;
+		op->result_blocks = block;
+	}
+
+	ptr = block->data + block->used;
+	block->used += len;
+
+	return ptr;
+}
+
 static struct bt_gatt_result *result_create(uint8_t opcode, const void *pdu,
-							uint16_t pdu_len,
-							uint16_t data_len,
-							void *op)
+						uint16_t pdu_len,
+						uint16_t data_len,
+						struct bt_gatt_request *op)
 {
 	struct bt_gatt_result *result;
 
-	result = new0(struct bt_gatt_result, 1);
-	result->pdu = malloc(pdu_len);
-	if (!result->pdu) {
-		free(result);
+	result = result_alloc(op, sizeof(*result) + pdu_len);
+	if (!result)
 		return NULL;
-	}
 
+	memset(result, 0, sizeof(*result));
 	result->opcode = opcode;
+	result->pdu = result + 1;
 	result->pdu_len = pdu_len;
 	result->data_len = data_len;
 	result->op = op;
@@ -72,31 +136,32 @@ static struct bt_gatt_result *result_create(uint8_t opcode, const void *pdu,
 	return result;
 }
 
-static void result_destroy(struct bt_gatt_result *result)
+static void result_destroy(struct bt_gatt_request *op)
 {
-	struct bt_gatt_result *next;
-
-	while (result) {
-		next = result->next;
+	struct result_block *block;
 
-		free(result->pdu);
-		free(result);
-
-		result = next;
+	while ((block = op->result_blocks)) {
+		op->result_blocks = block->next;
+		free(block);
 	}
+
+	op->result_head = op->result_tail = NULL;
+	op->result_count = 0;
 }
 
 static unsigned int result_element_count(struct bt_gatt_result *result)
 {
+	struct bt_gatt_request *op = result->op;
 	unsigned int count = 0;
 	struct bt_gatt_result *cur;
 
-	cur = result;
+	/* Running count is kept for the whole request */
+	if (result == op->result_head)
+		return op->result_count;
 
-	while (cur) {
-		count += cur->pdu_len / cur->data_len;
-		cur = cur->next;
-	}
+	for (cur = result; cur; cur = cur->next)
+		if (cur->opcode != BT_ATT_OP_READ_RSP)
+			count += cur->pdu_len / cur->data_len;
 
 	return count;
 }
@@ -147,9 +212,6 @@ unsigned int bt_gatt_result_descriptor_count(struct bt_gatt_result *result)
 
 unsigned int bt_gatt_result_included_count(struct bt_gatt_result *result)
 {
-	struct bt_gatt_result *cur;
-	unsigned int count = 0;
-
 	if (!result)
 		return 0;
 
@@ -166,11 +228,7 @@ unsigned int bt_gatt_result_included_count(struct bt_gatt_result *result)
 	if (result->data_len != 6 && result->data_len != 8)
 		return 0;
 
-	for (cur = result; cur; cur = cur->next)
-		if (cur->opcode == BT_ATT_OP_READ_BY_TYPE_RSP)
-			count += cur->pdu_len / cur->data_len;
-
-	return count;
+	return result_element_count(result);
 }
 
 bool bt_gatt_iter_init(struct bt_gatt_iter *iter, struct bt_gatt_result *result)
@@ -206,21 +264,6 @@ static bool convert_uuid_le(const uint8_t *src, size_t len, uint8_t dst[16])
 	return true;
 }
 
-struct bt_gatt_request {
-	struct bt_att *att;
-	unsigned int id;
-	uint16_t start_handle;
-	uint16_t end_handle;
-	int ref_count;
-	bt_uuid_t uuid;
-	uint16_t service_type;
-	struct bt_gatt_result *result_head;
-	struct bt_gatt_result *result_tail;
-	bt_gatt_request_callback_t callback;
-	void *user_data;
-	bt_gatt_destroy_func_t destroy;
-};
-
 static struct bt_gatt_result *result_append(uint8_t opcode, const void *pdu,
 						uint16_t pdu_len,
 						uint16_t data_len,
@@ -239,6 +282,10 @@ static struct bt_gatt_result *result_append(uint8_t opcode, const void *pdu,
 		op->result_tail = result;
 	}
 
+	/* Included service UUIDs read separately are not elements */
+	if (opcode != BT_ATT_OP_READ_RSP && data_len)
+		op->result_count += pdu_len / data_len;
+
 	return result;
 }
 
@@ -593,7 +640,7 @@ void bt_gatt_request_unref(struct bt_gatt_request *req)
 	if (req->destroy)
 		req->destroy(req->user_data);
 
-	result_destroy(req->result_head);
+	result_destroy(req);
 
 	free(req);
 }
@@ -46,10 +46,30 @@
 #endif
 
 /*
- * TODO: This is an arbitrary limit. Come up with something reasonable or
- * perhaps an API to set this value if there is a use case for it.
+ * Per connection budget for queued Prepare Write data, in bytes. Every queued
+ * attribute region is also charged its bookkeeping overhead so that many tiny
+ * fragments cannot get around the limit. The default holds more than the
+ * 30 full 512 byte regions the old entry limit allowed, servers that want a
+ * tighter bound set it with bt_gatt_server_set_max_prep_size().
  */
-#define DEFAULT_MAX_PREP_QUEUE_LEN 30
+#define DEFAULT_MAX_PREP_QUEUE_SIZE 65536
+
+struct async_read_op;
+
+/*
+ * One attribute read of a multi-attribute request. All reads of a request
+ * are issued at once; completions are buffered here until every slot before
+ * them has been encoded so the response keeps handle order.
+ */
+struct read_slot {
+	struct async_read_op *op;
+	struct gatt_db_attribute *attr;
+	uint16_t handle;
+	bool done;
+	int err;
+	uint8_t *value;
+	size_t len;
+};
 
 struct async_read_op {
 	struct bt_gatt_server *server;
@@ -58,7 +78,13 @@ struct async_read_op {
 	uint8_t *pdu;
 	size_t pdu_len;
 	size_t value_len;
-	struct queue *db_data;
+	uint16_t mtu;
+
+	struct read_slot *slots;
+	unsigned int num_slots;
+	unsigned int next_slot;		/* Next slot to encode */
+	unsigned int pending;		/* Reads not completed yet */
+	bool issuing;
 };
 
 struct async_write_op {
@@ -72,17 +98,12 @@ struct prep_write_data {
 	uint16_t handle;
 	uint16_t offset;
 	uint16_t length;
+	uint16_t size;			/* Allocated size of value */
 
 	bool reliable_supported;
 };
 
-static void prep_write_data_destroy(void *user_data)
-{
-	struct prep_write_data *data = user_data;
-
-	free(data->value);
-	free(data);
-}
+static void prep_write_data_destroy(void *user_data);
 
 struct bt_gatt_server {
 	struct gatt_db *db;
@@ -106,7 +127,8 @@ struct bt_gatt_server {
 	uint8_t min_enc_size;
 
 	struct queue *prep_queue;
-	unsigned int max_prep_queue_len;
+	size_t prep_queue_size;
+	size_t max_prep_queue_size;
 
 	struct async_read_op *pending_read_op;
 	struct async_write_op *pending_write_op;
@@ -114,6 +136,10 @@ struct bt_gatt_server {
 	bt_gatt_server_debug_func_t debug_callback;
 	bt_gatt_server_destroy_func_t debug_destroy;
 	void *debug_data;
+
+	bt_gatt_server_write_func_t write_callback;
+	bt_gatt_server_destroy_func_t write_destroy;
+	void *write_data;
 };
 
 static void bt_gatt_server_free(struct bt_gatt_server *server)
@@ -121,6 +147,9 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 	if (server->debug_destroy)
 		server->debug_destroy(server->debug_data);
 
+	if (server->write_destroy)
+		server->write_destroy(server->write_data);
+
 	bt_att_unregister(server->att, server->mtu_id);
 	bt_att_unregister(server->att, server->read_by_grp_type_id);
 	bt_att_unregister(server->att, server->read_by_type_id);
@@ -147,6 +176,16 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 	free(server);
 }
 
+static void prep_write_data_destroy(void *user_data)
+{
+	struct prep_write_data *data = user_data;
+
+	data->server->prep_queue_size -= data->length + sizeof(*data);
+
+	free(data->value);
+	free(data);
+}
+
 static bool get_uuid_le(const uint8_t *uuid, size_t len, bt_uuid_t *out_uuid)
 {
 	uint128_t u128;
@@ -166,14 +205,49 @@ static bool get_uuid_le(const uint8_t *uuid, size_t len, bt_uuid_t *out_uuid)
 	return false;
 }
 
+/*
+ * All attribute writes go through here so that an owner of the server can
+ * route them elsewhere, e.g. to the thread that serializes database writes.
+ */
+static bool server_attribute_write(struct bt_gatt_server *server,
+					struct gatt_db_attribute *attrib,
+					uint16_t offset, const uint8_t *value,
+					size_t len, uint8_t opcode,
+					gatt_db_attribute_write_t func,
+					void *user_data)
+{
+	if (server->write_callback)
+		return server->write_callback(server, attrib, offset, value,
+							len, opcode, func,
+							user_data,
+							server->write_data);
+
+	return gatt_db_attribute_write(attrib, offset, value, len, opcode,
+						server->att, func, user_data);
+}
+
+struct read_value {
+	uint8_t data[BT_ATT_MAX_VALUE_LEN];
+	size_t len;
+};
+
+/*
+ * The value is only valid during the callback, a shared database hands out
+ * a snapshot on the stack, so it is copied.
+ */
 static void attribute_read_cb(struct gatt_db_attribute *attrib, int err,
 					const uint8_t *value, size_t length,
 					void *user_data)
 {
-	struct iovec *iov = user_data;
+	struct read_value *val = user_data;
+
+	if (err || !value) {
+		val->len = 0;
+		return;
+	}
 
-	iov->iov_base = (void *) value;
-	iov->iov_len = length;
+	val->len = MIN(length, sizeof(val->data));
+	memcpy(val->data, value, val->len);
 }
 
 static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
@@ -183,7 +257,7 @@ static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
 {
 	int iter = 0;
 	uint16_t start_handle, end_handle;
-	struct iovec value;
+	struct read_value value;
 	uint8_t data_val_len;
 
 	*len = 0;
@@ -191,8 +265,7 @@ static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
 	while (queue_peek_head(q)) {
 		struct gatt_db_attribute *attrib = queue_pop_head(q);
 
-		value.iov_base = NULL;
-		value.iov_len = 0;
+		value.len = 0;
 
 		/*
 		 * This should never be deferred to the read callback for
@@ -201,7 +274,7 @@ static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
 		if (!gatt_db_attribute_read(attrib, 0,
 						BT_ATT_OP_READ_BY_GRP_TYPE_REQ,
 						att, attribute_read_cb,
-						&value) || !value.iov_len)
+						&value) || !value.len)
 			return false;
 
 		/*
@@ -211,10 +284,10 @@ static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
 		 */
 		if (iter == 0) {
 			data_val_len = MIN(MIN((unsigned)mtu - 6, 251),
-								value.iov_len);
+								value.len);
 			pdu[0] = data_val_len + 4;
 			iter++;
-		} else if (value.iov_len != data_val_len)
+		} else if (value.len != data_val_len)
 			break;
 
 		/* Stop if this unit would surpass the MTU */
@@ -226,7 +299,7 @@ static bool encode_read_by_grp_type_rsp(struct gatt_db *db, struct queue *q,
 
 		put_le16(start_handle, pdu + iter);
 		put_le16(end_handle, pdu + iter + 2);
-		memcpy(pdu + iter + 4, value.iov_base, data_val_len);
+		memcpy(pdu + iter + 4, value.data, data_val_len);
 
 		iter += data_val_len + 4;
 	}
@@ -316,69 +389,24 @@ error:
 	bt_att_send_error_rsp(server->att, opcode, ehandle, ecode);
 }
 
-static void async_read_op_destroy(struct async_read_op *op)
+static void read_op_free(struct async_read_op *op)
 {
-	if (op->server)
-		op->server->pending_read_op = NULL;
+	unsigned int i;
 
-	queue_destroy(op->db_data, NULL);
+	for (i = 0; i < op->num_slots; i++)
+		free(op->slots[i].value);
+
+	free(op->slots);
 	free(op->pdu);
 	free(op);
 }
 
-static void process_read_by_type(struct async_read_op *op);
-
-static void read_by_type_read_complete_cb(struct gatt_db_attribute *attr,
-						int err, const uint8_t *value,
-						size_t len, void *user_data)
+static void async_read_op_destroy(struct async_read_op *op)
 {
-	struct async_read_op *op = user_data;
-	struct bt_gatt_server *server = op->server;
-	uint16_t mtu;
-	uint16_t handle;
-
-	if (!server) {
-		async_read_op_destroy(op);
-		return;
-	}
-
-	mtu = bt_att_get_mtu(server->att);
-	handle = gatt_db_attribute_get_handle(attr);
-
-	/* Terminate the operation if there was an error */
-	if (err) {
-		bt_att_send_error_rsp(server->att, BT_ATT_OP_READ_BY_TYPE_REQ,
-								handle, err);
-		async_read_op_destroy(op);
-		return;
-	}
-
-	if (op->pdu_len == 0) {
-		op->value_len = MIN(MIN((unsigned) mtu - 4, 253), len);
-		op->pdu[0] = op->value_len + 2;
-		op->pdu_len++;
-	} else if (len != op->value_len) {
-		op->done = true;
-		goto done;
-	}
-
-	/* Stop if this would surpass the MTU */
-	if (op->pdu_len + op->value_len + 2 > (unsigned) mtu - 1) {
-		op->done = true;
-		goto done;
-	}
-
-	/* Encode the current value */
-	put_le16(handle, op->pdu + op->pdu_len);
-	memcpy(op->pdu + op->pdu_len + 2, value, op->value_len);
-
-	op->pdu_len += op->value_len + 2;
-
-	if (op->pdu_len == (unsigned) mtu - 1)
-		op->done = true;
+	if (op->server)
+		op->server->pending_read_op = NULL;
 
-done:
-	process_read_by_type(op);
+	read_op_free(op);
 }
 
 static bool check_min_key_size(uint8_t min_size, uint8_t size)
@@ -439,39 +467,220 @@ static uint8_t check_permissions(struct bt_gatt_server *server,
 	return 0;
 }
 
-static void process_read_by_type(struct async_read_op *op)
+static void read_op_finish(struct async_read_op *op, int err,
+							uint16_t ehandle)
 {
 	struct bt_gatt_server *server = op->server;
-	uint8_t ecode;
-	struct gatt_db_attribute *attr;
+	uint8_t rsp_opcode;
 
-	attr = queue_pop_head(op->db_data);
+	op->done = true;
+	server->pending_read_op = NULL;
 
-	if (op->done || !attr) {
-		bt_att_send(server->att, BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
-								op->pdu_len,
-								NULL, NULL,
-								NULL);
-		async_read_op_destroy(op);
+	if (err) {
+		bt_att_send_error_rsp(server->att, op->opcode, ehandle, err);
 		return;
 	}
 
-	ecode = check_permissions(server, attr, BT_ATT_PERM_READ |
+	if (op->opcode == BT_ATT_OP_READ_BY_TYPE_REQ)
+		rsp_opcode = BT_ATT_OP_READ_BY_TYPE_RSP;
+	else
+		rsp_opcode = BT_ATT_OP_READ_MULT_RSP;
+
+	bt_att_send(server->att, rsp_opcode, op->pdu, op->pdu_len,
+							NULL, NULL, NULL);
+}
+
+static void read_op_release(struct async_read_op *op)
+{
+	if (op->pending || op->issuing)
+		return;
+
+	if (op->done || !op->server)
+		read_op_free(op);
+}
+
+static void read_op_encode(struct async_read_op *op, struct read_slot *slot,
+					const uint8_t *value, size_t len)
+{
+	unsigned int mtu = op->mtu;
+
+	if (slot->err) {
+		read_op_finish(op, slot->err, slot->handle);
+		return;
+	}
+
+	if (op->opcode == BT_ATT_OP_READ_MULT_REQ) {
+		len = MIN(len, mtu - 1 - op->pdu_len);
+
+		if (len)
+			memcpy(op->pdu + op->pdu_len, value, len);
+
+		op->pdu_len += len;
+
+		if (op->pdu_len >= mtu - 1)
+			read_op_finish(op, 0, 0);
+
+		return;
+	}
+
+	if (op->pdu_len == 0) {
+		op->value_len = MIN(MIN(mtu - 4, 253), len);
+		op->pdu[0] = op->value_len + 2;
+		op->pdu_len++;
+	} else if (len != op->value_len) {
+		read_op_finish(op, 0, 0);
+		return;
+	}
+
+	/* Stop if this would surpass the MTU */
+	if (op->pdu_len + op->value_len + 2 > mtu - 1) {
+		read_op_finish(op, 0, 0);
+		return;
+	}
+
+	/* Encode the current value */
+	put_le16(slot->handle, op->pdu + op->pdu_len);
+	if (op->value_len)
+		memcpy(op->pdu + op->pdu_len + 2, value, op->value_len);
+
+	op->pdu_len += op->value_len + 2;
+
+	if (op->pdu_len == mtu - 1)
+		read_op_finish(op, 0, 0);
+}
+
+static void read_op_advance(struct async_read_op *op)
+{
+	struct read_slot *slot;
+
+	while (!op->done && op->next_slot < op->num_slots) {
+		slot = &op->slots[op->next_slot];
+		if (!slot->done)
+			return;
+
+		op->next_slot++;
+		read_op_encode(op, slot, slot->value, slot->len);
+	}
+
+	if (!op->done)
+		read_op_finish(op, 0, 0);
+}
+
+static void read_slot_complete_cb(struct gatt_db_attribute *attr, int err,
+					const uint8_t *value, size_t len,
+					void *user_data)
+{
+	struct read_slot *slot = user_data;
+	struct async_read_op *op = slot->op;
+
+	op->pending--;
+
+	if (op->done || !op->server) {
+		read_op_release(op);
+		return;
+	}
+
+	slot->done = true;
+	slot->err = err;
+
+	if (!err && slot == &op->slots[op->next_slot]) {
+		/* In order completion, encode straight from the callback */
+		op->next_slot++;
+		read_op_encode(op, slot, value, len);
+	} else if (!err && len) {
+		slot->len = MIN(len, (size_t) op->mtu);
+		slot->value = malloc(slot->len);
+		if (slot->value)
+			memcpy(slot->value, value, slot->len);
+		else
+			slot->err = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+	}
+
+	read_op_advance(op);
+	read_op_release(op);
+}
+
+static void read_op_add_slot(struct async_read_op *op,
+					struct gatt_db_attribute *attr,
+					uint16_t handle)
+{
+	struct read_slot *slot = &op->slots[op->num_slots++];
+
+	slot->op = op;
+	slot->attr = attr;
+	slot->handle = handle;
+
+	if (!attr) {
+		slot->err = BT_ATT_ERROR_INVALID_HANDLE;
+		slot->done = true;
+		return;
+	}
+
+	slot->err = check_permissions(op->server, attr, BT_ATT_PERM_READ |
 						BT_ATT_PERM_READ_AUTHEN |
 						BT_ATT_PERM_READ_ENCRYPT);
-	if (ecode)
-		goto error;
+	if (slot->err)
+		slot->done = true;
+}
 
-	if (gatt_db_attribute_read(attr, 0, op->opcode, server->att,
-					read_by_type_read_complete_cb, op))
-		return;
+static struct async_read_op *read_op_new(struct bt_gatt_server *server,
+						uint8_t opcode,
+						unsigned int max_slots)
+{
+	struct async_read_op *op;
 
-	ecode = BT_ATT_ERROR_UNLIKELY;
+	op = new0(struct async_read_op, 1);
+	op->mtu = bt_att_get_mtu(server->att);
+	op->pdu = malloc(op->mtu);
+	if (!op->pdu) {
+		free(op);
+		return NULL;
+	}
 
-error:
-	bt_att_send_error_rsp(server->att, BT_ATT_OP_READ_BY_TYPE_REQ,
-				gatt_db_attribute_get_handle(attr), ecode);
-	async_read_op_destroy(op);
+	op->opcode = opcode;
+	op->server = server;
+	op->slots = new0(struct read_slot, max_slots);
+
+	return op;
+}
+
+/*
+ * Start the reads of every slot up to the first one that is already known
+ * to fail; the response cannot extend past it anyway.
+ */
+static void read_op_issue(struct async_read_op *op)
+{
+	struct bt_gatt_server *server = op->server;
+	unsigned int i;
+
+	server->pending_read_op = op;
+	op->issuing = true;
+
+	for (i = 0; i < op->num_slots && !op->done && op->server; i++) {
+		struct read_slot *slot = &op->slots[i];
+
+		if (slot->done)
+			break;
+
+		op->pending++;
+
+		if (gatt_db_attribute_read(slot->attr, 0, op->opcode,
+						server->att,
+						read_slot_complete_cb, slot))
+			continue;
+
+		op->pending--;
+		slot->err = BT_ATT_ERROR_UNLIKELY;
+		slot->done = true;
+		break;
+	}
+
+	op->issuing = false;
+
+	if (op->server)
+		read_op_advance(op);
+
+	read_op_release(op);
 }
 
 static void read_by_type_cb(uint8_t opcode, const void *pdu,
@@ -484,6 +693,7 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 	uint8_t ecode;
 	struct queue *q = NULL;
 	struct async_read_op *op;
+	unsigned int max_slots;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
@@ -524,20 +734,25 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	op = new0(struct async_read_op, 1);
-	op->pdu = malloc(bt_att_get_mtu(server->att));
-	if (!op->pdu) {
-		free(op);
+	/* Each entry takes at least its handle, nothing past this can fit */
+	max_slots = MIN(queue_length(q),
+			((unsigned int) bt_att_get_mtu(server->att) - 2) / 2);
+
+	op = read_op_new(server, opcode, max_slots);
+	if (!op) {
 		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 		goto error;
 	}
 
-	op->opcode = opcode;
-	op->server = server;
-	op->db_data = q;
-	server->pending_read_op = op;
+	while (op->num_slots < max_slots) {
+		struct gatt_db_attribute *attr = queue_pop_head(q);
 
-	process_read_by_type(op);
+		read_op_add_slot(op, attr, gatt_db_attribute_get_handle(attr));
+	}
+
+	queue_destroy(q, NULL);
+
+	read_op_issue(op);
 
 	return;
 
@@ -827,8 +1042,8 @@ static void write_cb(uint8_t opcode, const void *pdu,
 	op->opcode = opcode;
 	server->pending_write_op = op;
 
-	if (gatt_db_attribute_write(attr, 0, pdu + 2, length - 2, opcode,
-							server->att,
+	if (server_attribute_write(server, attr, 0, pdu + 2, length - 2,
+							opcode,
 							write_complete_cb, op))
 		return;
 
@@ -981,143 +1196,46 @@ static void read_blob_cb(uint8_t opcode, const void *pdu,
 	handle_read_req(server, opcode, handle, offset);
 }
 
-struct read_multiple_resp_data {
-	struct bt_gatt_server *server;
-	uint16_t *handles;
-	size_t cur_handle;
-	size_t num_handles;
-	uint8_t *rsp_data;
-	size_t length;
-	size_t mtu;
-};
-
-static void read_multiple_resp_data_free(struct read_multiple_resp_data *data)
-{
-	free(data->handles);
-	free(data->rsp_data);
-	free(data);
-}
-
-static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
-					const uint8_t *value, size_t len,
-					void *user_data)
-{
-	struct read_multiple_resp_data *data = user_data;
-	struct gatt_db_attribute *next_attr;
-	uint16_t handle = gatt_db_attribute_get_handle(attr);
-	uint8_t ecode;
-
-	if (err != 0) {
-		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ, handle, err);
-		read_multiple_resp_data_free(data);
-		return;
-	}
-
-	ecode = check_permissions(data->server, attr, BT_ATT_PERM_READ |
-						BT_ATT_PERM_READ_AUTHEN |
-						BT_ATT_PERM_READ_ENCRYPT);
-	if (ecode) {
-		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ, handle, ecode);
-		read_multiple_resp_data_free(data);
-		return;
-	}
-
-	len = MIN(len, data->mtu - data->length - 1);
-
-	memcpy(data->rsp_data + data->length, value, len);
-	data->length += len;
-
-	data->cur_handle++;
-
-	if ((data->length >= data->mtu - 1) ||
-				(data->cur_handle == data->num_handles)) {
-		bt_att_send(data->server->att, BT_ATT_OP_READ_MULT_RSP,
-				data->rsp_data, data->length, NULL, NULL, NULL);
-		read_multiple_resp_data_free(data);
-		return;
-	}
-
-	util_debug(data->server->debug_callback, data->server->debug_data,
-				"Read Multiple Req - #%zu of %zu: 0x%04x",
-				data->cur_handle + 1, data->num_handles,
-				data->handles[data->cur_handle]);
-
-	next_attr = gatt_db_get_attribute(data->server->db,
-					data->handles[data->cur_handle]);
-
-	if (!next_attr) {
-		bt_att_send_error_rsp(data->server->att,
-					BT_ATT_OP_READ_MULT_REQ,
-					data->handles[data->cur_handle],
-					BT_ATT_ERROR_INVALID_HANDLE);
-		read_multiple_resp_data_free(data);
-		return;
-	}
-
-	if (!gatt_db_attribute_read(next_attr, 0, BT_ATT_OP_READ_MULT_REQ,
-					data->server->att,
-					read_multiple_complete_cb, data)) {
-		bt_att_send_error_rsp(data->server->att,
-						BT_ATT_OP_READ_MULT_REQ,
-						data->handles[data->cur_handle],
-						BT_ATT_ERROR_UNLIKELY);
-		read_multiple_resp_data_free(data);
-	}
-}
-
 static void read_multiple_cb(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
 	struct bt_gatt_server *server = user_data;
-	struct gatt_db_attribute *attr;
-	struct read_multiple_resp_data *data = NULL;
+	struct async_read_op *op;
 	uint8_t ecode = BT_ATT_ERROR_UNLIKELY;
-	size_t i = 0;
+	unsigned int num_handles, i;
 
 	if (length < 4) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
-	data = new0(struct read_multiple_resp_data, 1);
-	data->handles = NULL;
-	data->rsp_data = NULL;
-	data->server = server;
-	data->num_handles = length / 2;
-	data->cur_handle = 0;
-	data->mtu = bt_att_get_mtu(server->att);
-	data->length = 0;
-	data->rsp_data = malloc(data->mtu - 1);
-
-	if (!data->rsp_data)
+	if (server->pending_read_op)
 		goto error;
 
-	data->handles = new0(uint16_t, data->num_handles);
-
-	for (i = 0; i < data->num_handles; i++)
-		data->handles[i] = get_le16(pdu + i * 2);
+	num_handles = length / 2;
 
 	util_debug(server->debug_callback, server->debug_data,
-			"Read Multiple Req - %zu handles, 1st: 0x%04x",
-			data->num_handles, data->handles[0]);
-
-	attr = gatt_db_get_attribute(server->db, data->handles[0]);
+			"Read Multiple Req - %u handles, 1st: 0x%04x",
+			num_handles, get_le16(pdu));
 
-	if (!attr) {
-		ecode = BT_ATT_ERROR_INVALID_HANDLE;
+	op = read_op_new(server, opcode, num_handles);
+	if (!op) {
+		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 		goto error;
 	}
 
-	if (gatt_db_attribute_read(attr, 0, opcode, server->att,
-					read_multiple_complete_cb, data))
-		return;
+	for (i = 0; i < num_handles; i++) {
+		uint16_t handle = get_le16(pdu + i * 2);
 
-error:
-	if (data)
-		read_multiple_resp_data_free(data);
+		read_op_add_slot(op, gatt_db_get_attribute(server->db, handle),
+									handle);
+	}
+
+	read_op_issue(op);
 
+	return;
+
+error:
 	bt_att_send_error_rsp(server->att, opcode, 0, ecode);
 }
 
@@ -1125,21 +1243,33 @@ static bool append_prep_data(struct prep_write_data *prep_data, uint16_t handle,
 					uint16_t length, uint8_t *value)
 {
 	uint8_t *val;
-	uint16_t len;
+	size_t len;
 
 	if (!length)
 		return true;
 
 	len = prep_data->length + length;
-
-	val = realloc(prep_data->value, len);
-	if (!val)
+	if (len + prep_data->offset > UINT16_MAX)
 		return false;
 
-	memcpy(val + prep_data->length, value, length);
+	/* Grow geometrically so long writes do not realloc per fragment */
+	if (len > prep_data->size) {
+		size_t size = MAX(len, (size_t) prep_data->size * 2);
+
+		size = MIN(size, (size_t) UINT16_MAX);
+
+		val = realloc(prep_data->value, size);
+		if (!val)
+			return false;
+
+		prep_data->value = val;
+		prep_data->size = size;
+	}
+
+	memcpy(prep_data->value + prep_data->length, value, length);
 
-	prep_data->value = val;
 	prep_data->length = len;
+	prep_data->server->prep_queue_size += length;
 
 	return true;
 }
@@ -1168,16 +1298,16 @@ static bool prep_data_new(struct bt_gatt_server *server,
 	struct prep_write_data *prep_data;
 
 	prep_data = new0(struct prep_write_data, 1);
+	prep_data->server = server;
+	prep_data->handle = handle;
+	prep_data->offset = offset;
+	server->prep_queue_size += sizeof(*prep_data);
 
 	if (!append_prep_data(prep_data, handle, length, value)) {
 		prep_write_data_destroy(prep_data);
 		return false;
 	}
 
-	prep_data->server = server;
-	prep_data->handle = handle;
-	prep_data->offset = offset;
-
 	/*
 	 * Handle is the value handle. We need characteristic declaration
 	 * handle which in BlueZ is handle_value -1
@@ -1190,22 +1320,41 @@ static bool prep_data_new(struct bt_gatt_server *server,
 	return true;
 }
 
-static bool store_prep_data(struct bt_gatt_server *server,
+static uint8_t store_prep_data(struct bt_gatt_server *server,
 					uint16_t handle, uint16_t offset,
 					uint16_t length, uint8_t *value)
 {
 	struct prep_write_data *prep_data = NULL;
+	size_t cost = length;
 
 	/*
 	 * Now lets check if prep write is a continuation of long write
-	 * If so do aggregation of data
+	 * If so do aggregation of data. Only the tail may grow: merging
+	 * into an earlier entry would move its bytes past later writes to
+	 * the same range and change the result of Execute Write.
 	 */
 	prep_data = queue_peek_tail(server->prep_queue);
-	if (prep_data && (prep_data->handle == handle) &&
-			(offset == (prep_data->length + prep_data->offset)))
-		return append_prep_data(prep_data, handle, length, value);
+	if (prep_data && (prep_data->handle != handle ||
+			offset != prep_data->offset + prep_data->length))
+		prep_data = NULL;
+
+	if (!prep_data)
+		cost += sizeof(*prep_data);
+
+	if (server->prep_queue_size + cost > server->max_prep_queue_size)
+		return BT_ATT_ERROR_PREPARE_QUEUE_FULL;
+
+	if (prep_data) {
+		if (!append_prep_data(prep_data, handle, length, value))
+			return BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+
+		return 0;
+	}
 
-	return prep_data_new(server, handle, offset, length, value);
+	if (!prep_data_new(server, handle, offset, length, value))
+		return BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+
+	return 0;
 }
 
 struct prep_write_complete_data {
@@ -1220,6 +1369,7 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 	struct prep_write_complete_data *pwcd = user_data;
 	uint16_t handle = 0;
 	uint16_t offset;
+	uint8_t ecode;
 
 	handle = get_le16(pwcd->pdu);
 
@@ -1234,14 +1384,16 @@ static void prep_write_complete_cb(struct gatt_db_attribute *attr, int err,
 
 	offset = get_le16(pwcd->pdu + 2);
 
-	if (!store_prep_data(pwcd->server, handle, offset, pwcd->length - 4,
-						&((uint8_t *) pwcd->pdu)[4]))
+	ecode = store_prep_data(pwcd->server, handle, offset, pwcd->length - 4,
+						&((uint8_t *) pwcd->pdu)[4]);
+	if (ecode)
 		bt_att_send_error_rsp(pwcd->server->att,
-					BT_ATT_OP_PREP_WRITE_RSP, handle,
-					BT_ATT_ERROR_INSUFFICIENT_RESOURCES);
-
-	bt_att_send(pwcd->server->att, BT_ATT_OP_PREP_WRITE_RSP, pwcd->pdu,
-						pwcd->length, NULL, NULL, NULL);
+					BT_ATT_OP_PREP_WRITE_REQ, handle,
+					ecode);
+	else
+		bt_att_send(pwcd->server->att, BT_ATT_OP_PREP_WRITE_RSP,
+						pwcd->pdu, pwcd->length,
+						NULL, NULL, NULL);
 
 	free(pwcd->pdu);
 	free(pwcd);
@@ -1262,7 +1414,9 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	if (queue_length(server->prep_queue) >= server->max_prep_queue_len) {
+	/* Early reject, store_prep_data() also counts a new entry's size */
+	if (server->prep_queue_size + length - 4 >
+					server->max_prep_queue_size) {
 		ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
 		goto error;
 	}
@@ -1291,9 +1445,8 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 	pwcd->length = length;
 	pwcd->server = server;
 
-	status = gatt_db_attribute_write(attr, offset, NULL, 0,
+	status = server_attribute_write(server, attr, offset, NULL, 0,
 						BT_ATT_OP_PREP_WRITE_REQ,
-						server->att,
 						prep_write_complete_cb, pwcd);
 
 	if (status)
@@ -1340,10 +1493,9 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 		goto error;
 	}
 
-	status = gatt_db_attribute_write(attr, next->offset,
+	status = server_attribute_write(server, attr, next->offset,
 						next->value, next->length,
 						BT_ATT_OP_EXEC_WRITE_REQ,
-						server->att,
 						exec_write_complete_cb, server);
 
 	prep_write_data_destroy(next);
@@ -1568,7 +1720,7 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 	server->db = gatt_db_ref(db);
 	server->att = bt_att_ref(att);
 	server->mtu = MAX(mtu, BT_ATT_DEFAULT_LE_MTU);
-	server->max_prep_queue_len = DEFAULT_MAX_PREP_QUEUE_LEN;
+	server->max_prep_queue_size = DEFAULT_MAX_PREP_QUEUE_SIZE;
 	server->prep_queue = queue_new();
 	server->min_enc_size = min_enc_size;
 
@@ -1627,6 +1779,35 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 	return true;
 }
 
+bool bt_gatt_server_set_max_prep_size(struct bt_gatt_server *server,
+								size_t size)
+{
+	if (!server || !size)
+		return false;
+
+	server->max_prep_queue_size = size;
+
+	return true;
+}
+
+bool bt_gatt_server_set_write_handler(struct bt_gatt_server *server,
+					bt_gatt_server_write_func_t callback,
+					void *user_data,
+					bt_gatt_server_destroy_func_t destroy)
+{
+	if (!server)
+		return false;
+
+	if (server->write_destroy)
+		server->write_destroy(server->write_data);
+
+	server->write_callback = callback;
+	server->write_destroy = destroy;
+	server->write_data = user_data;
+
+	return true;
+}
+
 bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length)
@@ -0,0 +1,569 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/l2cap.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+#include "src/shared/gatt-shard.h"
+
+/* Shard that owns the database and runs all attribute writes */
+#define OWNER_SHARD 0
+
+struct gatt_shard {
+	struct bt_gatt_shards *shards;
+	unsigned int index;
+	pthread_t thread;
+	int event_fd;
+
+	pthread_mutex_t lock;
+	struct queue *inbox;		/* Work posted by other threads */
+	bool stopped;			/* No more work is taken */
+
+	struct queue *conns;		/* Only touched by the shard thread */
+	unsigned int num_conns;
+};
+
+struct bt_gatt_shards {
+	struct gatt_db *db;
+	uint16_t mtu;
+	uint8_t min_enc_size;
+	bool started;
+
+	unsigned int num_shards;
+	struct gatt_shard *shard;
+
+	bt_gatt_shards_attach_func_t attach_callback;
+	bt_gatt_shards_destroy_func_t attach_destroy;
+	void *attach_data;
+};
+
+typedef void (*shard_work_func_t)(struct gatt_shard *shard, void *data);
+
+struct shard_work {
+	shard_work_func_t func;
+	bt_gatt_shards_destroy_func_t destroy;
+	void *data;
+};
+
+struct shard_conn {
+	struct gatt_shard *shard;
+	struct bt_att *att;
+	struct bt_gatt_server *server;
+};
+
+/* Only referenced, completed and freed on the origin shard */
+struct shard_write {
+	struct gatt_shard *origin;
+	struct bt_gatt_server *server;
+	struct gatt_db_attribute *attrib;
+	uint16_t offset;
+	uint8_t opcode;
+	uint8_t *value;
+	size_t len;
+	gatt_db_attribute_write_t func;
+	void *func_data;
+	int err;
+};
+
+static bool shard_post(struct gatt_shard *shard, shard_work_func_t func,
+					bt_gatt_shards_destroy_func_t destroy,
+					void *data)
+{
+	struct shard_work *work;
+	uint64_t val = 1;
+
+	work = new0(struct shard_work, 1);
+	work->func = func;
+	work->destroy = destroy;
+	work->data = data;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (shard->stopped) {
+		pthread_mutex_unlock(&shard->lock);
+		free(work);
+		return false;
+	}
+
+	queue_push_tail(shard->inbox, work);
+	pthread_mutex_unlock(&shard->lock);
+
+	/* Fails only with the counter saturated, a wakeup is due anyway */
+	if (write(shard->event_fd, &val, sizeof(val)) < 0)
+		return true;
+
+	return true;
+}
+
+static void shard_work_drop(void *data)
+{
+	struct shard_work *work = data;
+
+	if (work->destroy)
+		work->destroy(work->data);
+
+	free(work);
+}
+
+static void shard_event_cb(int fd, uint32_t events, void *user_data)
+{
+	struct gatt_shard *shard = user_data;
+	struct shard_work *work;
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0)
+		return;
+
+	for (;;) {
+		pthread_mutex_lock(&shard->lock);
+		work = queue_pop_head(shard->inbox);
+		pthread_mutex_unlock(&shard->lock);
+
+		if (!work)
+			break;
+
+		work->func(shard, work->data);
+		free(work);
+	}
+}
+
+static void shard_quit(struct gatt_shard *shard, void *data)
+{
+	mainloop_quit();
+}
+
+static void write_free(struct shard_write *req)
+{
+	bt_gatt_server_unref(req->server);
+	free(req->value);
+	free(req);
+}
+
+/* Runs on the origin shard, also when its inbox is drained on shutdown */
+static void write_finish(void *data)
+{
+	struct shard_write *req = data;
+
+	req->func(req->attrib, req->err, req->func_data);
+	write_free(req);
+}
+
+static void write_complete(struct gatt_shard *shard, void *data)
+{
+	write_finish(data);
+}
+
+static void write_reply(struct shard_write *req, int err)
+{
+	req->err = err;
+
+	/*
+	 * The owner shard stops first and bt_gatt_shards_free() only stops
+	 * the others once it is gone, so the origin is still taking work.
+	 */
+	shard_post(req->origin, write_complete, write_finish, req);
+}
+
+static void write_done(struct gatt_db_attribute *attrib, int err,
+								void *user_data)
+{
+	write_reply(user_data, err);
+}
+
+/* Write work dropped by the owner shard still completes on the origin */
+static void write_abort(void *data)
+{
+	write_reply(data, BT_ATT_ERROR_UNLIKELY);
+}
+
+/*
+ * The bearer belongs to another thread's mainloop, so write callbacks get
+ * no bt_att here.
+ */
+static void write_exec(struct gatt_shard *shard, void *data)
+{
+	struct shard_write *req = data;
+
+	if (gatt_db_attribute_write(req->attrib, req->offset, req->value,
+						req->len, req->opcode,
+						NULL, write_done, req))
+		return;
+
+	write_abort(req);
+}
+
+static bool shard_write(struct bt_gatt_server *server,
+					struct gatt_db_attribute *attrib,
+					uint16_t offset, const uint8_t *value,
+					size_t len, uint8_t opcode,
+					gatt_db_attribute_write_t func,
+					void *func_data, void *user_data)
+{
+	struct shard_conn *conn = user_data;
+	struct gatt_shard *owner = &conn->shard->shards->shard[OWNER_SHARD];
+	struct shard_write *req;
+
+	if (conn->shard == owner)
+		return gatt_db_attribute_write(attrib, offset, value, len,
+						opcode, conn->att, func,
+						func_data);
+
+	req = new0(struct shard_write, 1);
+	req->origin = conn->shard;
+	req->server = bt_gatt_server_ref(server);
+	req->attrib = attrib;
+	req->offset = offset;
+	req->opcode = opcode;
+	req->func = func;
+	req->func_data = func_data;
+
+	if (len) {
+		req->value = malloc(len);
+		if (!req->value) {
+			write_free(req);
+			return false;
+		}
+
+		memcpy(req->value, value, len);
+		req->len = len;
+	}
+
+	if (!shard_post(owner, write_exec, write_abort, req)) {
+		write_free(req);
+		return false;
+	}
+
+	return true;
+}
+
+static void conn_free(void *data)
+{
+	struct shard_conn *conn = data;
+
+	bt_gatt_server_unref(conn->server);
+	bt_att_unref(conn->att);
+	free(conn);
+}
+
+static void conn_disconnect_cb(int err, void *user_data)
+{
+	struct shard_conn *conn = user_data;
+	struct gatt_shard *shard = conn->shard;
+
+	queue_remove(shard->conns, conn);
+	__sync_fetch_and_sub(&shard->num_conns, 1);
+
+	conn_free(conn);
+}
+
+static void attach_close(void *data)
+{
+	close(PTR_TO_INT(data));
+}
+
+static void attach_conn(struct gatt_shard *shard, void *data)
+{
+	struct bt_gatt_shards *shards = shard->shards;
+	struct shard_conn *conn;
+	int fd = PTR_TO_INT(data);
+
+	conn = new0(struct shard_conn, 1);
+	conn->shard = shard;
+
+	conn->att = bt_att_new(fd, false);
+	if (!conn->att) {
+		close(fd);
+		goto fail;
+	}
+
+	bt_att_set_close_on_unref(conn->att, true);
+
+	conn->server = bt_gatt_server_new(shards->db, conn->att, shards->mtu,
+							shards->min_enc_size);
+	if (!conn->server)
+		goto fail;
+
+	if (shards->num_shards > 1)
+		bt_gatt_server_set_write_handler(conn->server, shard_write,
+								conn, NULL);
+
+	if (!bt_att_register_disconnect(conn->att, conn_disconnect_cb, conn,
+									NULL))
+		goto fail;
+
+	queue_push_tail(shard->conns, conn);
+	__sync_fetch_and_add(&shard->num_conns, 1);
+
+	if (shards->attach_callback)
+		shards->attach_callback(conn->server, shard->index,
+							shards->attach_data);
+
+	return;
+
+fail:
+	conn_free(conn);
+}
+
+static void *shard_thread(void *data)
+{
+	struct gatt_shard *shard = data;
+
+	mainloop_init();
+
+	if (mainloop_add_fd(shard->event_fd, EPOLLIN, shard_event_cb,
+							shard, NULL) < 0)
+		return NULL;
+
+	mainloop_run();
+
+	/* Finish or drop what was posted on this thread, not the caller's */
+	pthread_mutex_lock(&shard->lock);
+	shard->stopped = true;
+	pthread_mutex_unlock(&shard->lock);
+
+	queue_remove_all(shard->inbox, NULL, NULL, shard_work_drop);
+	queue_remove_all(shard->conns, NULL, NULL, conn_free);
+	shard->num_conns = 0;
+
+	return NULL;
+}
+
+/*
+ * Hash on the peer address so that a reconnecting central lands on the same
+ * shard; fall back to the descriptor for non-L2CAP transports.
+ */
+static unsigned int conn_hash(int fd)
+{
+	struct sockaddr_l2 addr;
+	socklen_t len = sizeof(addr);
+	const uint8_t *key;
+	size_t key_len, i;
+	uint32_t hash = 2166136261u;
+
+	memset(&addr, 0, sizeof(addr));
+
+	if (!getpeername(fd, (struct sockaddr *) &addr, &len) &&
+					addr.l2_family == AF_BLUETOOTH) {
+		key = addr.l2_bdaddr.b;
+		key_len = sizeof(addr.l2_bdaddr.b);
+	} else {
+		key = (const uint8_t *) &fd;
+		key_len = sizeof(fd);
+	}
+
+	for (i = 0; i < key_len; i++) {
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+
+	/* Fold the high bits in, small shard counts only use the low ones */
+	return hash ^ (hash >> 16);
+}
+
+struct bt_gatt_shards *bt_gatt_shards_new(struct gatt_db *db,
+						unsigned int num_shards,
+						uint16_t mtu,
+						uint8_t min_enc_size)
+{
+	struct bt_gatt_shards *shards;
+	unsigned int i;
+
+	if (!db)
+		return NULL;
+
+	if (!num_shards) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		num_shards = cpus > 0 ? cpus : 1;
+	}
+
+	shards = new0(struct bt_gatt_shards, 1);
+	shards->db = gatt_db_ref(db);
+	shards->mtu = mtu;
+	shards->min_enc_size = min_enc_size;
+	shards->num_shards = num_shards;
+	shards->shard = new0(struct gatt_shard, num_shards);
+
+	for (i = 0; i < num_shards; i++) {
+		struct gatt_shard *shard = &shards->shard[i];
+
+		shard->shards = shards;
+		shard->index = i;
+		shard->inbox = queue_new();
+		shard->conns = queue_new();
+		pthread_mutex_init(&shard->lock, NULL);
+
+		shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (shard->event_fd < 0) {
+			shards->num_shards = i + 1;
+			bt_gatt_shards_free(shards);
+			return NULL;
+		}
+	}
+
+	if (num_shards > 1)
+		gatt_db_set_shared(db, true);
+
+	return shards;
+}
+
+void bt_gatt_shards_free(struct bt_gatt_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards)
+		return;
+
+	/*
+	 * Stop the owner first: writes it drops are completed on their
+	 * origin shards, which must still be running for that.
+	 */
+	if (shards->started) {
+		shard_post(&shards->shard[OWNER_SHARD], shard_quit, NULL, NULL);
+		pthread_join(shards->shard[OWNER_SHARD].thread, NULL);
+
+		for (i = 0; i < shards->num_shards; i++) {
+			if (i != OWNER_SHARD)
+				shard_post(&shards->shard[i], shard_quit,
+								NULL, NULL);
+		}
+
+		for (i = 0; i < shards->num_shards; i++) {
+			if (i != OWNER_SHARD)
+				pthread_join(shards->shard[i].thread, NULL);
+		}
+	}
+
+	/* Only work for shards that never ran can be left */
+	for (i = 0; i < shards->num_shards; i++) {
+		struct gatt_shard *shard = &shards->shard[i];
+
+		queue_destroy(shard->inbox, shard_work_drop);
+		queue_destroy(shard->conns, conn_free);
+		pthread_mutex_destroy(&shard->lock);
+
+		if (shard->event_fd >= 0)
+			close(shard->event_fd);
+	}
+
+	if (shards->attach_destroy)
+		shards->attach_destroy(shards->attach_data);
+
+	gatt_db_set_shared(shards->db, false);
+	gatt_db_unref(shards->db);
+	free(shards->shard);
+	free(shards);
+}
+
+bool bt_gatt_shards_set_attach_handler(struct bt_gatt_shards *shards,
+					bt_gatt_shards_attach_func_t callback,
+					void *user_data,
+					bt_gatt_shards_destroy_func_t destroy)
+{
+	if (!shards || shards->started)
+		return false;
+
+	if (shards->attach_destroy)
+		shards->attach_destroy(shards->attach_data);
+
+	shards->attach_callback = callback;
+	shards->attach_destroy = destroy;
+	shards->attach_data = user_data;
+
+	return true;
+}
+
+bool bt_gatt_shards_start(struct bt_gatt_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards || shards->started)
+		return false;
+
+	for (i = 0; i < shards->num_shards; i++) {
+		struct gatt_shard *shard = &shards->shard[i];
+
+		if (pthread_create(&shard->thread, NULL, shard_thread,
+								shard) != 0)
+			goto fail;
+	}
+
+	shards->started = true;
+
+	return true;
+
+fail:
+	while (i--) {
+		shard_post(&shards->shard[i], shard_quit, NULL, NULL);
+		pthread_join(shards->shard[i].thread, NULL);
+	}
+
+	return false;
+}
+
+int bt_gatt_shards_attach(struct bt_gatt_shards *shards, int fd)
+{
+	unsigned int index;
+
+	if (!shards || fd < 0)
+		return -EINVAL;
+
+	index = conn_hash(fd) % shards->num_shards;
+
+	if (!shard_post(&shards->shard[index], attach_conn, attach_close,
+							INT_TO_PTR(fd)))
+		return -ESHUTDOWN;
+
+	return index;
+}
+
+unsigned int bt_gatt_shards_get_count(struct bt_gatt_shards *shards)
+{
+	if (!shards)
+		return 0;
+
+	return shards->num_shards;
+}
+
+unsigned int bt_gatt_shards_get_connections(struct bt_gatt_shards *shards,
+							unsigned int shard)
+{
+	if (!shards || shard >= shards->num_shards)
+		return 0;
+
+	return __sync_fetch_and_add(&shards->shard[shard].num_conns, 0);
+}
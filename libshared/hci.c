@@ -0,0 +1,602 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
+#include "src/shared/io.h"
+#include "src/shared/queue.h"
+#include "src/shared/util.h"
+#include "src/shared/timeout.h"
+#include "src/shared/hci.h"
+
+/* Same as the kernel, after which the command credit is given back */
+#define HCI_CMD_TIMEOUT 2000
+
+struct bt_hci {
+	int ref_count;
+	struct io *io;
+	bool writer_active;
+	uint8_t num_cmds;
+	unsigned int next_cmd_id;
+	unsigned int next_evt_id;
+	struct queue *cmd_queue;	/* Waiting for a command credit */
+	struct queue *rsp_queue;	/* Sent, waiting for completion */
+	struct queue *evt_list;
+};
+
+struct cmd {
+	struct bt_hci *hci;
+	unsigned int id;
+	uint16_t opcode;
+	void *data;
+	uint8_t size;
+	unsigned int timeout_id;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+struct evt {
+	unsigned int id;
+	uint8_t event;
+	bt_hci_callback_func_t callback;
+	bt_hci_destroy_func_t destroy;
+	void *user_data;
+};
+
+static void cmd_free(void *data)
+{
+	struct cmd *cmd = data;
+
+	if (cmd->timeout_id)
+		timeout_remove(cmd->timeout_id);
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	free(cmd->data);
+	free(cmd);
+}
+
+/*
+ * A sent command stays queued until the controller completes it, so that
+ * its completion is not matched to a later command with the same opcode.
+ */
+static void cmd_detach(void *data, void *user_data)
+{
+	struct cmd *cmd = data;
+
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
+
+	cmd->callback = NULL;
+	cmd->destroy = NULL;
+	cmd->user_data = NULL;
+}
+
+static void evt_free(void *data)
+{
+	struct evt *evt = data;
+
+	if (evt->destroy)
+		evt->destroy(evt->user_data);
+
+	free(evt);
+}
+
+static bool match_cmd_id(const void *a, const void *b)
+{
+	const struct cmd *cmd = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	return cmd->id == id;
+}
+
+static bool match_cmd_opcode(const void *a, const void *b)
+{
+	const struct cmd *cmd = a;
+	uint16_t opcode = PTR_TO_UINT(b);
+
+	return cmd->opcode == opcode;
+}
+
+static bool match_evt_id(const void *a, const void *b)
+{
+	const struct evt *evt = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	return evt->id == id;
+}
+
+static void wakeup_writer(struct bt_hci *hci);
+
+static bool cmd_timeout(void *user_data)
+{
+	struct cmd *cmd = user_data;
+	struct bt_hci *hci = cmd->hci;
+
+	cmd->timeout_id = 0;
+
+	if (!queue_remove(hci->rsp_queue, cmd))
+		return false;
+
+	/*
+	 * The credit used by this command will never be returned by the
+	 * controller, so assume it can take one more like the kernel does.
+	 */
+	if (!hci->num_cmds)
+		hci->num_cmds = 1;
+
+	bt_hci_ref(hci);
+
+	if (cmd->callback)
+		cmd->callback(NULL, 0, cmd->user_data);
+
+	cmd_free(cmd);
+	wakeup_writer(hci);
+
+	bt_hci_unref(hci);
+
+	return false;
+}
+
+static bool send_command(struct bt_hci *hci, struct cmd *cmd)
+{
+	uint8_t type = HCI_COMMAND_PKT;
+	hci_command_hdr hdr;
+	struct iovec iov[3];
+	int iovcnt;
+
+	hdr.opcode = htobs(cmd->opcode);
+	hdr.plen = cmd->size;
+
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = &hdr;
+	iov[1].iov_len = HCI_COMMAND_HDR_SIZE;
+	iovcnt = 2;
+
+	if (cmd->size) {
+		iov[2].iov_base = cmd->data;
+		iov[2].iov_len = cmd->size;
+		iovcnt = 3;
+	}
+
+	return io_send(hci->io, iov, iovcnt) >= 0;
+}
+
+static void write_watch_destroy(void *user_data)
+{
+	struct bt_hci *hci = user_data;
+
+	hci->writer_active = false;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	struct cmd *cmd;
+
+	if (!hci->num_cmds)
+		return false;
+
+	cmd = queue_pop_head(hci->cmd_queue);
+	if (!cmd)
+		return false;
+
+	if (!send_command(hci, cmd)) {
+		bt_hci_ref(hci);
+
+		if (cmd->callback)
+			cmd->callback(NULL, 0, cmd->user_data);
+
+		cmd_free(cmd);
+		bt_hci_unref(hci);
+
+		/* Other commands may still go through */
+		return true;
+	}
+
+	hci->num_cmds--;
+
+	cmd->timeout_id = timeout_add(HCI_CMD_TIMEOUT, cmd_timeout, cmd,
+									NULL);
+	queue_push_tail(hci->rsp_queue, cmd);
+
+	/* Keep going while there are credits and commands left */
+	return true;
+}
+
+static void wakeup_writer(struct bt_hci *hci)
+{
+	if (hci->writer_active)
+		return;
+
+	if (!hci->num_cmds || queue_isempty(hci->cmd_queue))
+		return;
+
+	if (!io_set_write_handler(hci->io, can_write_data, hci,
+							write_watch_destroy))
+		return;
+
+	hci->writer_active = true;
+}
+
+static void process_response(struct bt_hci *hci, uint16_t opcode,
+					const void *data, uint8_t size)
+{
+	struct cmd *cmd;
+
+	/* Opcode 0x0000 only updates the number of command credits */
+	if (!opcode)
+		return;
+
+	/* Commands with the same opcode complete in the order they were sent */
+	cmd = queue_remove_if(hci->rsp_queue, match_cmd_opcode,
+							UINT_TO_PTR(opcode));
+	if (!cmd)
+		return;
+
+	if (cmd->callback)
+		cmd->callback(data, size, cmd->user_data);
+
+	cmd_free(cmd);
+}
+
+struct notify_data {
+	uint8_t event;
+	const void *data;
+	uint8_t size;
+};
+
+static void process_notify(void *data, void *user_data)
+{
+	struct evt *evt = data;
+	struct notify_data *notify = user_data;
+
+	if (evt->event != notify->event)
+		return;
+
+	if (evt->callback)
+		evt->callback(notify->data, notify->size, evt->user_data);
+}
+
+static void process_event(struct bt_hci *hci, const uint8_t *data,
+								size_t size)
+{
+	const hci_event_hdr *hdr = (const void *) data;
+	const evt_cmd_complete *cc;
+	const evt_cmd_status *cs;
+	struct notify_data notify;
+
+	if (size < HCI_EVENT_HDR_SIZE)
+		return;
+
+	data += HCI_EVENT_HDR_SIZE;
+	size -= HCI_EVENT_HDR_SIZE;
+
+	if (hdr->plen != size)
+		return;
+
+	switch (hdr->evt) {
+	case EVT_CMD_COMPLETE:
+		if (size < EVT_CMD_COMPLETE_SIZE)
+			return;
+
+		cc = (const void *) data;
+		hci->num_cmds = cc->ncmd;
+		process_response(hci, btohs(cc->opcode),
+					data + EVT_CMD_COMPLETE_SIZE,
+					size - EVT_CMD_COMPLETE_SIZE);
+		break;
+
+	case EVT_CMD_STATUS:
+		if (size < EVT_CMD_STATUS_SIZE)
+			return;
+
+		cs = (const void *) data;
+		hci->num_cmds = cs->ncmd;
+		process_response(hci, btohs(cs->opcode), &cs->status, 1);
+		break;
+
+	default:
+		notify.event = hdr->evt;
+		notify.data = data;
+		notify.size = size;
+
+		queue_foreach(hci->evt_list, process_notify, &notify);
+		break;
+	}
+}
+
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct bt_hci *hci = user_data;
+	uint8_t buf[HCI_MAX_EVENT_SIZE + 1];
+	ssize_t len;
+
+	len = read(io_get_fd(io), buf, sizeof(buf));
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (len < 1 || buf[0] != HCI_EVENT_PKT)
+		return true;
+
+	bt_hci_ref(hci);
+
+	process_event(hci, buf + 1, len - 1);
+	wakeup_writer(hci);
+
+	bt_hci_unref(hci);
+
+	return true;
+}
+
+struct bt_hci *bt_hci_new(int fd)
+{
+	struct bt_hci *hci;
+
+	if (fd < 0)
+		return NULL;
+
+	hci = new0(struct bt_hci, 1);
+	if (!hci)
+		return NULL;
+
+	hci->io = io_new(fd);
+	if (!hci->io)
+		goto fail;
+
+	/* The controller accepts at least one command until it says more */
+	hci->num_cmds = 1;
+	hci->next_cmd_id = 1;
+	hci->next_evt_id = 1;
+
+	hci->cmd_queue = queue_new();
+	hci->rsp_queue = queue_new();
+	hci->evt_list = queue_new();
+
+	if (!io_set_read_handler(hci->io, can_read_data, hci, NULL))
+		goto fail;
+
+	return bt_hci_ref(hci);
+
+fail:
+	queue_destroy(hci->cmd_queue, NULL);
+	queue_destroy(hci->rsp_queue, NULL);
+	queue_destroy(hci->evt_list, NULL);
+	io_destroy(hci->io);
+	free(hci);
+
+	return NULL;
+}
+
+struct bt_hci *bt_hci_new_raw_device(uint16_t index)
+{
+	struct sockaddr_hci addr;
+	struct hci_filter flt;
+	struct bt_hci *hci;
+	int fd;
+
+	fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+								BTPROTO_HCI);
+	if (fd < 0)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = index;
+	addr.hci_channel = HCI_CHANNEL_RAW;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto fail;
+
+	/* Set once for the lifetime of the socket, commands never touch it */
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_all_events(&flt);
+
+	if (setsockopt(fd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+		goto fail;
+
+	hci = bt_hci_new(fd);
+	if (!hci)
+		goto fail;
+
+	bt_hci_set_close_on_unref(hci, true);
+
+	return hci;
+
+fail:
+	close(fd);
+	return NULL;
+}
+
+struct bt_hci *bt_hci_ref(struct bt_hci *hci)
+{
+	if (!hci)
+		return NULL;
+
+	__sync_fetch_and_add(&hci->ref_count, 1);
+
+	return hci;
+}
+
+void bt_hci_unref(struct bt_hci *hci)
+{
+	if (!hci)
+		return;
+
+	if (__sync_sub_and_fetch(&hci->ref_count, 1))
+		return;
+
+	queue_destroy(hci->evt_list, evt_free);
+	queue_destroy(hci->cmd_queue, cmd_free);
+	queue_destroy(hci->rsp_queue, cmd_free);
+
+	io_destroy(hci->io);
+
+	free(hci);
+}
+
+bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close)
+{
+	if (!hci)
+		return false;
+
+	return io_set_close_on_destroy(hci->io, do_close);
+}
+
+unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
+				const void *data, uint8_t size,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct cmd *cmd;
+
+	if (!hci)
+		return 0;
+
+	cmd = new0(struct cmd, 1);
+	if (!cmd)
+		return 0;
+
+	if (size > 0) {
+		cmd->data = malloc(size);
+		if (!cmd->data) {
+			free(cmd);
+			return 0;
+		}
+
+		memcpy(cmd->data, data, size);
+	}
+
+	if (hci->next_cmd_id < 1)
+		hci->next_cmd_id = 1;
+
+	cmd->hci = hci;
+	cmd->id = hci->next_cmd_id++;
+	cmd->opcode = opcode;
+	cmd->size = size;
+	cmd->callback = callback;
+	cmd->destroy = destroy;
+	cmd->user_data = user_data;
+
+	if (!queue_push_tail(hci->cmd_queue, cmd)) {
+		free(cmd->data);
+		free(cmd);
+		return 0;
+	}
+
+	wakeup_writer(hci);
+
+	return cmd->id;
+}
+
+bool bt_hci_cancel(struct bt_hci *hci, unsigned int id)
+{
+	struct cmd *cmd;
+
+	if (!hci || !id)
+		return false;
+
+	cmd = queue_remove_if(hci->cmd_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (cmd) {
+		cmd_free(cmd);
+		return true;
+	}
+
+	cmd = queue_find(hci->rsp_queue, match_cmd_id, UINT_TO_PTR(id));
+	if (!cmd)
+		return false;
+
+	cmd_detach(cmd, NULL);
+
+	return true;
+}
+
+bool bt_hci_flush(struct bt_hci *hci)
+{
+	if (!hci)
+		return false;
+
+	queue_remove_all(hci->cmd_queue, NULL, NULL, cmd_free);
+	queue_foreach(hci->rsp_queue, cmd_detach, NULL);
+
+	return true;
+}
+
+unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
+				bt_hci_callback_func_t callback,
+				void *user_data, bt_hci_destroy_func_t destroy)
+{
+	struct evt *evt;
+
+	if (!hci || !callback)
+		return 0;
+
+	evt = new0(struct evt, 1);
+	if (!evt)
+		return 0;
+
+	if (hci->next_evt_id < 1)
+		hci->next_evt_id = 1;
+
+	evt->id = hci->next_evt_id++;
+	evt->event = event;
+	evt->callback = callback;
+	evt->destroy = destroy;
+	evt->user_data = user_data;
+
+	if (!queue_push_tail(hci->evt_list, evt)) {
+		free(evt);
+		return 0;
+	}
+
+	return evt->id;
+}
+
+bool bt_hci_unregister(struct bt_hci *hci, unsigned int id)
+{
+	struct evt *evt;
+
+	if (!hci || !id)
+		return false;
+
+	evt = queue_remove_if(hci->evt_list, match_evt_id, UINT_TO_PTR(id));
+	if (!evt)
+		return false;
+
+	evt_free(evt);
+
+	return true;
+}
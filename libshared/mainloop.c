@@ -40,9 +40,14 @@
 
 #define MAX_EPOLL_EVENTS 10
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status = EXIT_SUCCESS;
+/*
+ * Loop state is per thread so that several threads can each run their own
+ * mainloop, e.g. one per GATT server shard. Single threaded users see no
+ * difference.
+ */
+static __thread int epoll_fd;
+static __thread int epoll_terminate;
+static __thread int exit_status = EXIT_SUCCESS;
 
 struct mainloop_data {
 	int fd;
@@ -54,7 +59,7 @@ struct mainloop_data {
 
 #define MAX_MAINLOOP_ENTRIES 128
 
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
+static __thread struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
 
 struct timeout_data {
 	int fd;
@@ -71,7 +76,7 @@ struct signal_data {
 	void *user_data;
 };
 
-static struct signal_data *signal_data;
+static __thread struct signal_data *signal_data;
 
 void mainloop_init(void)
 {
@@ -35,6 +35,7 @@
 #include <dirent.h>
 #include <limits.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "src/shared/util.h"
 
@@ -54,7 +55,7 @@ void *btd_malloc(size_t size)
 	return NULL;
 }
 
-void util_debug(util_debug_func_t function, void *user_data,
+void util_debug_print(util_debug_func_t function, void *user_data,
 						const char *format, ...)
 {
 	char str[78];
@@ -70,7 +71,7 @@ void util_debug(util_debug_func_t function, void *user_data,
 	function(str, user_data);
 }
 
-void util_hexdump(const char dir, const unsigned char *buf, size_t len,
+void util_hexdump_print(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data)
 {
 	static const char hexdigits[] = "0123456789abcdef";
@@ -834,16 +835,129 @@ static const struct {
 	{ }
 };
 
-const char *bt_uuid16_to_str(uint16_t uuid)
+/*
+ * Both name tables are indexed by open addressing hash tables built once
+ * on first use. Slots hold the table index plus one, 0 marks a free slot,
+ * and only the first entry of a duplicated UUID is inserted so lookups
+ * return what a linear scan of the table would.
+ */
+#define UUID16_COUNT	(sizeof(uuid16_table) / sizeof(uuid16_table[0]) - 1)
+#define UUID128_COUNT	(sizeof(uuid128_table) / sizeof(uuid128_table[0]) - 1)
+#define UUID16_SLOTS	2048
+#define UUID128_SLOTS	128
+
+_Static_assert(UUID16_COUNT * 2 <= UUID16_SLOTS, "uuid16 index too small");
+_Static_assert(UUID128_COUNT * 2 <= UUID128_SLOTS, "uuid128 index too small");
+
+static uint16_t uuid16_index[UUID16_SLOTS];
+static uint8_t uuid128_index[UUID128_SLOTS];
+static uint8_t uuid128_keys[UUID128_COUNT][16];
+static pthread_once_t uuid_index_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned int uuid16_hash(uint16_t uuid)
+{
+	return ((uint32_t) uuid * 0x9e3779b1) >> (32 - 11);
+}
+
+static unsigned int uuid128_hash(const uint8_t key[16])
 {
+	uint64_t h = get_le64(key) ^ get_le64(key + 8);
+
+	return (h * 0x9e3779b97f4a7c15ULL) >> (64 - 7);
+}
+
+/* Hex digit values plus one, 0 for anything that is not a hex digit */
+static const uint8_t hex_table[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* Parse a 36 character UUID string in canonical form, in any letter case */
+static bool uuid128_parse(const char *str, uint8_t key[16])
+{
+	static const uint8_t pos[16] = { 0, 2, 4, 6, 9, 11, 14, 16,
+					19, 21, 24, 26, 28, 30, 32, 34 };
+	const uint8_t *p = (const uint8_t *) str;
+	uint8_t valid = 1;
 	int i;
 
-	for (i = 0; uuid16_table[i].str; i++) {
-		if (uuid16_table[i].uuid == uuid)
-			return uuid16_table[i].str;
+	if (p[8] != '-' || p[13] != '-' || p[18] != '-' || p[23] != '-')
+		return false;
+
+	for (i = 0; i < 16; i++) {
+		uint8_t hi = hex_table[p[pos[i]]];
+		uint8_t lo = hex_table[p[pos[i] + 1]];
+
+		valid &= (hi != 0) & (lo != 0);
+		key[i] = ((hi - 1) & 0x0f) << 4 | ((lo - 1) & 0x0f);
 	}
 
-	return "Unknown";
+	return valid;
+}
+
+static const char *uuid16_lookup(uint16_t uuid, bool insert, uint16_t idx)
+{
+	unsigned int h = uuid16_hash(uuid);
+
+	for (;; h = (h + 1) & (UUID16_SLOTS - 1)) {
+		uint16_t slot = uuid16_index[h];
+
+		if (!slot) {
+			if (insert)
+				uuid16_index[h] = idx + 1;
+			return NULL;
+		}
+
+		if (uuid16_table[slot - 1].uuid == uuid)
+			return uuid16_table[slot - 1].str;
+	}
+}
+
+static const char *uuid128_lookup(const uint8_t key[16], bool insert,
+								uint8_t idx)
+{
+	unsigned int h = uuid128_hash(key);
+
+	for (;; h = (h + 1) & (UUID128_SLOTS - 1)) {
+		uint8_t slot = uuid128_index[h];
+
+		if (!slot) {
+			if (insert)
+				uuid128_index[h] = idx + 1;
+			return NULL;
+		}
+
+		if (!memcmp(uuid128_keys[slot - 1], key, 16))
+			return uuid128_table[slot - 1].str;
+	}
+}
+
+static void uuid_index_build(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < UUID16_COUNT; i++)
+		uuid16_lookup(uuid16_table[i].uuid, true, i);
+
+	for (i = 0; i < UUID128_COUNT; i++) {
+		if (!uuid128_parse(uuid128_table[i].uuid, uuid128_keys[i]))
+			continue;
+
+		uuid128_lookup(uuid128_keys[i], true, i);
+	}
+}
+
+const char *bt_uuid16_to_str(uint16_t uuid)
+{
+	const char *str;
+
+	pthread_once(&uuid_index_once, uuid_index_build);
+
+	str = uuid16_lookup(uuid, false, 0);
+
+	return str ? str : "Unknown";
 }
 
 const char *bt_uuid32_to_str(uint32_t uuid)
@@ -856,9 +970,10 @@ const char *bt_uuid32_to_str(uint32_t uuid)
 
 const char *bt_uuidstr_to_str(const char *uuid)
 {
+	uint8_t key[16];
+	const char *str;
 	uint32_t val;
 	size_t len;
-	int i;
 
 	if (!uuid)
 		return NULL;
@@ -881,9 +996,12 @@ const char *bt_uuidstr_to_str(const char *uuid)
 	if (len != 36)
 		return NULL;
 
-	for (i = 0; uuid128_table[i].str; i++) {
-		if (strcasecmp(uuid128_table[i].uuid, uuid) == 0)
-			return uuid128_table[i].str;
+	if (uuid128_parse(uuid, key)) {
+		pthread_once(&uuid_index_once, uuid_index_build);
+
+		str = uuid128_lookup(key, false, 0);
+		if (str)
+			return str;
 	}
 
 	if (strncasecmp(uuid + 8, "-0000-1000-8000-00805f9b34fb", 28))
@@ -0,0 +1,426 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+
+#include "src/shared/util.h"
+#include "src/shared/hci.h"
+#include "src/shared/mainloop.h"
+
+#include "ble_accept.h"
+
+/* In units of 0.625 ms, the kernel's defaults */
+#define CONN_SCAN_INTERVAL 0x0060
+#define CONN_SCAN_WINDOW 0x0030
+
+/* Interval in units of 1.25 ms, supervision timeout in units of 10 ms */
+#define CONN_MIN_INTERVAL 0x0018
+#define CONN_MAX_INTERVAL 0x0028
+#define CONN_TIMEOUT 0x002a
+
+#define INITIATOR_FILTER_ACCEPT_LIST 0x01
+
+/* Connection complete status after LE Create Connection Cancel */
+#define STATUS_UNKNOWN_CONN_ID 0x02
+
+#define RETRY_INTERVAL_MS 1000
+
+struct entry {
+    struct ble_accept_device dev;
+    bool listed;
+    bool connected;
+    uint16_t handle;
+};
+
+static struct bt_hci* g_hci = NULL;
+static unsigned int g_meta_id = 0;
+static unsigned int g_disconn_id = 0;
+static int g_retry_id = -1;
+
+static struct entry* g_entries = NULL;
+static size_t g_count = 0;
+
+/* LE Create Connection is pending on the accept list */
+static bool g_initiating = false;
+
+static void (*g_connected)(const struct ble_accept_device* dev,
+                           void* user_data) = NULL;
+static void* g_user_data = NULL;
+
+static uint8_t hci_addr_type(const struct ble_accept_device* dev) {
+    return dev->bdaddr_type == BDADDR_LE_RANDOM ? LE_RANDOM_ADDRESS
+                                                : LE_PUBLIC_ADDRESS;
+}
+
+static void cmd_status_cb(const void* data, uint8_t size, void* user_data) {
+    const char* name = user_data;
+    const uint8_t* status = data;
+
+    if (!status)
+        printf("%s: no response from controller\n", name);
+    else if (status[0])
+        printf("%s failed (0x%02x)\n", name, status[0]);
+}
+
+static void send_cmd(uint16_t ocf,
+                     const void* data,
+                     uint8_t size,
+                     bt_hci_callback_func_t callback,
+                     const char* name) {
+    if (!bt_hci_send(g_hci, cmd_opcode_pack(OGF_LE_CTL, ocf), data, size,
+                     callback, (void*)name, NULL))
+        printf("Failed to send %s\n", name);
+}
+
+static void list_add(struct entry* entry) {
+    le_add_device_to_white_list_cp cp;
+
+    if (entry->listed)
+        return;
+
+    cp.bdaddr_type = hci_addr_type(&entry->dev);
+    bacpy(&cp.bdaddr, &entry->dev.bdaddr);
+
+    send_cmd(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &cp, sizeof(cp), cmd_status_cb,
+             "LE Add Device To Accept List");
+    entry->listed = true;
+}
+
+static void list_remove(struct entry* entry) {
+    le_remove_device_from_white_list_cp cp;
+
+    if (!entry->listed)
+        return;
+
+    cp.bdaddr_type = hci_addr_type(&entry->dev);
+    bacpy(&cp.bdaddr, &entry->dev.bdaddr);
+
+    send_cmd(OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST, &cp, sizeof(cp),
+             cmd_status_cb, "LE Remove Device From Accept List");
+    entry->listed = false;
+}
+
+static void initiate(void);
+
+static void retry_cb(int id, void* user_data) {
+    mainloop_remove_timeout(id);
+    g_retry_id = -1;
+
+    initiate();
+}
+
+/* Initiating stopped or never started, try again shortly */
+static void retry_initiate(void) {
+    g_initiating = false;
+
+    if (g_retry_id < 0)
+        g_retry_id =
+            mainloop_add_timeout(RETRY_INTERVAL_MS, retry_cb, NULL, NULL);
+}
+
+static void create_status_cb(const void* data, uint8_t size, void* user_data) {
+    const uint8_t* status = data;
+
+    cmd_status_cb(data, size, user_data);
+
+    if (!status || status[0])
+        retry_initiate();
+}
+
+/* Start initiating, unless nothing listed is left to connect to */
+static void initiate(void) {
+    le_create_connection_cp cp;
+    size_t i;
+
+    if (g_initiating)
+        return;
+
+    for (i = 0; i < g_count; i++) {
+        if (g_entries[i].listed)
+            break;
+    }
+
+    if (i == g_count)
+        return;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.interval = htobs(CONN_SCAN_INTERVAL);
+    cp.window = htobs(CONN_SCAN_WINDOW);
+    cp.initiator_filter = INITIATOR_FILTER_ACCEPT_LIST;
+    cp.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+    cp.min_interval = htobs(CONN_MIN_INTERVAL);
+    cp.max_interval = htobs(CONN_MAX_INTERVAL);
+    cp.supervision_timeout = htobs(CONN_TIMEOUT);
+
+    send_cmd(OCF_LE_CREATE_CONN, &cp, sizeof(cp), create_status_cb,
+             "LE Create Connection");
+    g_initiating = true;
+}
+
+/* The accept list cannot change while the controller initiates from it */
+static void cancel_initiate(void) {
+    if (!g_initiating)
+        return;
+
+    send_cmd(OCF_LE_CREATE_CONN_CANCEL, NULL, 0, NULL,
+             "LE Create Connection Cancel");
+    g_initiating = false;
+}
+
+static struct entry* find_addr(const bdaddr_t* bdaddr) {
+    for (size_t i = 0; i < g_count; i++) {
+        if (!bacmp(&g_entries[i].dev.bdaddr, bdaddr))
+            return &g_entries[i];
+    }
+
+    return NULL;
+}
+
+static struct entry* find_handle(uint16_t handle) {
+    for (size_t i = 0; i < g_count; i++) {
+        if (g_entries[i].connected && g_entries[i].handle == handle)
+            return &g_entries[i];
+    }
+
+    return NULL;
+}
+
+static void conn_complete(uint8_t status,
+                          uint16_t handle,
+                          uint8_t role,
+                          const bdaddr_t* peer) {
+    struct entry* entry;
+
+    if (status) {
+        if (status == STATUS_UNKNOWN_CONN_ID || !g_initiating)
+            return;
+
+        printf("Auto-connect failed (0x%02x)\n", status);
+        retry_initiate();
+        return;
+    }
+
+    /* Our initiator is the only one that can be running */
+    if (role == 0x00)
+        g_initiating = false;
+
+    entry = find_addr(peer);
+    if (!entry || entry->connected)
+        return;
+
+    entry->connected = true;
+    entry->handle = btohs(handle);
+
+    cancel_initiate();
+    list_remove(entry);
+    initiate();
+
+    if (g_connected)
+        g_connected(&entry->dev, g_user_data);
+}
+
+static void le_meta_cb(const void* data, uint8_t size, void* user_data) {
+    const uint8_t* ptr = data;
+    const evt_le_connection_complete* cc;
+    const evt_le_enhanced_connection_complete* ecc;
+
+    if (size < EVT_LE_META_EVENT_SIZE)
+        return;
+
+    size -= EVT_LE_META_EVENT_SIZE;
+
+    switch (ptr[0]) {
+        case EVT_LE_CONN_COMPLETE:
+            if (size < EVT_LE_CONN_COMPLETE_SIZE)
+                return;
+            cc = (const void*)(ptr + 1);
+            conn_complete(cc->status, cc->handle, cc->role, &cc->peer_bdaddr);
+            break;
+        case EVT_LE_ENHANCED_CONN_COMPLETE:
+            if (size < EVT_LE_ENHANCED_CONN_COMPLETE_SIZE)
+                return;
+            ecc = (const void*)(ptr + 1);
+            conn_complete(ecc->status, ecc->handle, ecc->role,
+                          &ecc->peer_bdaddr);
+            break;
+    }
+}
+
+static void disconn_cb(const void* data, uint8_t size, void* user_data) {
+    const evt_disconn_complete* evt = data;
+    struct entry* entry;
+
+    if (size < EVT_DISCONN_COMPLETE_SIZE || evt->status)
+        return;
+
+    entry = find_handle(btohs(evt->handle));
+    if (!entry)
+        return;
+
+    entry->connected = false;
+
+    cancel_initiate();
+    list_add(entry);
+    initiate();
+}
+
+static void read_size_cb(const void* data, uint8_t size, void* user_data) {
+    const le_read_white_list_size_rp* rp = data;
+
+    if (!rp || size < LE_READ_WHITE_LIST_SIZE_RP_SIZE || rp->status) {
+        printf("Failed to read accept list size\n");
+        return;
+    }
+
+    /* Devices that do not fit are left out */
+    if (g_count > rp->size) {
+        printf("Accept list holds %u of %zu devices\n", rp->size, g_count);
+        g_count = rp->size;
+    }
+
+    /* Commands go out in order, so the list is complete before use */
+    send_cmd(OCF_LE_CLEAR_WHITE_LIST, NULL, 0, cmd_status_cb,
+             "LE Clear Accept List");
+
+    for (size_t i = 0; i < g_count; i++)
+        list_add(&g_entries[i]);
+
+    initiate();
+}
+
+static bool accept_start(struct bt_hci* hci,
+                         const struct ble_accept_device* devices,
+                         size_t count) {
+    g_entries = new0(struct entry, count);
+    if (!g_entries)
+        return false;
+
+    for (size_t i = 0; i < count; i++)
+        g_entries[i].dev = devices[i];
+
+    g_count = count;
+    g_hci = hci;
+
+    g_meta_id =
+        bt_hci_register(hci, EVT_LE_META_EVENT, le_meta_cb, NULL, NULL);
+    g_disconn_id =
+        bt_hci_register(hci, EVT_DISCONN_COMPLETE, disconn_cb, NULL, NULL);
+    if (!g_meta_id || !g_disconn_id)
+        goto fail;
+
+    if (!bt_hci_send(hci,
+                     cmd_opcode_pack(OGF_LE_CTL, OCF_LE_READ_WHITE_LIST_SIZE),
+                     NULL, 0, read_size_cb, NULL, NULL))
+        goto fail;
+
+    return true;
+
+fail:
+    bt_hci_unregister(hci, g_meta_id);
+    bt_hci_unregister(hci, g_disconn_id);
+    free(g_entries);
+    g_entries = NULL;
+    g_count = 0;
+    g_hci = NULL;
+
+    return false;
+}
+
+bool ble_accept_start(uint16_t hci_index,
+                      const struct ble_accept_device* devices,
+                      size_t count,
+                      void (*connected)(const struct ble_accept_device* dev,
+                                        void* user_data),
+                      void* user_data) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new_raw_device(hci_index);
+    if (!hci) {
+        perror("Failed to open HCI device");
+        return false;
+    }
+
+    if (!accept_start(hci, devices, count)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    g_connected = connected;
+    g_user_data = user_data;
+
+    return true;
+}
+
+bool ble_accept_start_fd(int fd,
+                         const struct ble_accept_device* devices,
+                         size_t count,
+                         void (*connected)(const struct ble_accept_device* dev,
+                                           void* user_data),
+                         void* user_data) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new(fd);
+    if (!hci)
+        return false;
+
+    if (!accept_start(hci, devices, count)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    g_connected = connected;
+    g_user_data = user_data;
+
+    return true;
+}
+
+static void initiate_cancelled(void* user_data) {
+    bt_hci_unref(user_data);
+}
+
+void ble_accept_stop(void) {
+    struct bt_hci* hci = g_hci;
+    bool initiating = g_initiating;
+
+    if (!hci)
+        return;
+
+    g_hci = NULL;
+    g_initiating = false;
+
+    if (g_retry_id >= 0)
+        mainloop_remove_timeout(g_retry_id);
+    g_retry_id = -1;
+
+    bt_hci_unregister(hci, g_meta_id);
+    bt_hci_unregister(hci, g_disconn_id);
+    bt_hci_flush(hci);
+
+    free(g_entries);
+    g_entries = NULL;
+    g_count = 0;
+
+    g_connected = NULL;
+    g_user_data = NULL;
+
+    if (!initiating) {
+        bt_hci_unref(hci);
+        return;
+    }
+
+    /* The last reference goes once the controller has stopped initiating */
+    if (!bt_hci_send(hci,
+                     cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CREATE_CONN_CANCEL),
+                     NULL, 0, NULL, hci, initiate_cancelled))
+        bt_hci_unref(hci);
+}
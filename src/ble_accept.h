@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/bluetooth.h"
+
+/* bdaddr_type is BDADDR_LE_PUBLIC or BDADDR_LE_RANDOM, as for sockets */
+struct ble_accept_device {
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+};
+
+/*
+ * Load |devices| into the controller's accept list and let it connect to
+ * whichever of them advertises first. |connected| runs once the link is
+ * up, so a connect() to the device returns without waiting for the
+ * radio. Connected devices leave the list and rejoin it when their link
+ * goes. Must run on the BLE mainloop.
+ */
+bool ble_accept_start(uint16_t hci_index,
+                      const struct ble_accept_device* devices,
+                      size_t count,
+                      void (*connected)(const struct ble_accept_device* dev,
+                                        void* user_data),
+                      void* user_data);
+
+/* Same, on an already open HCI socket such as one end of a socketpair */
+bool ble_accept_start_fd(int fd,
+                         const struct ble_accept_device* devices,
+                         size_t count,
+                         void (*connected)(const struct ble_accept_device* dev,
+                                           void* user_data),
+                         void* user_data);
+
+void ble_accept_stop(void);
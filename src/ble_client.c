@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lib/bluetooth.h"
@@ -21,25 +22,56 @@
 #include "src/shared/gatt-client.h"
 #include "src/shared/mainloop.h"
 
+#include "ble_accept.h"
+#include "ble_conn.h"
+#include "ble_scanner.h"
 #include "config.h"
 
 #define ATT_CID 4
+#define HCI_DEV_INDEX 0
 #define POLL_INTERVAL_MS 2000
 
+/* Time for the controller to take the commands sent on stop */
+#define STOP_GRACE_MS 250
+
 #define UUID_ESS_SERVICE 0x181A
 #define UUID_TEMPERATURE 0x2A6E
 #define UUID_PRESSURE 0x2A6D
 #define UUID_HUMIDITY 0x2A6F
 
+/* Characteristic of the ESS profile and how to decode its value */
+struct ess_chrc {
+    bt_uuid_t uuid;
+    uint16_t min_len;
+    void (*decode)(const uint8_t* value);
+};
+
+static void decode_temperature(const uint8_t* value);
+static void decode_pressure(const uint8_t* value);
+static void decode_humidity(const uint8_t* value);
+
+static const bt_uuid_t ess_uuid = BT_UUID16_INIT(UUID_ESS_SERVICE);
+
+static const struct ess_chrc ess_chrcs[] = {
+    {BT_UUID16_INIT(UUID_TEMPERATURE), 2, decode_temperature},
+    {BT_UUID16_INIT(UUID_PRESSURE), 4, decode_pressure},
+    {BT_UUID16_INIT(UUID_HUMIDITY), 2, decode_humidity},
+};
+
+#define ESS_CHRC_COUNT (sizeof(ess_chrcs) / sizeof(ess_chrcs[0]))
+
 struct client {
     int fd;
     struct bt_att* att;
     struct gatt_db* db;
     struct bt_gatt_client* gatt;
 
-    uint16_t temp_handle;
-    uint16_t press_handle;
-    uint16_t humid_handle;
+    /* Value handles, indexed like ess_chrcs; 0 if not discovered */
+    uint16_t value_handles[ESS_CHRC_COUNT];
+
+    /* Sensor reads in flight and when the current one went out */
+    unsigned int reads_pending;
+    uint64_t read_start;
 };
 
 struct ble_sensor_state {
@@ -71,6 +103,12 @@ static int g_sec = BT_SECURITY_LOW;
 static uint16_t g_mtu = 0;
 static struct client* g_cli = NULL;
 
+/* The controller reconnects on its own, see BLE_AUTO_CONNECT */
+static bool g_auto_connect = false;
+
+/* ble_client_stop() was called, the mainloop quits shortly */
+static bool g_stopping = false;
+
 /* polling */
 static void poll_sensors_cb(int id, void* user_data);
 static void read_cb(bool success,
@@ -80,7 +118,12 @@ static void read_cb(bool success,
                     void* user_data);
 
 /* connection */
+static bool client_connect(const bdaddr_t* dst, uint8_t dst_type);
 static void reconnect_cb(int id, void* user_data);
+#ifdef BLE_AUTO_CONNECT
+static void auto_connect_cb(const struct ble_accept_device* dev,
+                            void* user_data);
+#endif
 static void att_disconnect_cb(int err, void* user_data);
 
 /* logs */
@@ -98,7 +141,7 @@ static struct client* client_create(int fd, uint16_t mtu);
 static void client_destroy(void);
 
 static int l2cap_le_att_connect(bdaddr_t* src,
-                                bdaddr_t* dst,
+                                const bdaddr_t* dst,
                                 uint8_t dst_type,
                                 int sec);
 
@@ -108,48 +151,71 @@ void ble_client_stop(void);
 bool ble_get_temperature(float* out);
 bool ble_get_pressure(float* out);
 bool ble_get_humidity(float* out);
+void ble_set_temperature(float celsius);
+void ble_set_pressure(float hpa);
+void ble_set_humidity(float rh);
 bool ble_is_connected(void);
 
 /* inner functions */
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Decoders run with g_state.lock held */
+static void decode_temperature(const uint8_t* value) {
+    g_state.temperature = (int16_t)get_le16(value) / 100.0f;
+    g_state.has_temp = true;
+}
+
+static void decode_pressure(const uint8_t* value) {
+    /* 0.1 Pa units, kept in hPa like the scanner does */
+    g_state.pressure = get_le32(value) / 1000.0f;
+    g_state.has_press = true;
+}
+
+static void decode_humidity(const uint8_t* value) {
+    g_state.humidity = get_le16(value) / 100.0f;
+    g_state.has_humid = true;
+}
+
 static void read_cb(bool success,
                     uint8_t att_ecode,
                     const uint8_t* value,
                     uint16_t length,
                     void* user_data) {
-    uint16_t uuid16 = PTR_TO_UINT(user_data);
+    const struct ess_chrc* chrc = user_data;
+    struct client* cli = g_cli;
+    uint64_t now = now_us();
+
+    /*
+     * ATT has one request outstanding at a time, so each read went out
+     * when the previous response came in.
+     */
+    if (cli && cli->reads_pending) {
+        cli->reads_pending--;
+        ble_conn_add_rtt(now - cli->read_start);
+        cli->read_start = now;
+    }
 
-    if (!success || !value)
+    if (!success || !value || length < chrc->min_len)
         return;
 
     pthread_mutex_lock(&g_state.lock);
-
-    switch (uuid16) {
-        case UUID_TEMPERATURE: {
-            int16_t raw = le16toh(*(int16_t*)value);
-            g_state.temperature = raw / 100.0f;
-            g_state.has_temp = true;
-            break;
-        }
-        case UUID_PRESSURE: {
-            uint32_t raw = le32toh(*(uint32_t*)value);
-            g_state.pressure = raw / 100.0f;
-            g_state.has_press = true;
-            break;
-        }
-        case UUID_HUMIDITY: {
-            uint16_t raw = le16toh(*(uint16_t*)value);
-            g_state.humidity = raw / 100.0f;
-            g_state.has_humid = true;
-            break;
-        }
-    }
-
+    chrc->decode(value);
     pthread_mutex_unlock(&g_state.lock);
 }
 
 static void poll_sensors_cb(int id, void* user_data) {
     struct client* cli = g_cli;
 
+    if (g_stopping)
+        return;
+
     pthread_mutex_lock(&g_state.lock);
     bool connected = g_state.connected;
     pthread_mutex_unlock(&g_state.lock);
@@ -159,50 +225,73 @@ static void poll_sensors_cb(int id, void* user_data) {
         return;
     }
 
-    if (cli->temp_handle)
-        bt_gatt_client_read_value(cli->gatt, cli->temp_handle, read_cb,
-                                  UINT_TO_PTR(UUID_TEMPERATURE), NULL);
-
-    if (cli->press_handle)
-        bt_gatt_client_read_value(cli->gatt, cli->press_handle, read_cb,
-                                  UINT_TO_PTR(UUID_PRESSURE), NULL);
+    if (!cli->reads_pending)
+        cli->read_start = now_us();
 
-    if (cli->humid_handle)
-        bt_gatt_client_read_value(cli->gatt, cli->humid_handle, read_cb,
-                                  UINT_TO_PTR(UUID_HUMIDITY), NULL);
+    for (size_t i = 0; i < ESS_CHRC_COUNT; i++) {
+        if (cli->value_handles[i] &&
+            bt_gatt_client_read_value(cli->gatt, cli->value_handles[i],
+                                      read_cb, (void*)&ess_chrcs[i], NULL))
+            cli->reads_pending++;
+    }
 
     mainloop_add_timeout(POLL_INTERVAL_MS, poll_sensors_cb, cli, NULL);
 }
 
-static void reconnect_cb(int id, void* user_data) {
+static bool client_connect(const bdaddr_t* dst, uint8_t dst_type) {
     int fd;
 
-    printf("Reconnecting...\n");
-
-    fd = l2cap_le_att_connect(BDADDR_ANY, &g_dst_addr, g_dst_type, g_sec);
+    fd = l2cap_le_att_connect(BDADDR_ANY, dst, dst_type, g_sec);
 
     if (fd < 0) {
-        printf("Reconnect failed (fd), retrying...\n");
-        mainloop_add_timeout(POLL_INTERVAL_MS, reconnect_cb, NULL, NULL);
-        return;
+        printf("Connect failed (fd)\n");
+        return false;
     }
 
     g_cli = client_create(fd, g_mtu);
 
     if (!g_cli) {
-        printf("Reconnect failed (cli), retrying...\n");
-        mainloop_add_timeout(POLL_INTERVAL_MS, reconnect_cb, NULL, NULL);
-        return;
+        printf("Connect failed (cli)\n");
+        return false;
     }
 
+    ble_conn_attach(fd);
+
     pthread_mutex_lock(&g_state.lock);
     g_state.connected = true;
     g_state.has_temp = false;
     g_state.has_press = false;
     g_state.has_humid = false;
     pthread_mutex_unlock(&g_state.lock);
+
+    return true;
 }
 
+static void reconnect_cb(int id, void* user_data) {
+    if (g_stopping)
+        return;
+
+    printf("Reconnecting...\n");
+
+    if (!client_connect(&g_dst_addr, g_dst_type)) {
+        printf("Reconnect failed, retrying...\n");
+        mainloop_add_timeout(POLL_INTERVAL_MS, reconnect_cb, NULL, NULL);
+    }
+}
+
+#ifdef BLE_AUTO_CONNECT
+/* The link is already up, so connecting ATT does not wait for the radio */
+static void auto_connect_cb(const struct ble_accept_device* dev,
+                            void* user_data) {
+    if (g_cli)
+        return;
+
+    printf("Controller connected to the device\n");
+
+    client_connect(&dev->bdaddr, dev->bdaddr_type);
+}
+#endif
+
 static void att_disconnect_cb(int err, void* user_data) {
     printf("Disconnected (%s)\n", strerror(err));
 
@@ -213,9 +302,12 @@ static void att_disconnect_cb(int err, void* user_data) {
     g_state.has_humid = false;
     pthread_mutex_unlock(&g_state.lock);
 
+    ble_conn_detach();
     client_destroy();
 
-    mainloop_add_timeout(POLL_INTERVAL_MS, reconnect_cb, NULL, NULL);
+    /* Otherwise the controller reconnects once the device advertises */
+    if (!g_auto_connect)
+        mainloop_add_timeout(POLL_INTERVAL_MS, reconnect_cb, NULL, NULL);
 }
 
 static void log_service_event(struct gatt_db_attribute* attr, const char* str) {
@@ -344,29 +436,21 @@ static void ess_char_cb(struct gatt_db_attribute* attr, void* user_data) {
                                          &uuid))
         return;
 
-    bt_uuid_t t, p, h;
-    bt_uuid16_create(&t, UUID_TEMPERATURE);
-    bt_uuid16_create(&p, UUID_PRESSURE);
-    bt_uuid16_create(&h, UUID_HUMIDITY);
-
-    if (bt_uuid_cmp(&uuid, &t) == 0)
-        cli->temp_handle = value_handle;
-    else if (bt_uuid_cmp(&uuid, &p) == 0)
-        cli->press_handle = value_handle;
-    else if (bt_uuid_cmp(&uuid, &h) == 0)
-        cli->humid_handle = value_handle;
+    for (size_t i = 0; i < ESS_CHRC_COUNT; i++) {
+        if (bt_uuid_cmp(&uuid, &ess_chrcs[i].uuid) == 0) {
+            cli->value_handles[i] = value_handle;
+            return;
+        }
+    }
 }
 
 static void service_cb(struct gatt_db_attribute* attr, void* user_data) {
     struct client* cli = user_data;
     bt_uuid_t uuid;
-    bt_uuid_t ess_uuid;
 
     if (!gatt_db_attribute_get_service_uuid(attr, &uuid))
         return;
 
-    bt_uuid16_create(&ess_uuid, UUID_ESS_SERVICE);
-
     if (bt_uuid_cmp(&uuid, &ess_uuid) != 0)
         return;
 
@@ -428,7 +512,9 @@ static struct client* client_create(int fd, uint16_t mtu) {
         return NULL;
     }
 
-    cli->gatt = bt_gatt_client_new(cli->db, cli->att, mtu);
+    /* Only the Environmental Sensing service is needed, skip the rest */
+    cli->gatt =
+        bt_gatt_client_new_filtered(cli->db, cli->att, mtu, &ess_uuid, 1);
     if (!cli->gatt) {
         fprintf(stderr, "Failed to create GATT client\n");
         gatt_db_unref(cli->db);
@@ -458,7 +544,7 @@ static void client_destroy(void) {
 }
 
 static int l2cap_le_att_connect(bdaddr_t* src,
-                                bdaddr_t* dst,
+                                const bdaddr_t* dst,
                                 uint8_t dst_type,
                                 int sec) {
     int sock;
@@ -527,6 +613,7 @@ static int l2cap_le_att_connect(bdaddr_t* src,
 
 /* public API */
 bool ble_client_start(void) {
+    enum ble_conn_profile profile;
     bdaddr_t src_addr;
     bacpy(&src_addr, BDADDR_ANY);
 
@@ -534,6 +621,36 @@ bool ble_client_start(void) {
 
     mainloop_init();
 
+    /* Before connecting, to see the parameters the link starts with */
+    if (!ble_conn_profile_from_str(BLE_CONN_PROFILE, &profile))
+        profile = BLE_CONN_PROFILE_DEFAULT;
+
+    if (!ble_conn_start(HCI_DEV_INDEX, &g_dst_addr, profile))
+        fprintf(stderr, "Connection parameters will not be tuned\n");
+
+#ifdef BLE_SCAN
+    /* Readings in advertisements arrive even while not connected */
+    if (!ble_scanner_start(HCI_DEV_INDEX, &g_dst_addr))
+        fprintf(stderr, "Failed to start LE scanner\n");
+#endif
+
+#ifdef BLE_AUTO_CONNECT
+    /* Device table for the accept list, only the configured sensor */
+    struct ble_accept_device device;
+
+    bacpy(&device.bdaddr, &g_dst_addr);
+    device.bdaddr_type = g_dst_type;
+
+    g_auto_connect =
+        ble_accept_start(HCI_DEV_INDEX, &device, 1, auto_connect_cb, NULL);
+    if (g_auto_connect) {
+        mainloop_add_timeout(POLL_INTERVAL_MS, poll_sensors_cb, NULL, NULL);
+        return true;
+    }
+
+    fprintf(stderr, "Failed to start auto-connect, connecting directly\n");
+#endif
+
     int fd = l2cap_le_att_connect(&src_addr, &g_dst_addr, g_dst_type,
                                   BT_SECURITY_LOW);
 
@@ -549,6 +666,8 @@ bool ble_client_start(void) {
         return false;
     }
 
+    ble_conn_attach(fd);
+
     pthread_mutex_lock(&g_state.lock);
     g_state.connected = true;
     pthread_mutex_unlock(&g_state.lock);
@@ -558,10 +677,36 @@ bool ble_client_start(void) {
     return true;
 }
 
-void ble_client_stop(void) {
+static void stop_cb(int id, void* user_data) {
+    mainloop_remove_timeout(id);
     mainloop_quit();
 }
 
+void ble_client_stop(void) {
+    /* Asked again, do not wait for the controller */
+    if (g_stopping) {
+        mainloop_quit();
+        return;
+    }
+
+    g_stopping = true;
+
+    ble_conn_stop();
+
+#ifdef BLE_SCAN
+    ble_scanner_stop();
+#endif
+
+#ifdef BLE_AUTO_CONNECT
+    /* Otherwise the controller keeps initiating to the device */
+    if (g_auto_connect)
+        ble_accept_stop();
+#endif
+
+    if (mainloop_add_timeout(STOP_GRACE_MS, stop_cb, NULL, NULL) < 0)
+        mainloop_quit();
+}
+
 bool ble_get_temperature(float* out) {
     bool ok;
 
@@ -598,6 +743,27 @@ bool ble_get_humidity(float* out) {
     return ok;
 }
 
+void ble_set_temperature(float celsius) {
+    pthread_mutex_lock(&g_state.lock);
+    g_state.temperature = celsius;
+    g_state.has_temp = true;
+    pthread_mutex_unlock(&g_state.lock);
+}
+
+void ble_set_pressure(float hpa) {
+    pthread_mutex_lock(&g_state.lock);
+    g_state.pressure = hpa;
+    g_state.has_press = true;
+    pthread_mutex_unlock(&g_state.lock);
+}
+
+void ble_set_humidity(float rh) {
+    pthread_mutex_lock(&g_state.lock);
+    g_state.humidity = rh;
+    g_state.has_humid = true;
+    pthread_mutex_unlock(&g_state.lock);
+}
+
 bool ble_is_connected(void) {
     bool connected;
 
@@ -6,6 +6,10 @@
 /* call at startup */
 bool ble_client_start(void);
 
+/*
+ * Stop the controller from scanning and initiating, then quit the BLE
+ * mainloop. Must run on the BLE mainloop, e.g. from its signal handler.
+ */
 void ble_client_stop(void);
 
 bool ble_is_connected(void);
@@ -14,3 +18,8 @@ bool ble_is_connected(void);
 bool ble_get_temperature(float *out_celsius);
 bool ble_get_pressure(float *out_hpa);
 bool ble_get_humidity(float *out_rh);
+
+/* sensor updates from other sources, e.g. advertisements (thread-safe) */
+void ble_set_temperature(float celsius);
+void ble_set_pressure(float hpa);
+void ble_set_humidity(float rh);
@@ -0,0 +1,349 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/l2cap.h"
+
+#include "src/shared/util.h"
+#include "src/shared/hci.h"
+#include "src/shared/mainloop.h"
+
+#include "ble_conn.h"
+
+#define CONN_REPORT_INTERVAL_MS 30000
+
+/* Intervals in units of 1.25 ms, supervision timeout in units of 10 ms */
+struct conn_params {
+    const char* name;
+    uint16_t min_interval;
+    uint16_t max_interval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+static const struct conn_params profiles[] = {
+    [BLE_CONN_PROFILE_DEFAULT] = {"", 0, 0, 0, 0},
+    /* 7.5-15 ms, every event */
+    [BLE_CONN_PROFILE_LOW_LATENCY] = {"low-latency", 6, 12, 0, 200},
+    /* 30-50 ms, every event */
+    [BLE_CONN_PROFILE_BALANCED] = {"balanced", 24, 40, 0, 400},
+    /* 100-200 ms, the peripheral may skip 4 events while idle */
+    [BLE_CONN_PROFILE_LOW_POWER] = {"low-power", 80, 160, 4, 600},
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+struct link {
+    bool attached;
+    uint16_t handle;
+
+    /* Parameters in use, from the last connection or update complete */
+    bool has_params;
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+
+    /* ATT round trips since the last report, in microseconds */
+    uint32_t rtt_count;
+    uint64_t rtt_sum;
+    uint32_t rtt_min;
+    uint32_t rtt_max;
+};
+
+static struct bt_hci* g_hci = NULL;
+static unsigned int g_event_id = 0;
+static int g_report_id = -1;
+static bdaddr_t g_peer;
+static enum ble_conn_profile g_profile = BLE_CONN_PROFILE_DEFAULT;
+static struct link g_link;
+
+bool ble_conn_profile_from_str(const char* str, enum ble_conn_profile* out) {
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        if (!strcmp(str, profiles[i].name)) {
+            *out = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void print_params(const char* what) {
+    printf("%s: interval %.2f ms, latency %u, supervision timeout %u ms\n",
+           what, g_link.interval * 1.25f, g_link.latency,
+           g_link.timeout * 10);
+}
+
+static void set_params(uint16_t interval, uint16_t latency, uint16_t timeout) {
+    g_link.has_params = true;
+    g_link.interval = btohs(interval);
+    g_link.latency = btohs(latency);
+    g_link.timeout = btohs(timeout);
+}
+
+static void apply_profile(void);
+
+static void conn_complete(uint8_t status,
+                          uint16_t handle,
+                          const bdaddr_t* peer,
+                          uint16_t interval,
+                          uint16_t latency,
+                          uint16_t timeout) {
+    if (status || bacmp(peer, &g_peer))
+        return;
+
+    /* A blocking connect() usually returns before the event is read */
+    if (g_link.attached && btohs(handle) != g_link.handle)
+        return;
+
+    g_link.handle = btohs(handle);
+    set_params(interval, latency, timeout);
+
+    if (!g_link.attached)
+        return;
+
+    print_params("Connected");
+    apply_profile();
+}
+
+static void update_complete(const evt_le_connection_update_complete* evt) {
+    if (!g_link.attached || btohs(evt->handle) != g_link.handle)
+        return;
+
+    if (evt->status) {
+        printf("Connection update failed (0x%02x)\n", evt->status);
+        return;
+    }
+
+    set_params(evt->interval, evt->latency, evt->supervision_timeout);
+    print_params("Connection updated");
+}
+
+static void le_meta_cb(const void* data, uint8_t size, void* user_data) {
+    const uint8_t* ptr = data;
+    const evt_le_connection_complete* cc;
+    const evt_le_enhanced_connection_complete* ecc;
+
+    if (size < EVT_LE_META_EVENT_SIZE)
+        return;
+
+    size -= EVT_LE_META_EVENT_SIZE;
+
+    switch (ptr[0]) {
+        case EVT_LE_CONN_COMPLETE:
+            if (size < EVT_LE_CONN_COMPLETE_SIZE)
+                return;
+            cc = (const void*)(ptr + 1);
+            conn_complete(cc->status, cc->handle, &cc->peer_bdaddr,
+                          cc->interval, cc->latency, cc->supervision_timeout);
+            break;
+        case EVT_LE_ENHANCED_CONN_COMPLETE:
+            if (size < EVT_LE_ENHANCED_CONN_COMPLETE_SIZE)
+                return;
+            ecc = (const void*)(ptr + 1);
+            conn_complete(ecc->status, ecc->handle, &ecc->peer_bdaddr,
+                          ecc->interval, ecc->latency,
+                          ecc->supervision_timeout);
+            break;
+        case EVT_LE_CONN_UPDATE_COMPLETE:
+            if (size < EVT_LE_CONN_UPDATE_COMPLETE_SIZE)
+                return;
+            update_complete((const void*)(ptr + 1));
+            break;
+    }
+}
+
+static void update_status_cb(const void* data,
+                             uint8_t size,
+                             void* user_data) {
+    const uint8_t* status = data;
+
+    if (!status)
+        printf("LE Connection Update: no response from controller\n");
+    else if (status[0])
+        printf("LE Connection Update failed (0x%02x)\n", status[0]);
+}
+
+static bool params_match(const struct conn_params* params) {
+    return g_link.has_params && g_link.interval >= params->min_interval &&
+           g_link.interval <= params->max_interval &&
+           g_link.latency == params->latency &&
+           g_link.timeout == params->timeout;
+}
+
+static void apply_profile(void) {
+    const struct conn_params* params = &profiles[g_profile];
+    le_connection_update_cp cp;
+
+    if (g_profile == BLE_CONN_PROFILE_DEFAULT || params_match(params))
+        return;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.handle = htobs(g_link.handle);
+    cp.min_interval = htobs(params->min_interval);
+    cp.max_interval = htobs(params->max_interval);
+    cp.latency = htobs(params->latency);
+    cp.supervision_timeout = htobs(params->timeout);
+
+    /* The result arrives as an LE Connection Update Complete event */
+    if (!bt_hci_send(g_hci, cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CONN_UPDATE),
+                     &cp, sizeof(cp), update_status_cb, NULL, NULL))
+        printf("Failed to request %s connection parameters\n", params->name);
+}
+
+static void reset_rtt(void) {
+    g_link.rtt_count = 0;
+    g_link.rtt_sum = 0;
+    g_link.rtt_min = UINT32_MAX;
+    g_link.rtt_max = 0;
+}
+
+static void report_cb(int id, void* user_data) {
+    mainloop_modify_timeout(id, CONN_REPORT_INTERVAL_MS);
+
+    if (!g_link.attached)
+        return;
+
+    if (g_link.has_params)
+        print_params("Connection");
+
+    if (!g_link.rtt_count)
+        return;
+
+    printf("ATT round trip: min %.1f ms, avg %.1f ms, max %.1f ms (%u)\n",
+           g_link.rtt_min / 1000.0f,
+           g_link.rtt_sum / (1000.0f * g_link.rtt_count),
+           g_link.rtt_max / 1000.0f, g_link.rtt_count);
+
+    reset_rtt();
+}
+
+static bool conn_start(struct bt_hci* hci,
+                       const bdaddr_t* peer,
+                       enum ble_conn_profile profile) {
+    g_event_id =
+        bt_hci_register(hci, EVT_LE_META_EVENT, le_meta_cb, NULL, NULL);
+    if (!g_event_id)
+        return false;
+
+    bacpy(&g_peer, peer);
+    g_profile = profile;
+
+    memset(&g_link, 0, sizeof(g_link));
+    reset_rtt();
+
+    g_report_id = mainloop_add_timeout(CONN_REPORT_INTERVAL_MS, report_cb,
+                                       NULL, NULL);
+    g_hci = hci;
+
+    return true;
+}
+
+bool ble_conn_start(uint16_t hci_index,
+                    const bdaddr_t* peer,
+                    enum ble_conn_profile profile) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new_raw_device(hci_index);
+    if (!hci) {
+        perror("Failed to open HCI device");
+        return false;
+    }
+
+    if (!conn_start(hci, peer, profile)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    return true;
+}
+
+bool ble_conn_start_fd(int fd,
+                       const bdaddr_t* peer,
+                       enum ble_conn_profile profile) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new(fd);
+    if (!hci)
+        return false;
+
+    if (!conn_start(hci, peer, profile)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    return true;
+}
+
+void ble_conn_stop(void) {
+    if (!g_hci)
+        return;
+
+    if (g_report_id >= 0)
+        mainloop_remove_timeout(g_report_id);
+    g_report_id = -1;
+
+    bt_hci_unregister(g_hci, g_event_id);
+    bt_hci_unref(g_hci);
+    g_hci = NULL;
+
+    g_link.attached = false;
+}
+
+void ble_conn_attach(int att_fd) {
+    struct l2cap_conninfo info;
+    socklen_t len = sizeof(info);
+
+    if (!g_hci)
+        return;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(att_fd, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0) {
+        perror("Failed to get connection handle");
+        return;
+    }
+
+    /* Parameters of an earlier link to the peer no longer apply */
+    if (info.hci_handle != g_link.handle)
+        g_link.has_params = false;
+
+    g_link.handle = info.hci_handle;
+    g_link.attached = true;
+    reset_rtt();
+
+    /* Otherwise the profile is applied once the connection event is read */
+    if (!g_link.has_params)
+        return;
+
+    print_params("Connected");
+    apply_profile();
+}
+
+void ble_conn_detach(void) {
+    g_link.attached = false;
+    g_link.has_params = false;
+}
+
+void ble_conn_add_rtt(uint32_t usec) {
+    if (!g_link.attached)
+        return;
+
+    g_link.rtt_count++;
+    g_link.rtt_sum += usec;
+
+    if (usec < g_link.rtt_min)
+        g_link.rtt_min = usec;
+
+    if (usec > g_link.rtt_max)
+        g_link.rtt_max = usec;
+}
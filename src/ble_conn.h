@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/bluetooth.h"
+
+/*
+ * Connection parameters requested for the sensor link. The default leaves
+ * whatever the kernel and the peripheral negotiated.
+ */
+enum ble_conn_profile {
+    BLE_CONN_PROFILE_DEFAULT,
+    BLE_CONN_PROFILE_LOW_LATENCY,
+    BLE_CONN_PROFILE_BALANCED,
+    BLE_CONN_PROFILE_LOW_POWER,
+};
+
+/* "", "low-latency", "balanced" or "low-power" */
+bool ble_conn_profile_from_str(const char* str, enum ble_conn_profile* out);
+
+/*
+ * Follow the link to |peer| on HCI device |hci_index|: apply |profile| to
+ * each new connection and periodically report the connection interval
+ * and ATT round-trip time. The profile is applied once both the ATT
+ * socket is attached and the LE Connection Complete event has been read,
+ * in either order, so start it before connecting. Must run on the BLE
+ * mainloop.
+ */
+bool ble_conn_start(uint16_t hci_index,
+                    const bdaddr_t* peer,
+                    enum ble_conn_profile profile);
+
+/* Same, on an already open HCI socket such as one end of a socketpair */
+bool ble_conn_start_fd(int fd,
+                       const bdaddr_t* peer,
+                       enum ble_conn_profile profile);
+
+void ble_conn_stop(void);
+
+/* The ATT socket to the peer has connected, or the link has gone */
+void ble_conn_attach(int att_fd);
+void ble_conn_detach(void);
+
+/* Time from sending an ATT request to receiving its response */
+void ble_conn_add_rtt(uint32_t usec);
@@ -0,0 +1,282 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+
+#include "src/shared/util.h"
+#include "src/shared/hci.h"
+
+#include "ble_client.h"
+#include "ble_scanner.h"
+
+/* In units of 0.625 ms */
+#define SCAN_INTERVAL 0x0060
+#define SCAN_WINDOW 0x0030
+
+#define SCAN_TYPE_PASSIVE 0x00
+
+#define UUID_ESS_SERVICE 0x181A
+#define COMPANY_RUUVI 0x0499
+
+/* Service data layouts used by ESS broadcasting thermometers */
+#define ESS_PVVX_LEN 15
+#define ESS_ATC1441_LEN 13
+
+#define RUUVI_RAWV2 0x05
+#define RUUVI_RAWV2_MIN_LEN 7
+
+/* Devices tracked at once, the least recently heard one is replaced */
+#define ADV_CACHE_SIZE 256
+
+static struct bt_hci* g_hci = NULL;
+static unsigned int g_report_id = 0;
+static bdaddr_t g_sensor;
+static bool g_any_sensor = true;
+static struct bt_adv_cache* g_cache = NULL;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* pvvx custom format: little endian, 0.01 C and 0.01 % */
+static void decode_ess_pvvx(const uint8_t* data) {
+    ble_set_temperature((int16_t)get_le16(data + 6) / 100.0f);
+    ble_set_humidity(get_le16(data + 8) / 100.0f);
+}
+
+/* ATC1441 format: big endian, 0.1 C and 1 % */
+static void decode_ess_atc1441(const uint8_t* data) {
+    ble_set_temperature((int16_t)get_be16(data + 6) / 10.0f);
+    ble_set_humidity(data[8]);
+}
+
+static void decode_ess_service_data(const uint8_t* data, uint8_t len) {
+    switch (len) {
+        case ESS_PVVX_LEN:
+            decode_ess_pvvx(data);
+            break;
+        case ESS_ATC1441_LEN:
+            decode_ess_atc1441(data);
+            break;
+    }
+}
+
+/* Ruuvi data format 5, all-ones marks a value as not available */
+static void decode_ruuvi(const uint8_t* data, uint8_t len) {
+    uint16_t temp, humid, press;
+
+    if (len < RUUVI_RAWV2_MIN_LEN || data[0] != RUUVI_RAWV2)
+        return;
+
+    temp = get_be16(data + 1);
+    humid = get_be16(data + 3);
+    press = get_be16(data + 5);
+
+    if (temp != 0x8000)
+        ble_set_temperature((int16_t)temp * 0.005f);
+
+    if (humid != 0xffff)
+        ble_set_humidity(humid * 0.0025f);
+
+    if (press != 0xffff)
+        ble_set_pressure((press + 50000) / 100.0f);
+}
+
+static void handle_service_data(const struct bt_ad_field* field) {
+    if (field->type != BT_AD_SERVICE_DATA16 ||
+        get_le16(field->data) != UUID_ESS_SERVICE)
+        return;
+
+    decode_ess_service_data(field->data + 2, field->len - 2);
+}
+
+static void handle_manufacturer_data(const struct bt_ad_field* field) {
+    if (get_le16(field->data) != COMPANY_RUUVI)
+        return;
+
+    decode_ruuvi(field->data + 2, field->len - 2);
+}
+
+static void handle_report(const le_advertising_info* info, int8_t rssi) {
+    struct bt_ad_info ad;
+
+    if (!bt_adv_cache_update(g_cache, &info->bdaddr, info->bdaddr_type,
+                             info->data, info->length, rssi, now_ms()))
+        return;
+
+    if (!g_any_sensor && bacmp(&info->bdaddr, &g_sensor))
+        return;
+
+    /* Fields before a malformed one are still valid */
+    bt_ad_parse(info->data, info->length, &ad);
+
+    for (uint8_t i = 0; i < ad.num_service_data; i++)
+        handle_service_data(&ad.service_data[i]);
+
+    for (uint8_t i = 0; i < ad.num_manufacturer_data; i++)
+        handle_manufacturer_data(&ad.manufacturer_data[i]);
+}
+
+static void le_meta_cb(const void* data, uint8_t size, void* user_data) {
+    const uint8_t* ptr = data;
+    size_t left = size;
+    uint8_t num_reports;
+
+    if (left < 2 || ptr[0] != EVT_LE_ADVERTISING_REPORT)
+        return;
+
+    num_reports = ptr[1];
+    ptr += 2;
+    left -= 2;
+
+    /* Each report is followed by its RSSI */
+    while (num_reports--) {
+        const le_advertising_info* info = (const void*)ptr;
+        size_t report_len;
+
+        if (left < LE_ADVERTISING_INFO_SIZE)
+            return;
+
+        report_len = LE_ADVERTISING_INFO_SIZE + info->length + 1;
+        if (left < report_len)
+            return;
+
+        handle_report(info, (int8_t)ptr[report_len - 1]);
+
+        ptr += report_len;
+        left -= report_len;
+    }
+}
+
+static void cmd_status_cb(const void* data, uint8_t size, void* user_data) {
+    const char* name = user_data;
+    const uint8_t* status = data;
+
+    if (!status)
+        printf("%s: no response from controller\n", name);
+    else if (status[0])
+        printf("%s failed (0x%02x)\n", name, status[0]);
+}
+
+static bool scanner_start(struct bt_hci* hci, const bdaddr_t* sensor) {
+    le_set_scan_parameters_cp param;
+    le_set_scan_enable_cp enable;
+
+    g_any_sensor = !sensor;
+    if (sensor)
+        bacpy(&g_sensor, sensor);
+
+    g_cache = bt_adv_cache_new(ADV_CACHE_SIZE);
+    if (!g_cache)
+        return false;
+
+    g_report_id =
+        bt_hci_register(hci, EVT_LE_META_EVENT, le_meta_cb, NULL, NULL);
+    if (!g_report_id)
+        goto fail;
+
+    memset(&param, 0, sizeof(param));
+    param.type = SCAN_TYPE_PASSIVE;
+    param.interval = htobs(SCAN_INTERVAL);
+    param.window = htobs(SCAN_WINDOW);
+    param.own_bdaddr_type = LE_PUBLIC_ADDRESS;
+
+    if (!bt_hci_send(hci,
+                     cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS),
+                     &param, sizeof(param), cmd_status_cb,
+                     "LE Set Scan Parameters", NULL))
+        goto fail;
+
+    /* Keep duplicates, changed readings are detected per payload */
+    enable.enable = 0x01;
+    enable.filter_dup = 0x00;
+
+    if (!bt_hci_send(hci, cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE),
+                     &enable, sizeof(enable), cmd_status_cb,
+                     "LE Set Scan Enable", NULL))
+        goto fail;
+
+    g_hci = hci;
+
+    return true;
+
+fail:
+    bt_adv_cache_free(g_cache);
+    g_cache = NULL;
+
+    return false;
+}
+
+bool ble_scanner_start(uint16_t hci_index, const bdaddr_t* sensor) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new_raw_device(hci_index);
+    if (!hci) {
+        perror("Failed to open HCI device");
+        return false;
+    }
+
+    if (!scanner_start(hci, sensor)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    return true;
+}
+
+bool ble_scanner_start_fd(int fd, const bdaddr_t* sensor) {
+    struct bt_hci* hci;
+
+    if (g_hci)
+        return false;
+
+    hci = bt_hci_new(fd);
+    if (!hci)
+        return false;
+
+    if (!scanner_start(hci, sensor)) {
+        bt_hci_unref(hci);
+        return false;
+    }
+
+    return true;
+}
+
+static void scan_disabled(void* user_data) {
+    bt_hci_unref(user_data);
+}
+
+void ble_scanner_stop(void) {
+    struct bt_hci* hci = g_hci;
+    le_set_scan_enable_cp enable;
+
+    if (!hci)
+        return;
+
+    g_hci = NULL;
+
+    bt_hci_unregister(hci, g_report_id);
+    bt_hci_flush(hci);
+
+    bt_adv_cache_free(g_cache);
+    g_cache = NULL;
+
+    enable.enable = 0x00;
+    enable.filter_dup = 0x00;
+
+    /* The last reference goes once the controller has stopped scanning */
+    if (!bt_hci_send(hci, cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE),
+                     &enable, sizeof(enable), NULL, hci, scan_disabled))
+        bt_hci_unref(hci);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lib/bluetooth.h"
+
+/*
+ * Passive LE scan that feeds sensor readings broadcast in advertisements
+ * into the same state as the GATT client. Only reports from |sensor| are
+ * used, or from any device if it is NULL. Must run on the BLE mainloop.
+ */
+bool ble_scanner_start(uint16_t hci_index, const bdaddr_t* sensor);
+
+/* Same, on an already open HCI socket such as one end of a socketpair */
+bool ble_scanner_start_fd(int fd, const bdaddr_t* sensor);
+
+void ble_scanner_stop(void);
@@ -43,7 +43,7 @@ static void send_response(int client_fd) {
                    : "N/A",
              has_p ? ({
                  static char b[32];
-                 snprintf(b, 32, "%.1f hPa", p / 10.0f);
+                 snprintf(b, 32, "%.1f hPa", p);
                  b;
              })
                    : "N/A",
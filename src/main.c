@@ -4,19 +4,39 @@
 #include "src/shared/mainloop.h"
 
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static sigset_t g_signals;
+
+static void signal_cb(int signum, void* user_data) {
+    printf("%s, stopping\n", strsignal(signum));
+    ble_client_stop();
+}
 
 /* BLE thread */
 static void* ble_thread(void* arg) {
+    int status;
+
     ble_client_start();
-    mainloop_run();
-    return NULL;
+    mainloop_set_signal(&g_signals, signal_cb, NULL, NULL);
+    status = mainloop_run();
+
+    /* The HTTP server has nothing to clean up */
+    exit(status);
 }
 
 int main(void) {
     pthread_t ble_tid;
 
+    /* Blocked in every thread, the BLE mainloop reads them */
+    sigemptyset(&g_signals);
+    sigaddset(&g_signals, SIGINT);
+    sigaddset(&g_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &g_signals, NULL);
+
     if (pthread_create(&ble_tid, NULL, ble_thread, NULL) != 0) {
         perror("pthread_create");
         return EXIT_FAILURE;
@@ -26,4 +46,4 @@ int main(void) {
     http_server_run(8080);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,128 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Signs the same Signed Write Command with bt_crypto_sign_att(), which sets
+ * up the key for every message, and with bt_crypto_sign_att_key() on a key
+ * set up once, checking that both give the same signatures. Takes the number
+ * of messages to sign as optional argument.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/shared/crypto.h"
+
+#define DEFAULT_ITERATIONS 20000
+
+static const uint8_t key[16] = {
+	0x3c, 0x4f, 0xcf, 0x09, 0x88, 0x15, 0xf7, 0xab,
+	0xa6, 0xd2, 0xae, 0x28, 0x16, 0x15, 0x7e, 0x2b
+};
+
+/* Opcode, handle and value of a Signed Write Command */
+static const uint8_t msg[] = {
+	0xd2, 0x2a, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+	0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	0x0e, 0x0f, 0x10, 0x11
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bt_crypto *crypto;
+	struct bt_crypto_sign_key *sign_key;
+	unsigned int i, iterations = DEFAULT_ITERATIONS;
+	uint8_t sig[12], cached_sig[12];
+	uint8_t check = 0;
+	double start, plain, cached;
+	int failed = 0;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (!iterations)
+		iterations = 1;
+
+	/* No AF_ALG support in the kernel, reported to ctest as skipped */
+	crypto = bt_crypto_new();
+	if (!crypto) {
+		printf("no crypto support\n");
+		return 77;
+	}
+
+	sign_key = bt_crypto_sign_key_new(crypto, key);
+	if (!sign_key) {
+		printf("failed to set up signing key\n");
+		bt_crypto_unref(crypto);
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (!bt_crypto_sign_att(crypto, key, msg, sizeof(msg), i, sig))
+			failed = 1;
+		check ^= sig[0];
+	}
+	plain = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		if (!bt_crypto_sign_att_key(crypto, sign_key, msg, sizeof(msg),
+							i, cached_sig))
+			failed = 1;
+		check ^= cached_sig[0];
+	}
+	cached = now() - start;
+
+	/* Both loops signed the same messages, so check cancelled out */
+	if (check || memcmp(sig, cached_sig, sizeof(sig))) {
+		printf("signatures differ\n");
+		failed = 1;
+	}
+
+	printf("%u signatures\n", iterations);
+	printf("  bt_crypto_sign_att:     %8.3f us each\n",
+						plain * 1e6 / iterations);
+	printf("  bt_crypto_sign_att_key: %8.3f us each (%.1fx)\n",
+						cached * 1e6 / iterations,
+						cached > 0 ? plain / cached : 0);
+
+	bt_crypto_sign_key_free(sign_key);
+	bt_crypto_unref(crypto);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
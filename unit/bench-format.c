@@ -0,0 +1,233 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Formats random addresses with ba2str() and random 16 and 128 bit UUIDs
+ * with bt_uuid_to_string(), next to the sprintf based formatting they
+ * replaced, checking that the strings and return values are the same.
+ * Takes the number of values to format as optional argument.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#define DEFAULT_ITERATIONS 200000
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sprintf_ba2str(const bdaddr_t *ba, char *str)
+{
+	return sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
+		ba->b[5], ba->b[4], ba->b[3], ba->b[2], ba->b[1], ba->b[0]);
+}
+
+static int sprintf_uuid_to_string(const bt_uuid_t *uuid, char *str, size_t n)
+{
+	bt_uuid_t tmp;
+	unsigned int   data0;
+	unsigned short data1;
+	unsigned short data2;
+	unsigned short data3;
+	unsigned int   data4;
+	unsigned short data5;
+	const uint8_t *data;
+
+	bt_uuid_to_uuid128(uuid, &tmp);
+	data = (uint8_t *) &tmp.value.u128;
+
+	memcpy(&data0, &data[0], 4);
+	memcpy(&data1, &data[4], 2);
+	memcpy(&data2, &data[6], 2);
+	memcpy(&data3, &data[8], 2);
+	memcpy(&data4, &data[10], 4);
+	memcpy(&data5, &data[14], 2);
+
+	snprintf(str, n, "%.8x-%.4x-%.4x-%.4x-%.8x%.4x",
+				ntohl(data0), ntohs(data1),
+				ntohs(data2), ntohs(data3),
+				ntohl(data4), ntohs(data5));
+
+	return 0;
+}
+
+static void random_bytes(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+static void print_result(const char *name, double old, double new,
+						unsigned int iterations)
+{
+	printf("  %-18s %8.1f ns -> %6.1f ns (%.1fx)\n", name,
+					old * 1e9 / iterations,
+					new * 1e9 / iterations,
+					new > 0 ? old / new : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, iterations = DEFAULT_ITERATIONS;
+	bdaddr_t *addrs;
+	bt_uuid_t *uuid16s, *uuid128s;
+	char str[MAX_LEN_UUID_STR], old_str[MAX_LEN_UUID_STR];
+	unsigned int check = 0;
+	double start, old, new;
+	int failed = 0;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (!iterations)
+		iterations = 1;
+
+	addrs = calloc(iterations, sizeof(*addrs));
+	uuid16s = calloc(iterations, sizeof(*uuid16s));
+	uuid128s = calloc(iterations, sizeof(*uuid128s));
+	if (!addrs || !uuid16s || !uuid128s) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+
+	for (i = 0; i < iterations; i++) {
+		uint128_t u128;
+
+		random_bytes(addrs[i].b, sizeof(addrs[i].b));
+		bt_uuid16_create(&uuid16s[i], rand());
+		random_bytes(u128.data, sizeof(u128.data));
+		bt_uuid128_create(&uuid128s[i], u128);
+	}
+
+	/* Same strings and return values, also when truncated */
+	for (i = 0; i < iterations; i++) {
+		size_t n = i % sizeof(str) + 1;
+
+		if (ba2str(&addrs[i], str) != sprintf_ba2str(&addrs[i],
+								old_str) ||
+						strcmp(str, old_str)) {
+			printf("ba2str differs: %s %s\n", str, old_str);
+			failed = 1;
+		}
+
+		memset(str, 0, sizeof(str));
+		memset(old_str, 0, sizeof(old_str));
+		bt_uuid_to_string(&uuid16s[i], str, n);
+		sprintf_uuid_to_string(&uuid16s[i], old_str, n);
+		if (memcmp(str, old_str, sizeof(str))) {
+			printf("uuid16 differs: %s %s\n", str, old_str);
+			failed = 1;
+		}
+
+		memset(str, 0, sizeof(str));
+		memset(old_str, 0, sizeof(old_str));
+		bt_uuid_to_string(&uuid128s[i], str, n);
+		sprintf_uuid_to_string(&uuid128s[i], old_str, n);
+		if (memcmp(str, old_str, sizeof(str))) {
+			printf("uuid128 differs: %s %s\n", str, old_str);
+			failed = 1;
+		}
+	}
+
+	printf("%u values\n", iterations);
+
+	/* Summing a character keeps the formatting from being optimized out */
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		sprintf_ba2str(&addrs[i], str);
+		check += str[i % 17];
+	}
+	old = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		ba2str(&addrs[i], str);
+		check -= str[i % 17];
+	}
+	new = now() - start;
+
+	print_result("ba2str", old, new, iterations);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		sprintf_uuid_to_string(&uuid16s[i], str, sizeof(str));
+		check += str[i % 36];
+	}
+	old = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		bt_uuid_to_string(&uuid16s[i], str, sizeof(str));
+		check -= str[i % 36];
+	}
+	new = now() - start;
+
+	print_result("uuid16 to string", old, new, iterations);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		sprintf_uuid_to_string(&uuid128s[i], str, sizeof(str));
+		check += str[i % 36];
+	}
+	old = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		bt_uuid_to_string(&uuid128s[i], str, sizeof(str));
+		check -= str[i % 36];
+	}
+	new = now() - start;
+
+	print_result("uuid128 to string", old, new, iterations);
+
+	/* Both sides formatted the same strings, so check cancelled out */
+	if (check) {
+		printf("formatted strings differ\n");
+		failed = 1;
+	}
+
+	free(addrs);
+	free(uuid16s);
+	free(uuid128s);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
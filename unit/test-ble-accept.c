@@ -0,0 +1,429 @@
+/*
+ * Runs the accept list auto-connect against a fake controller on a
+ * socketpair, checking that the devices are loaded into the accept list
+ * before initiating from it, that connected devices leave the list and
+ * rejoin it when their link goes, that a failed attempt is retried, that
+ * stopping cancels initiating, and that a restart only loads as many
+ * devices as the accept list holds.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/timeout.h"
+
+#include "ble_accept.h"
+
+/* Time for the commands and events of a step to cross the socketpair */
+#define STEP_MS 50
+
+/* Longer than the retry interval in ble_accept.c */
+#define RETRY_WAIT_MS 1200
+
+#define MAX_CMDS 32
+
+#define DEV_A 0
+#define DEV_B 1
+
+struct cmd {
+	uint16_t ocf;
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t filter;
+};
+
+static struct ble_accept_device devices[2];
+static int fds[2];
+static int ctl;
+static int failed;
+
+/* LE commands the controller read, and how many a step has checked */
+static struct cmd cmds[MAX_CMDS];
+static unsigned int num_cmds;
+static unsigned int num_checked;
+
+static uint8_t list_size = 4;
+
+static int connected[8];
+static unsigned int num_connected;
+
+static unsigned int step;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		printf("step %u: %s failed\n", step, #cond);		\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static void send_event(uint8_t event, const void *param, uint8_t len)
+{
+	uint8_t buf[3 + 255];
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = event;
+	buf[2] = len;
+	memcpy(buf + 3, param, len);
+
+	if (write(ctl, buf, 3 + len) != 3 + len) {
+		perror("write event");
+		failed = 1;
+	}
+}
+
+static void conn_complete(uint8_t status, uint16_t handle, int dev)
+{
+	uint8_t buf[1 + EVT_LE_CONN_COMPLETE_SIZE];
+	evt_le_connection_complete *cc = (void *) (buf + 1);
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = EVT_LE_CONN_COMPLETE;
+	cc->status = status;
+	cc->handle = htobs(handle);
+
+	if (dev >= 0) {
+		cc->peer_bdaddr_type = devices[dev].bdaddr_type ==
+					BDADDR_LE_RANDOM ? LE_RANDOM_ADDRESS :
+							LE_PUBLIC_ADDRESS;
+		bacpy(&cc->peer_bdaddr, &devices[dev].bdaddr);
+	}
+
+	send_event(EVT_LE_META_EVENT, buf, sizeof(buf));
+}
+
+static void disconn_complete(uint16_t handle)
+{
+	evt_disconn_complete evt;
+
+	evt.status = 0x00;
+	evt.handle = htobs(handle);
+	evt.reason = 0x13;
+
+	send_event(EVT_DISCONN_COMPLETE, &evt, sizeof(evt));
+}
+
+static void cmd_complete(uint16_t opcode, const uint8_t *rp, uint8_t len)
+{
+	uint8_t buf[EVT_CMD_COMPLETE_SIZE + 8];
+	evt_cmd_complete *cc = (void *) buf;
+
+	cc->ncmd = 1;
+	cc->opcode = htobs(opcode);
+	memcpy(buf + EVT_CMD_COMPLETE_SIZE, rp, len);
+
+	send_event(EVT_CMD_COMPLETE, buf, EVT_CMD_COMPLETE_SIZE + len);
+}
+
+static void cmd_status(uint16_t opcode)
+{
+	evt_cmd_status cs;
+
+	cs.status = 0x00;
+	cs.ncmd = 1;
+	cs.opcode = htobs(opcode);
+
+	send_event(EVT_CMD_STATUS, &cs, sizeof(cs));
+}
+
+/* Answers like a controller that always has room and a free radio */
+static void ctl_read(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[3 + 255 + 1];
+	uint8_t rp[2] = { 0x00, list_size };
+	uint16_t opcode;
+	struct cmd *cmd;
+	ssize_t len;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 4)
+		return;
+
+	opcode = buf[1] | buf[2] << 8;
+
+	if (buf[0] != HCI_COMMAND_PKT || buf[3] != len - 4 ||
+					cmd_opcode_ogf(opcode) != OGF_LE_CTL ||
+					num_cmds == MAX_CMDS) {
+		printf("unexpected command packet of %zd bytes\n", len);
+		failed = 1;
+		return;
+	}
+
+	cmd = &cmds[num_cmds++];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->ocf = cmd_opcode_ocf(opcode);
+
+	switch (cmd->ocf) {
+	case OCF_LE_ADD_DEVICE_TO_WHITE_LIST:
+	case OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST:
+		cmd->bdaddr_type = buf[4];
+		bacpy(&cmd->bdaddr, (const bdaddr_t *) (buf + 5));
+		cmd_complete(opcode, rp, 1);
+		break;
+	case OCF_LE_CREATE_CONN:
+		cmd->filter = ((const le_create_connection_cp *)
+						(buf + 4))->initiator_filter;
+		cmd_status(opcode);
+		break;
+	case OCF_LE_CREATE_CONN_CANCEL:
+		cmd_complete(opcode, rp, 1);
+		conn_complete(0x02, 0x0000, -1);
+		break;
+	case OCF_LE_READ_WHITE_LIST_SIZE:
+		cmd_complete(opcode, rp, 2);
+		break;
+	default:
+		cmd_complete(opcode, rp, 1);
+		break;
+	}
+}
+
+/* The next command has |ocf|, and for list changes is about |dev| */
+static bool next_cmd(uint16_t ocf, int dev)
+{
+	const struct cmd *cmd;
+	uint8_t type;
+
+	if (num_checked == num_cmds) {
+		printf("step %u: command 0x%04x not sent\n", step, ocf);
+		return false;
+	}
+
+	cmd = &cmds[num_checked++];
+
+	if (cmd->ocf != ocf) {
+		printf("step %u: command 0x%04x sent instead of 0x%04x\n",
+							step, cmd->ocf, ocf);
+		return false;
+	}
+
+	if (dev < 0)
+		return true;
+
+	type = devices[dev].bdaddr_type == BDADDR_LE_RANDOM ?
+					LE_RANDOM_ADDRESS : LE_PUBLIC_ADDRESS;
+
+	return !bacmp(&cmd->bdaddr, &devices[dev].bdaddr) &&
+						cmd->bdaddr_type == type;
+}
+
+static bool next_create(void)
+{
+	const struct cmd *cmd = &cmds[num_checked];
+
+	return next_cmd(OCF_LE_CREATE_CONN, -1) && cmd->filter == 0x01;
+}
+
+static bool no_more_cmds(void)
+{
+	return num_checked == num_cmds;
+}
+
+static void connected_cb(const struct ble_accept_device *dev,
+							void *user_data)
+{
+	int i;
+
+	check(user_data == devices);
+
+	for (i = 0; i < 2; i++) {
+		if (!bacmp(&dev->bdaddr, &devices[i].bdaddr) &&
+				dev->bdaddr_type == devices[i].bdaddr_type)
+			break;
+	}
+
+	check(i < 2);
+
+	if (num_connected < 8)
+		connected[num_connected++] = i;
+}
+
+static bool start(void)
+{
+	return ble_accept_start_fd(fds[0], devices, 2, connected_cb, devices);
+}
+
+/*
+ * Each step checks what the previous one caused, then returns how long to
+ * wait before the next step.
+ */
+static unsigned int step_start(void)
+{
+	check(start());
+	check(!start());
+
+	return STEP_MS;
+}
+
+static unsigned int step_loaded(void)
+{
+	check(next_cmd(OCF_LE_READ_WHITE_LIST_SIZE, -1));
+	check(next_cmd(OCF_LE_CLEAR_WHITE_LIST, -1));
+	check(next_cmd(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, DEV_A));
+	check(next_cmd(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, DEV_B));
+	check(next_create());
+	check(no_more_cmds());
+
+	conn_complete(0x00, 0x0040, DEV_A);
+
+	return STEP_MS;
+}
+
+static unsigned int step_a_connected(void)
+{
+	check(num_connected == 1 && connected[0] == DEV_A);
+
+	/* Initiating ended with the connection, so nothing to cancel */
+	check(next_cmd(OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST, DEV_A));
+	check(next_create());
+	check(no_more_cmds());
+
+	conn_complete(0x00, 0x0041, DEV_B);
+
+	return STEP_MS;
+}
+
+static unsigned int step_b_connected(void)
+{
+	check(num_connected == 2 && connected[1] == DEV_B);
+
+	/* The list is empty, no initiating */
+	check(next_cmd(OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST, DEV_B));
+	check(no_more_cmds());
+
+	disconn_complete(0x0040);
+
+	return STEP_MS;
+}
+
+static unsigned int step_a_disconnected(void)
+{
+	check(next_cmd(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, DEV_A));
+	check(next_create());
+	check(no_more_cmds());
+
+	/* Failed attempt, initiating again after the retry interval */
+	conn_complete(0x3e, 0x0000, -1);
+
+	return STEP_MS;
+}
+
+static unsigned int step_failed(void)
+{
+	check(no_more_cmds());
+
+	return RETRY_WAIT_MS;
+}
+
+static unsigned int step_retried(void)
+{
+	check(next_create());
+	check(no_more_cmds());
+
+	/* Initiating, so stopping has to cancel it */
+	ble_accept_stop();
+	ble_accept_stop();
+
+	/* Not taken for a connection once stopped */
+	conn_complete(0x00, 0x0040, DEV_A);
+
+	return STEP_MS;
+}
+
+static unsigned int step_stopped(void)
+{
+	check(next_cmd(OCF_LE_CREATE_CONN_CANCEL, -1));
+	check(no_more_cmds());
+	check(num_connected == 2);
+
+	/* Only the first device fits this time */
+	list_size = 1;
+	check(start());
+
+	return STEP_MS;
+}
+
+static unsigned int step_restarted(void)
+{
+	check(next_cmd(OCF_LE_READ_WHITE_LIST_SIZE, -1));
+	check(next_cmd(OCF_LE_CLEAR_WHITE_LIST, -1));
+	check(next_cmd(OCF_LE_ADD_DEVICE_TO_WHITE_LIST, DEV_A));
+	check(next_create());
+	check(no_more_cmds());
+
+	ble_accept_stop();
+
+	return STEP_MS;
+}
+
+static unsigned int step_done(void)
+{
+	check(next_cmd(OCF_LE_CREATE_CONN_CANCEL, -1));
+	check(no_more_cmds());
+
+	return 0;
+}
+
+static unsigned int (*const steps[])(void) = {
+	step_start,
+	step_loaded,
+	step_a_connected,
+	step_b_connected,
+	step_a_disconnected,
+	step_failed,
+	step_retried,
+	step_stopped,
+	step_restarted,
+	step_done,
+};
+
+static bool run_step(void *user_data)
+{
+	unsigned int delay;
+
+	delay = steps[step]();
+
+	if (++step < sizeof(steps) / sizeof(steps[0]))
+		timeout_add(delay, run_step, NULL, NULL);
+	else
+		mainloop_quit();
+
+	return false;
+}
+
+int main(void)
+{
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	str2ba("AA:AA:AA:AA:AA:AA", &devices[DEV_A].bdaddr);
+	devices[DEV_A].bdaddr_type = BDADDR_LE_PUBLIC;
+	str2ba("BB:BB:BB:BB:BB:BB", &devices[DEV_B].bdaddr);
+	devices[DEV_B].bdaddr_type = BDADDR_LE_RANDOM;
+
+	mainloop_init();
+
+	ctl = fds[1];
+	mainloop_add_fd(ctl, EPOLLIN, ctl_read, NULL, NULL);
+
+	timeout_add(STEP_MS, run_step, NULL, NULL);
+
+	mainloop_run();
+
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
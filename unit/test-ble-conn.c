@@ -0,0 +1,393 @@
+/*
+ * Follows links to the sensor with a fake controller on a socketpair,
+ * checking that the connection profile is requested once both the ATT
+ * socket is attached and the LE Connection Complete event has been read,
+ * in either order, that it is not requested when the link already uses
+ * it or for other devices, and that nothing is requested once stopped.
+ * getsockopt() is wrapped at link time to hand out connection handles.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/l2cap.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/timeout.h"
+
+#include "ble_conn.h"
+
+/* Time for the commands and events of a step to cross the socketpair */
+#define STEP_MS 50
+
+#define MAX_CMDS 8
+
+/* Parameters of the low power profile, see ble_conn.c */
+#define LOW_POWER_MIN_INTERVAL 80
+#define LOW_POWER_MAX_INTERVAL 160
+#define LOW_POWER_LATENCY 4
+#define LOW_POWER_TIMEOUT 600
+
+#define ATT_FD 1000
+
+struct cmd {
+	uint16_t ocf;
+	le_connection_update_cp cp;
+};
+
+int __real_getsockopt(int fd, int level, int optname, void *optval,
+							socklen_t *optlen);
+
+static bdaddr_t peer;
+static bdaddr_t other;
+static int fds[2];
+static int ctl;
+static int failed;
+
+static struct cmd cmds[MAX_CMDS];
+static unsigned int num_cmds;
+
+/* Handle of the link the ATT socket is on, 0 if it is not connected */
+static uint16_t att_handle;
+
+static unsigned int step;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		printf("step %u: %s failed\n", step, #cond);		\
+		failed = 1;						\
+	}								\
+} while (0)
+
+int __wrap_getsockopt(int fd, int level, int optname, void *optval,
+							socklen_t *optlen)
+{
+	struct l2cap_conninfo *info = optval;
+
+	if (fd != ATT_FD || level != SOL_L2CAP || optname != L2CAP_CONNINFO)
+		return __real_getsockopt(fd, level, optname, optval, optlen);
+
+	if (!att_handle) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	memset(info, 0, *optlen);
+	info->hci_handle = att_handle;
+
+	return 0;
+}
+
+static void send_event(uint8_t event, const void *param, uint8_t len)
+{
+	uint8_t buf[3 + 255];
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = event;
+	buf[2] = len;
+	memcpy(buf + 3, param, len);
+
+	if (write(ctl, buf, 3 + len) != 3 + len) {
+		perror("write event");
+		failed = 1;
+	}
+}
+
+static void send_le_event(uint8_t subevent, const void *param, uint8_t len)
+{
+	uint8_t buf[1 + 254];
+
+	buf[0] = subevent;
+	memcpy(buf + 1, param, len);
+
+	send_event(EVT_LE_META_EVENT, buf, 1 + len);
+}
+
+static void conn_complete(uint16_t handle, const bdaddr_t *bdaddr,
+					uint16_t interval, uint16_t latency,
+					uint16_t timeout)
+{
+	evt_le_connection_complete evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.handle = htobs(handle);
+	bacpy(&evt.peer_bdaddr, bdaddr);
+	evt.interval = htobs(interval);
+	evt.latency = htobs(latency);
+	evt.supervision_timeout = htobs(timeout);
+
+	send_le_event(EVT_LE_CONN_COMPLETE, &evt, sizeof(evt));
+}
+
+static void enhanced_conn_complete(uint16_t handle, const bdaddr_t *bdaddr,
+					uint16_t interval, uint16_t latency,
+					uint16_t timeout)
+{
+	evt_le_enhanced_connection_complete evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.handle = htobs(handle);
+	bacpy(&evt.peer_bdaddr, bdaddr);
+	evt.interval = htobs(interval);
+	evt.latency = htobs(latency);
+	evt.supervision_timeout = htobs(timeout);
+
+	send_le_event(EVT_LE_ENHANCED_CONN_COMPLETE, &evt, sizeof(evt));
+}
+
+/* Accepts every update, with an interval from the middle of the range */
+static void ctl_read(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[3 + 255 + 1];
+	evt_cmd_status cs;
+	evt_le_connection_update_complete uc;
+	struct cmd *cmd;
+	ssize_t len;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 4)
+		return;
+
+	if (buf[0] != HCI_COMMAND_PKT || buf[3] != len - 4 ||
+					num_cmds == MAX_CMDS) {
+		printf("unexpected command packet of %zd bytes\n", len);
+		failed = 1;
+		return;
+	}
+
+	cmd = &cmds[num_cmds++];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->ocf = cmd_opcode_ocf(buf[1] | buf[2] << 8);
+	if (len - 4 >= (ssize_t) sizeof(cmd->cp))
+		memcpy(&cmd->cp, buf + 4, sizeof(cmd->cp));
+
+	cs.status = 0x00;
+	cs.ncmd = 1;
+	cs.opcode = htobs(buf[1] | buf[2] << 8);
+	send_event(EVT_CMD_STATUS, &cs, sizeof(cs));
+
+	if (cmd->ocf != OCF_LE_CONN_UPDATE)
+		return;
+
+	uc.status = 0x00;
+	uc.handle = cmd->cp.handle;
+	uc.interval = htobs((btohs(cmd->cp.min_interval) +
+					btohs(cmd->cp.max_interval)) / 2);
+	uc.latency = cmd->cp.latency;
+	uc.supervision_timeout = cmd->cp.supervision_timeout;
+	send_le_event(EVT_LE_CONN_UPDATE_COMPLETE, &uc, sizeof(uc));
+}
+
+/* The next command asks the link on |handle| for the low power profile */
+static bool update_sent(unsigned int index, uint16_t handle)
+{
+	const struct cmd *cmd = &cmds[index];
+
+	if (index >= num_cmds)
+		return false;
+
+	return cmd->ocf == OCF_LE_CONN_UPDATE &&
+		btohs(cmd->cp.handle) == handle &&
+		btohs(cmd->cp.min_interval) == LOW_POWER_MIN_INTERVAL &&
+		btohs(cmd->cp.max_interval) == LOW_POWER_MAX_INTERVAL &&
+		btohs(cmd->cp.latency) == LOW_POWER_LATENCY &&
+		btohs(cmd->cp.supervision_timeout) == LOW_POWER_TIMEOUT;
+}
+
+/*
+ * Each step checks what the previous one caused, then returns how long to
+ * wait before the next step.
+ */
+static unsigned int step_start(void)
+{
+	check(ble_conn_start_fd(fds[0], &peer, BLE_CONN_PROFILE_LOW_POWER));
+	check(!ble_conn_start_fd(fds[0], &peer, BLE_CONN_PROFILE_LOW_POWER));
+
+	/* The ATT socket is usually attached before the event is read */
+	att_handle = 0x0040;
+	ble_conn_attach(ATT_FD);
+
+	return STEP_MS;
+}
+
+static unsigned int step_attached(void)
+{
+	check(num_cmds == 0);
+
+	conn_complete(0x0041, &other, 24, 0, 72);
+	conn_complete(0x0040, &peer, 24, 0, 72);
+
+	return STEP_MS;
+}
+
+static unsigned int step_connected(void)
+{
+	/* Only for the sensor, and the update complete is taken as is */
+	check(num_cmds == 1);
+	check(update_sent(0, 0x0040));
+
+	ble_conn_add_rtt(30000);
+	ble_conn_detach();
+
+	/* The next link already uses the profile, connected before attach */
+	enhanced_conn_complete(0x0042, &peer, 100, LOW_POWER_LATENCY,
+							LOW_POWER_TIMEOUT);
+
+	return STEP_MS;
+}
+
+static unsigned int step_matching(void)
+{
+	check(num_cmds == 1);
+
+	att_handle = 0x0042;
+	ble_conn_attach(ATT_FD);
+
+	return STEP_MS;
+}
+
+static unsigned int step_matching_attached(void)
+{
+	check(num_cmds == 1);
+
+	ble_conn_detach();
+
+	/* A link the ATT socket is not on yet, then one to another device */
+	att_handle = 0;
+	ble_conn_attach(ATT_FD);
+	conn_complete(0x0043, &peer, 24, 0, 72);
+	conn_complete(0x0044, &other, 24, 0, 72);
+
+	return STEP_MS;
+}
+
+static unsigned int step_not_attached(void)
+{
+	check(num_cmds == 1);
+
+	att_handle = 0x0043;
+	ble_conn_attach(ATT_FD);
+
+	return STEP_MS;
+}
+
+static unsigned int step_event_first(void)
+{
+	check(num_cmds == 2);
+	check(update_sent(1, 0x0043));
+
+	ble_conn_stop();
+	ble_conn_stop();
+
+	/* Stopped, the link is no longer followed */
+	ble_conn_attach(ATT_FD);
+	ble_conn_add_rtt(30000);
+
+	return STEP_MS;
+}
+
+static unsigned int step_stopped(void)
+{
+	check(num_cmds == 2);
+
+	/* The default profile keeps what the link negotiated */
+	check(ble_conn_start_fd(fds[0], &peer, BLE_CONN_PROFILE_DEFAULT));
+	ble_conn_attach(ATT_FD);
+	conn_complete(0x0043, &peer, 24, 0, 72);
+
+	return STEP_MS;
+}
+
+static unsigned int step_default(void)
+{
+	check(num_cmds == 2);
+
+	ble_conn_stop();
+
+	return 0;
+}
+
+static unsigned int (*const steps[])(void) = {
+	step_start,
+	step_attached,
+	step_connected,
+	step_matching,
+	step_matching_attached,
+	step_not_attached,
+	step_event_first,
+	step_stopped,
+	step_default,
+};
+
+static bool run_step(void *user_data)
+{
+	unsigned int delay;
+
+	delay = steps[step]();
+
+	if (++step < sizeof(steps) / sizeof(steps[0]))
+		timeout_add(delay, run_step, NULL, NULL);
+	else
+		mainloop_quit();
+
+	return false;
+}
+
+static void test_profile_names(void)
+{
+	static const struct {
+		const char *str;
+		enum ble_conn_profile profile;
+	} names[] = {
+		{ "", BLE_CONN_PROFILE_DEFAULT },
+		{ "low-latency", BLE_CONN_PROFILE_LOW_LATENCY },
+		{ "balanced", BLE_CONN_PROFILE_BALANCED },
+		{ "low-power", BLE_CONN_PROFILE_LOW_POWER },
+	};
+	enum ble_conn_profile profile;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		check(ble_conn_profile_from_str(names[i].str, &profile));
+		check(profile == names[i].profile);
+	}
+
+	check(!ble_conn_profile_from_str("fast", &profile));
+}
+
+int main(void)
+{
+	test_profile_names();
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	str2ba("AA:BB:CC:DD:EE:FF", &peer);
+	str2ba("11:22:33:44:55:66", &other);
+
+	mainloop_init();
+
+	ctl = fds[1];
+	mainloop_add_fd(ctl, EPOLLIN, ctl_read, NULL, NULL);
+
+	timeout_add(STEP_MS, run_step, NULL, NULL);
+
+	mainloop_run();
+
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
@@ -0,0 +1,324 @@
+/*
+ * Replays recorded LE Advertising Report events to the scanner over a
+ * socketpair, checking the Ruuvi data format 5 and pvvx decoding, that
+ * unchanged payloads are not decoded again, that reports from devices
+ * other than the sensor are ignored, that truncated reports and fields
+ * are dropped, and that stopping disables scanning.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/timeout.h"
+
+#include "ble_client.h"
+#include "ble_scanner.h"
+
+/* Time for the commands and events of a step to cross the socketpair */
+#define STEP_MS 50
+
+#define MAX_CMDS 8
+
+struct cmd {
+	uint16_t ocf;
+	uint8_t param[2];
+};
+
+/* Ruuvi data format 5 test vector: 24.3 C, 53.49 %, 1000.44 hPa */
+static const uint8_t ruuvi_event[] = {
+	0x04, 0x3e, 0x2b, 0x02, 0x01, 0x00, 0x01, 0x0a, 0xcf, 0x21,
+	0x7a, 0x2b, 0xf6, 0x1f, 0x02, 0x01, 0x06, 0x1b, 0xff, 0x99,
+	0x04, 0x05, 0x12, 0xfc, 0x53, 0x94, 0xc3, 0x7c, 0x00, 0x04,
+	0xff, 0xfc, 0x04, 0x0c, 0xac, 0x36, 0x42, 0x00, 0xcd, 0xcb,
+	0xb8, 0x33, 0x4c, 0x88, 0x4f, 0xc4
+};
+
+/* Another device, 25.6 C without humidity and pressure */
+static const uint8_t other_event[] = {
+	0x04, 0x3e, 0x2b, 0x02, 0x01, 0x00, 0x01, 0xe4, 0x60, 0x52,
+	0x33, 0x1d, 0xc8, 0x1f, 0x02, 0x01, 0x06, 0x1b, 0xff, 0x99,
+	0x04, 0x05, 0x14, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x04,
+	0xff, 0xfc, 0x04, 0x0c, 0xac, 0x36, 0x42, 0x00, 0xcd, 0xcb,
+	0xb8, 0x33, 0x4c, 0x88, 0x4f, 0xc4
+};
+
+/* pvvx service data: 23.45 C, 45.67 % */
+static const uint8_t pvvx_event[] = {
+	0x04, 0x3e, 0x22, 0x02, 0x01, 0x00, 0x01, 0x0a, 0xcf, 0x21,
+	0x7a, 0x2b, 0xf6, 0x16, 0x02, 0x01, 0x06, 0x12, 0x16, 0x1a,
+	0x18, 0x0a, 0xcf, 0x21, 0x7a, 0x2b, 0xf6, 0x29, 0x09, 0xd7,
+	0x11, 0x54, 0x0b, 0x57, 0x01, 0x04, 0xc4
+};
+
+/* A Ruuvi report with 24.8 C, then a pvvx report cut short */
+static const uint8_t cut_report_event[] = {
+	0x04, 0x3e, 0x41, 0x02, 0x02, 0x00, 0x01, 0x0a, 0xcf, 0x21,
+	0x7a, 0x2b, 0xf6, 0x1f, 0x02, 0x01, 0x06, 0x1b, 0xff, 0x99,
+	0x04, 0x05, 0x13, 0x60, 0xff, 0xff, 0xff, 0xff, 0x00, 0x04,
+	0xff, 0xfc, 0x04, 0x0c, 0xac, 0x36, 0x42, 0x00, 0xcd, 0xcb,
+	0xb8, 0x33, 0x4c, 0x88, 0x4f, 0xc4, 0x00, 0x01, 0x0a, 0xcf,
+	0x21, 0x7a, 0x2b, 0xf6, 0x16, 0x02, 0x01, 0x06, 0x12, 0x16,
+	0x1a, 0x18, 0x0a, 0xcf, 0x21, 0x7a, 0x2b, 0xf6
+};
+
+/* Ruuvi data too short for format 5, then a field longer than the data */
+static const uint8_t cut_field_event[] = {
+	0x04, 0x3e, 0x15, 0x02, 0x01, 0x00, 0x01, 0x0a, 0xcf, 0x21,
+	0x7a, 0x2b, 0xf6, 0x09, 0x04, 0xff, 0x99, 0x04, 0x05, 0x0a,
+	0xff, 0x99, 0x04, 0xc4
+};
+
+/* The Ruuvi test vector report cut short */
+static const uint8_t cut_data_event[] = {
+	0x04, 0x3e, 0x16, 0x02, 0x01, 0x00, 0x01, 0x0a, 0xcf, 0x21,
+	0x7a, 0x2b, 0xf6, 0x1f, 0x02, 0x01, 0x06, 0x1b, 0xff, 0x99,
+	0x04, 0x05, 0x12, 0xfc, 0x53
+};
+
+static bdaddr_t sensor;
+static int fds[2];
+static int ctl;
+static int failed;
+
+static struct cmd cmds[MAX_CMDS];
+static unsigned int num_cmds;
+
+static unsigned int temp_updates, humid_updates, press_updates;
+static float temperature, humidity, pressure;
+
+static unsigned int step;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		printf("step %u: %s failed\n", step, #cond);		\
+		failed = 1;						\
+	}								\
+} while (0)
+
+/* Replace the GATT client's state, which the scanner feeds */
+void ble_set_temperature(float celsius)
+{
+	temperature = celsius;
+	temp_updates++;
+}
+
+void ble_set_humidity(float rh)
+{
+	humidity = rh;
+	humid_updates++;
+}
+
+void ble_set_pressure(float hpa)
+{
+	pressure = hpa;
+	press_updates++;
+}
+
+static bool near(float value, float expected)
+{
+	return value - expected < 0.001f && expected - value < 0.001f;
+}
+
+static void replay(const uint8_t *event, size_t len)
+{
+	if (write(ctl, event, len) != (ssize_t) len) {
+		perror("write event");
+		failed = 1;
+	}
+}
+
+static void ctl_read(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[3 + 255 + 1];
+	uint8_t cc[] = { HCI_EVENT_PKT, EVT_CMD_COMPLETE, 4, 1, 0, 0, 0x00 };
+	struct cmd *cmd;
+	ssize_t len;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 4)
+		return;
+
+	if (buf[0] != HCI_COMMAND_PKT || buf[3] != len - 4 || len < 6 ||
+					num_cmds == MAX_CMDS) {
+		printf("unexpected command packet of %zd bytes\n", len);
+		failed = 1;
+		return;
+	}
+
+	cmd = &cmds[num_cmds++];
+	cmd->ocf = cmd_opcode_ocf(buf[1] | buf[2] << 8);
+	memcpy(cmd->param, buf + 4, 2);
+
+	cc[4] = buf[1];
+	cc[5] = buf[2];
+	replay(cc, sizeof(cc));
+}
+
+/*
+ * Each step checks what the previous one caused, then returns how long to
+ * wait before the next step.
+ */
+static unsigned int step_start(void)
+{
+	check(ble_scanner_start_fd(fds[0], &sensor));
+	check(!ble_scanner_start_fd(fds[0], &sensor));
+
+	return STEP_MS;
+}
+
+static unsigned int step_scanning(void)
+{
+	/* Passive scan, keeping duplicates */
+	check(num_cmds == 2);
+	check(cmds[0].ocf == OCF_LE_SET_SCAN_PARAMETERS);
+	check(cmds[0].param[0] == 0x00);
+	check(cmds[1].ocf == OCF_LE_SET_SCAN_ENABLE);
+	check(cmds[1].param[0] == 0x01 && cmds[1].param[1] == 0x00);
+
+	replay(ruuvi_event, sizeof(ruuvi_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_ruuvi(void)
+{
+	check(temp_updates == 1 && near(temperature, 24.3f));
+	check(humid_updates == 1 && near(humidity, 53.49f));
+	check(press_updates == 1 && near(pressure, 1000.44f));
+
+	/* Same payload again, and one from another device */
+	replay(ruuvi_event, sizeof(ruuvi_event));
+	replay(other_event, sizeof(other_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_filtered(void)
+{
+	check(temp_updates == 1 && humid_updates == 1 && press_updates == 1);
+
+	replay(pvvx_event, sizeof(pvvx_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_pvvx(void)
+{
+	check(temp_updates == 2 && near(temperature, 23.45f));
+	check(humid_updates == 2 && near(humidity, 45.67f));
+	check(press_updates == 1);
+
+	replay(cut_report_event, sizeof(cut_report_event));
+	replay(cut_field_event, sizeof(cut_field_event));
+	replay(cut_data_event, sizeof(cut_data_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_truncated(void)
+{
+	/* Only the complete report, without humidity and pressure */
+	check(temp_updates == 3 && near(temperature, 24.8f));
+	check(humid_updates == 2 && press_updates == 1);
+
+	ble_scanner_stop();
+	ble_scanner_stop();
+
+	replay(other_event, sizeof(other_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_stopped(void)
+{
+	check(num_cmds == 3);
+	check(cmds[2].ocf == OCF_LE_SET_SCAN_ENABLE);
+	check(cmds[2].param[0] == 0x00);
+	check(temp_updates == 3);
+
+	/* Any device this time */
+	check(ble_scanner_start_fd(fds[0], NULL));
+	replay(other_event, sizeof(other_event));
+
+	return STEP_MS;
+}
+
+static unsigned int step_any(void)
+{
+	check(num_cmds == 5);
+	check(temp_updates == 4 && near(temperature, 25.6f));
+
+	ble_scanner_stop();
+
+	return STEP_MS;
+}
+
+static unsigned int step_done(void)
+{
+	check(num_cmds == 6);
+	check(cmds[5].ocf == OCF_LE_SET_SCAN_ENABLE);
+	check(cmds[5].param[0] == 0x00);
+
+	return 0;
+}
+
+static unsigned int (*const steps[])(void) = {
+	step_start,
+	step_scanning,
+	step_ruuvi,
+	step_filtered,
+	step_pvvx,
+	step_truncated,
+	step_stopped,
+	step_any,
+	step_done,
+};
+
+static bool run_step(void *user_data)
+{
+	unsigned int delay;
+
+	delay = steps[step]();
+
+	if (++step < sizeof(steps) / sizeof(steps[0]))
+		timeout_add(delay, run_step, NULL, NULL);
+	else
+		mainloop_quit();
+
+	return false;
+}
+
+int main(void)
+{
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	str2ba("F6:2B:7A:21:CF:0A", &sensor);
+
+	mainloop_init();
+
+	ctl = fds[1];
+	mainloop_add_fd(ctl, EPOLLIN, ctl_read, NULL, NULL);
+
+	timeout_add(STEP_MS, run_step, NULL, NULL);
+
+	mainloop_run();
+
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
@@ -0,0 +1,253 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Serves a characteristic backed by callbacks and one stored in the database
+ * from a sharded GATT server to a set of bearers on socketpairs, checking
+ * that every bearer gets answers, that stored values are read back through
+ * Read By Group Type and Read By Type, that writes run on the owner shard
+ * without a bt_att from another shard, and that the server shuts down with a
+ * write still in flight.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+#include "src/shared/gatt-shard.h"
+
+#define NUM_SHARDS 4
+#define NUM_CONNS 8
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t shard_thread[NUM_SHARDS];
+static bool shard_seen[NUM_SHARDS];
+static uint8_t value;
+static unsigned int writes;
+static unsigned int foreign_writes;
+static bool write_off_owner;
+
+static void attach_cb(struct bt_gatt_server *server, unsigned int shard,
+							void *user_data)
+{
+	pthread_mutex_lock(&lock);
+	shard_thread[shard] = pthread_self();
+	shard_seen[shard] = true;
+	pthread_mutex_unlock(&lock);
+}
+
+static void value_read(struct gatt_db_attribute *attrib, unsigned int id,
+					uint16_t offset, uint8_t opcode,
+					struct bt_att *att, void *user_data)
+{
+	uint8_t v;
+
+	pthread_mutex_lock(&lock);
+	v = value;
+	pthread_mutex_unlock(&lock);
+
+	gatt_db_attribute_read_result(attrib, id, 0, &v, sizeof(v));
+}
+
+static void value_write(struct gatt_db_attribute *attrib, unsigned int id,
+					uint16_t offset, const uint8_t *data,
+					size_t len, uint8_t opcode,
+					struct bt_att *att, void *user_data)
+{
+	pthread_mutex_lock(&lock);
+
+	if (!pthread_equal(pthread_self(), shard_thread[0]))
+		write_off_owner = true;
+
+	if (len == 1)
+		value = data[0];
+
+	writes++;
+	if (!att)
+		foreign_writes++;
+
+	pthread_mutex_unlock(&lock);
+
+	gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static void stored_write(struct gatt_db_attribute *attrib, int err,
+							void *user_data)
+{
+}
+
+static ssize_t transact(int fd, const uint8_t *pdu, size_t len,
+						uint8_t *rsp, size_t rsp_len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (write(fd, pdu, len) != (ssize_t) len)
+		return -1;
+
+	if (poll(&pfd, 1, 2000) != 1)
+		return -1;
+
+	return read(fd, rsp, rsp_len);
+}
+
+int main(void)
+{
+	struct bt_gatt_shards *shards;
+	struct gatt_db *db;
+	struct gatt_db_attribute *svc, *chrc, *stored;
+	static const uint8_t stored_value[] = { 's', 't', 'o', 'r', 'e', 'd' };
+	bt_uuid_t uuid;
+	int fds[NUM_CONNS][2];
+	uint16_t handle, stored_handle, svc_end;
+	unsigned int i, total = 0, used = 0;
+	int failed = 0;
+
+	db = gatt_db_new();
+
+	bt_uuid16_create(&uuid, 0xfff0);
+	svc = gatt_db_add_service(db, &uuid, true, 5);
+
+	bt_uuid16_create(&uuid, 0xfff1);
+	chrc = gatt_db_service_add_characteristic(svc, &uuid,
+				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+				BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_WRITE,
+				value_read, value_write, NULL);
+
+	bt_uuid16_create(&uuid, 0xfff2);
+	stored = gatt_db_service_add_characteristic(svc, &uuid,
+						BT_ATT_PERM_READ,
+						BT_GATT_CHRC_PROP_READ,
+						NULL, NULL, NULL);
+	gatt_db_attribute_write(stored, 0, stored_value, sizeof(stored_value),
+					0, NULL, stored_write, NULL);
+
+	gatt_db_service_set_active(svc, true);
+	gatt_db_attribute_get_service_handles(svc, NULL, &svc_end);
+	handle = gatt_db_attribute_get_handle(chrc);
+	stored_handle = gatt_db_attribute_get_handle(stored);
+
+	shards = bt_gatt_shards_new(db, NUM_SHARDS, 0, 0);
+	bt_gatt_shards_set_attach_handler(shards, attach_cb, NULL, NULL);
+	bt_gatt_shards_start(shards);
+
+	/* Non-L2CAP descriptors are spread over the shards by number */
+	for (i = 0; i < NUM_CONNS; i++) {
+		socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds[i]);
+		bt_gatt_shards_attach(shards, fds[i][0]);
+	}
+
+	for (i = 0; i < NUM_CONNS; i++) {
+		uint8_t wr[] = { BT_ATT_OP_WRITE_REQ, handle & 0xff,
+						handle >> 8, 0x40 + i };
+		uint8_t rd[] = { BT_ATT_OP_READ_REQ, handle & 0xff,
+						handle >> 8 };
+		uint8_t rsp[16];
+
+		if (transact(fds[i][1], wr, sizeof(wr), rsp, sizeof(rsp)) != 1 ||
+					rsp[0] != BT_ATT_OP_WRITE_RSP) {
+			printf("conn %u: no write response\n", i);
+			failed = 1;
+		}
+
+		if (transact(fds[i][1], rd, sizeof(rd), rsp, sizeof(rsp)) != 2 ||
+					rsp[0] != BT_ATT_OP_READ_RSP ||
+					rsp[1] != 0x40 + i) {
+			printf("conn %u: read did not see the write\n", i);
+			failed = 1;
+		}
+	}
+
+	/* Values stored in the shared database are read from a snapshot */
+	for (i = 0; i < NUM_CONNS; i++) {
+		uint8_t grp[] = { BT_ATT_OP_READ_BY_GRP_TYPE_REQ, 0x01, 0x00,
+						0xff, 0xff, 0x00, 0x28 };
+		uint8_t type[] = { BT_ATT_OP_READ_BY_TYPE_REQ, 0x01, 0x00,
+						0xff, 0xff, 0xf2, 0xff };
+		uint8_t rsp[32];
+
+		if (transact(fds[i][1], grp, sizeof(grp), rsp, sizeof(rsp)) != 8 ||
+				rsp[0] != BT_ATT_OP_READ_BY_GRP_TYPE_RSP ||
+				rsp[1] != 6 || get_le16(rsp + 2) != 0x0001 ||
+				get_le16(rsp + 4) != svc_end ||
+				get_le16(rsp + 6) != 0xfff0) {
+			printf("conn %u: bad Read By Group Type response\n", i);
+			failed = 1;
+		}
+
+		if (transact(fds[i][1], type, sizeof(type), rsp, sizeof(rsp)) !=
+					4 + (ssize_t) sizeof(stored_value) ||
+				rsp[0] != BT_ATT_OP_READ_BY_TYPE_RSP ||
+				rsp[1] != 2 + sizeof(stored_value) ||
+				get_le16(rsp + 2) != stored_handle ||
+				memcmp(rsp + 4, stored_value,
+						sizeof(stored_value))) {
+			printf("conn %u: bad Read By Type response\n", i);
+			failed = 1;
+		}
+	}
+
+	for (i = 0; i < NUM_SHARDS; i++) {
+		total += bt_gatt_shards_get_connections(shards, i);
+		used += shard_seen[i];
+	}
+
+	printf("%u connections on %u shards, %u writes, %u from other shards\n",
+						total, used, writes,
+						foreign_writes);
+
+	if (total != NUM_CONNS || used < 2 || writes != NUM_CONNS ||
+					!foreign_writes || write_off_owner) {
+		printf("unexpected distribution of work\n");
+		failed = 1;
+	}
+
+	/* Leave a write from every bearer in flight across the shutdown */
+	for (i = 0; i < NUM_CONNS; i++) {
+		uint8_t wr[] = { BT_ATT_OP_WRITE_REQ, handle & 0xff,
+						handle >> 8, 0 };
+
+		if (write(fds[i][1], wr, sizeof(wr)) < 0)
+			failed = 1;
+	}
+
+	bt_gatt_shards_free(shards);
+	gatt_db_unref(db);
+
+	for (i = 0; i < NUM_CONNS; i++)
+		close(fds[i][1]);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}
@@ -0,0 +1,453 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Runs the HCI command engine against a fake controller on a socketpair,
+ * checking that commands only go out while there are command credits,
+ * that completions are matched by opcode in the order commands were sent,
+ * that Command Status completes a command, that cancelled commands never
+ * call back, that a command the controller never answers times out and
+ * gives its credit back, and that events reach the handlers registered
+ * for them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "src/shared/util.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/timeout.h"
+#include "src/shared/hci.h"
+
+#define OP_A 0x2001
+#define OP_B 0x200b
+#define OP_C 0x2005
+#define OP_STATUS 0x0405
+#define OP_SILENT 0x0c03
+
+/* Time for the commands and events of a step to cross the socketpair */
+#define STEP_MS 50
+
+/* Longer than the command timeout in hci.c */
+#define CMD_TIMEOUT_MS 2500
+
+#define MAX_CMDS 16
+
+struct result {
+	bool called;
+	bool destroyed;
+	bool timed_out;
+	unsigned int order;
+	uint8_t size;
+	uint8_t data[8];
+};
+
+static struct bt_hci *hci;
+static int ctl;
+static int failed;
+
+static struct result results[MAX_CMDS];
+static unsigned int ids[MAX_CMDS];
+static unsigned int num_calls;
+
+/* Opcode and first parameter byte of each command the controller read */
+static uint16_t sent_op[MAX_CMDS];
+static uint8_t sent_param[MAX_CMDS];
+static unsigned int num_sent;
+
+static unsigned int meta_events, meta_events2, disconn_events;
+static uint8_t meta_data[8];
+static uint8_t meta_size;
+static unsigned int disconn_id;
+
+static unsigned int step;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		printf("step %u: %s failed\n", step, #cond);		\
+		failed = 1;						\
+	}								\
+} while (0)
+
+static void cmd_cb(const void *data, uint8_t size, void *user_data)
+{
+	struct result *res = &results[PTR_TO_UINT(user_data)];
+
+	res->called = true;
+	res->order = ++num_calls;
+	res->timed_out = !data;
+	res->size = size;
+
+	if (data)
+		memcpy(res->data, data, size < 8 ? size : 8);
+}
+
+static void cmd_destroy(void *user_data)
+{
+	struct result *res = &results[PTR_TO_UINT(user_data)];
+
+	if (res->destroyed) {
+		printf("command %u destroyed twice\n", PTR_TO_UINT(user_data));
+		failed = 1;
+	}
+
+	res->destroyed = true;
+}
+
+static void send_cmd(unsigned int n, uint16_t opcode, uint8_t param)
+{
+	ids[n] = bt_hci_send(hci, opcode, &param, 1, cmd_cb, UINT_TO_PTR(n),
+								cmd_destroy);
+	if (!ids[n]) {
+		printf("sending command %u failed\n", n);
+		failed = 1;
+	}
+}
+
+static void send_event(uint8_t event, const void *param, uint8_t len,
+								uint8_t plen)
+{
+	uint8_t buf[3 + 255];
+
+	buf[0] = HCI_EVENT_PKT;
+	buf[1] = event;
+	buf[2] = plen;
+	memcpy(buf + 3, param, len);
+
+	if (write(ctl, buf, 3 + len) != 3 + len) {
+		perror("write event");
+		failed = 1;
+	}
+}
+
+static void complete(uint16_t opcode, uint8_t ncmd, uint8_t ret)
+{
+	uint8_t param[5] = { ncmd, opcode & 0xff, opcode >> 8, 0x00, ret };
+
+	send_event(EVT_CMD_COMPLETE, param, sizeof(param), sizeof(param));
+}
+
+static void status(uint16_t opcode, uint8_t ncmd, uint8_t st)
+{
+	uint8_t param[4] = { st, ncmd, opcode & 0xff, opcode >> 8 };
+
+	send_event(EVT_CMD_STATUS, param, sizeof(param), sizeof(param));
+}
+
+static void ctl_read(int fd, uint32_t events, void *user_data)
+{
+	uint8_t buf[3 + 255 + 1];
+	ssize_t len;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len < 0)
+		return;
+
+	if (len != 5 || buf[0] != HCI_COMMAND_PKT || buf[3] != 1 ||
+						num_sent == MAX_CMDS) {
+		printf("unexpected command packet of %zd bytes\n", len);
+		failed = 1;
+		return;
+	}
+
+	sent_op[num_sent] = buf[1] | buf[2] << 8;
+	sent_param[num_sent] = buf[4];
+	num_sent++;
+}
+
+static void meta_cb(const void *data, uint8_t size, void *user_data)
+{
+	meta_events++;
+	meta_size = size;
+	memcpy(meta_data, data, size < 8 ? size : 8);
+}
+
+static void meta_cb2(const void *data, uint8_t size, void *user_data)
+{
+	meta_events2++;
+}
+
+static void disconn_cb(const void *data, uint8_t size, void *user_data)
+{
+	disconn_events++;
+}
+
+/*
+ * Each step checks what the previous one caused, then returns how long to
+ * wait before the next step.
+ */
+static unsigned int step_credits(void)
+{
+	/* One credit to start with, the rest wait */
+	send_cmd(0, OP_A, 0);
+	send_cmd(1, OP_B, 1);
+	send_cmd(2, OP_B, 2);
+	send_cmd(3, OP_C, 3);
+
+	return STEP_MS;
+}
+
+static unsigned int step_credits_given(void)
+{
+	check(num_sent == 1);
+	check(sent_op[0] == OP_A);
+	check(!results[0].called);
+
+	complete(OP_A, 3, 0xa0);
+
+	return STEP_MS;
+}
+
+static unsigned int step_out_of_order(void)
+{
+	check(results[0].called && results[0].size == 2);
+	check(results[0].data[0] == 0x00 && results[0].data[1] == 0xa0);
+	check(results[0].destroyed);
+
+	check(num_sent == 4);
+	check(sent_op[1] == OP_B && sent_param[1] == 1);
+	check(sent_op[2] == OP_B && sent_param[2] == 2);
+	check(sent_op[3] == OP_C && sent_param[3] == 3);
+
+	/* An opcode nobody sent and a credit only update are ignored */
+	complete(0x2099, 1, 0xee);
+	complete(0x0000, 1, 0xee);
+
+	complete(OP_C, 1, 0xc3);
+	complete(OP_B, 1, 0xb1);
+	complete(OP_B, 1, 0xb2);
+
+	return STEP_MS;
+}
+
+static unsigned int step_status(void)
+{
+	check(results[3].called && results[3].data[1] == 0xc3);
+	check(results[1].called && results[1].data[1] == 0xb1);
+	check(results[2].called && results[2].data[1] == 0xb2);
+	check(results[3].order < results[1].order);
+	check(results[1].order < results[2].order);
+	check(num_calls == 4);
+
+	send_cmd(4, OP_STATUS, 4);
+
+	return STEP_MS;
+}
+
+static unsigned int step_status_sent(void)
+{
+	check(num_sent == 5 && sent_op[4] == OP_STATUS);
+
+	status(OP_STATUS, 2, 0x0c);
+
+	return STEP_MS;
+}
+
+static unsigned int step_cancel(void)
+{
+	check(results[4].called && results[4].size == 1);
+	check(results[4].data[0] == 0x0c);
+
+	/* With two credits the third command stays queued */
+	send_cmd(5, OP_A, 5);
+	send_cmd(6, OP_A, 6);
+	send_cmd(7, OP_A, 7);
+
+	return STEP_MS;
+}
+
+static unsigned int step_cancel_sent(void)
+{
+	check(num_sent == 7);
+	check(sent_param[5] == 5 && sent_param[6] == 6);
+
+	check(bt_hci_cancel(hci, ids[7]));
+	check(results[7].destroyed);
+	check(bt_hci_cancel(hci, ids[5]));
+	check(results[5].destroyed);
+	check(!bt_hci_cancel(hci, ids[7]));
+	check(!bt_hci_cancel(hci, ids[0]));
+
+	/* Completes command 5, which must not be taken for command 6 */
+	complete(OP_A, 0, 0xa5);
+
+	return STEP_MS;
+}
+
+static unsigned int step_cancel_complete(void)
+{
+	check(!results[5].called && !results[6].called);
+
+	complete(OP_A, 1, 0xa6);
+
+	return STEP_MS;
+}
+
+static unsigned int step_timeout(void)
+{
+	check(results[6].called && results[6].data[1] == 0xa6);
+	check(!results[7].called);
+
+	/* The queued command was cancelled before it was sent */
+	check(num_sent == 7);
+
+	/* Never answered, the command behind it waits for the timeout */
+	send_cmd(8, OP_SILENT, 8);
+	send_cmd(9, OP_A, 9);
+
+	return STEP_MS;
+}
+
+static unsigned int step_timeout_wait(void)
+{
+	check(num_sent == 8 && sent_op[7] == OP_SILENT);
+
+	return CMD_TIMEOUT_MS;
+}
+
+static unsigned int step_timeout_expired(void)
+{
+	check(results[8].called && results[8].timed_out);
+	check(results[8].size == 0 && results[8].destroyed);
+	check(num_sent == 9 && sent_param[8] == 9);
+
+	complete(OP_A, 1, 0xa9);
+
+	return STEP_MS;
+}
+
+static unsigned int step_events(void)
+{
+	static const uint8_t meta[] = { 0x02, 0x01, 0x02 };
+	static const uint8_t disconn[] = { 0x00, 0x40, 0x00, 0x13 };
+
+	check(results[9].called && results[9].data[1] == 0xa9);
+
+	check(bt_hci_register(hci, EVT_LE_META_EVENT, meta_cb, NULL, NULL));
+	check(bt_hci_register(hci, EVT_LE_META_EVENT, meta_cb2, NULL, NULL));
+	disconn_id = bt_hci_register(hci, EVT_DISCONN_COMPLETE, disconn_cb,
+								NULL, NULL);
+	check(disconn_id);
+	check(bt_hci_unregister(hci, disconn_id));
+	check(!bt_hci_unregister(hci, disconn_id));
+
+	send_event(EVT_LE_META_EVENT, meta, sizeof(meta), sizeof(meta));
+	send_event(EVT_DISCONN_COMPLETE, disconn, sizeof(disconn),
+							sizeof(disconn));
+
+	/* Parameter length does not match the packet, dropped */
+	send_event(EVT_LE_META_EVENT, meta, sizeof(meta), sizeof(meta) + 2);
+
+	return STEP_MS;
+}
+
+static unsigned int step_events_seen(void)
+{
+	check(meta_events == 1 && meta_events2 == 1);
+	check(meta_size == 3 && !memcmp(meta_data, "\x02\x01\x02", 3));
+	check(disconn_events == 0);
+
+	return 0;
+}
+
+static unsigned int (*const steps[])(void) = {
+	step_credits,
+	step_credits_given,
+	step_out_of_order,
+	step_status,
+	step_status_sent,
+	step_cancel,
+	step_cancel_sent,
+	step_cancel_complete,
+	step_timeout,
+	step_timeout_wait,
+	step_timeout_expired,
+	step_events,
+	step_events_seen,
+};
+
+static bool run_step(void *user_data)
+{
+	unsigned int delay, i;
+
+	delay = steps[step]();
+
+	if (++step < sizeof(steps) / sizeof(steps[0])) {
+		timeout_add(delay, run_step, NULL, NULL);
+		return false;
+	}
+
+	bt_hci_unref(hci);
+
+	for (i = 0; i < 10; i++) {
+		if (!results[i].destroyed) {
+			printf("command %u not destroyed\n", i);
+			failed = 1;
+		}
+	}
+
+	mainloop_quit();
+
+	return false;
+}
+
+int main(void)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	mainloop_init();
+
+	hci = bt_hci_new(fds[0]);
+	if (!hci) {
+		printf("failed to create HCI\n");
+		return 1;
+	}
+
+	bt_hci_set_close_on_unref(hci, true);
+
+	ctl = fds[1];
+	mainloop_add_fd(ctl, EPOLLIN, ctl_read, NULL, NULL);
+
+	timeout_add(STEP_MS, run_step, NULL, NULL);
+
+	mainloop_run();
+
+	mainloop_remove_fd(ctl);
+	close(ctl);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+
+	return failed;
+}